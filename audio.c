@@ -0,0 +1,371 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "audio.h"
+#include "chip8_internal.h"
+
+/* Events are stamped with guest time in 1/65536 of a timer tick. */
+#define TIME_SHIFT 16
+#define RING_SIZE 1024
+#define CACHE_LINE 64
+#define AMPLITUDE 8000
+#define CHUNK 512
+/* How long the thread sleeps when there is nothing to render. */
+#define IDLE_NS 2000000
+
+enum event_type {
+  EVENT_ON,
+  EVENT_OFF,
+  EVENT_PITCH,
+  EVENT_PATTERN,
+  EVENT_END,
+};
+
+struct event {
+  uint64_t time;
+  uint8_t type;   /* enum event_type */
+  uint8_t pitch;
+  uint8_t pattern[16];
+};
+
+struct chip8_audio {
+  struct event ring[RING_SIZE];
+  /* Written by the emulation thread only. head is read by the other, on its
+     own cache line so that the two threads do not share one. */
+  size_t head;
+  uint64_t ticks;     /* Timer ticks since first attached */
+  bool sounding;      /* Whether the last event sent was EVENT_ON */
+  uint64_t dropped;
+  char pad[CACHE_LINE];
+  /* Written by the thread rendering only. */
+  size_t tail;
+  uint64_t samples;
+  bool failed;
+  bool on;
+  uint8_t pitch;
+  uint8_t pattern[16];
+  double phase;       /* Position in the pattern, in bits */
+  char pad2[CACHE_LINE];
+  struct chip8_audio_sink sink;
+  unsigned rate;
+  pthread_t thread;
+};
+
+/* The buzzer sounded until an XO-CHIP program loads its own pattern. */
+static const uint8_t square_wave[16] = {
+  0xFF, 0x00, 0xFF, 0x00, 0xFF, 0x00, 0xFF, 0x00,
+  0xFF, 0x00, 0xFF, 0x00, 0xFF, 0x00, 0xFF, 0x00,
+};
+
+/* Queues an event. Returns false if the ring is full. */
+static bool push(chip8_audio *a, const struct event *e)
+{
+  size_t tail = __atomic_load_n(&a->tail, __ATOMIC_ACQUIRE);
+  if (a->head - tail == RING_SIZE) {
+    return false;
+  }
+  a->ring[a->head % RING_SIZE] = *e;
+  __atomic_store_n(&a->head, a->head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+static uint64_t now(const chip8 *c8)
+{
+  return (c8->audio->ticks << TIME_SHIFT)
+         + ((uint64_t) c8->tick_cycles << TIME_SHIFT) / c8->cycles_per_tick;
+}
+
+static void send(chip8 *c8, uint64_t time, enum event_type type)
+{
+  struct event e = { .time = time, .type = type, .pitch = c8->pitch };
+  if (type == EVENT_PATTERN) {
+    memcpy(e.pattern, c8->pattern, sizeof(e.pattern));
+  }
+  if (!push(c8->audio, &e)) {
+    ++c8->audio->dropped;
+  } else if (type == EVENT_ON || type == EVENT_OFF) {
+    c8->audio->sounding = type == EVENT_ON;
+  }
+}
+
+void chip8_audio_sound(chip8 *c8)
+{
+  if ((c8->sound_timer > 0) != c8->audio->sounding) {
+    send(c8, now(c8), c8->sound_timer > 0 ? EVENT_ON : EVENT_OFF);
+  }
+}
+
+void chip8_audio_ticked(chip8 *c8, uint64_t n, uint8_t sound_before)
+{
+  chip8_audio *a = c8->audio;
+  uint64_t first = a->ticks;
+  a->ticks += n;
+  if (a->sounding && sound_before > 0 && sound_before <= n) {
+    send(c8, (first + sound_before) << TIME_SHIFT, EVENT_OFF);
+  }
+  /* Puts right what dropped events or a restore left wrong. */
+  chip8_audio_sound(c8);
+}
+
+void chip8_audio_pitch(chip8 *c8)
+{
+  send(c8, now(c8), EVENT_PITCH);
+}
+
+void chip8_audio_pattern(chip8 *c8)
+{
+  send(c8, now(c8), EVENT_PATTERN);
+}
+
+void chip8_audio_attach(chip8 *c8, chip8_audio *a)
+{
+  c8->audio = a;
+  if (a) {
+    chip8_audio_sound(c8);
+  }
+}
+
+static void write_samples(chip8_audio *a, const int16_t *samples, size_t n)
+{
+  if (!a->failed && !a->sink.write(a->sink.ctx, samples, n)) {
+    a->failed = true;
+  }
+  __atomic_store_n(&a->samples, a->samples + n, __ATOMIC_RELAXED);
+}
+
+/* Renders the sound up to the given guest time. */
+static void render(chip8_audio *a, uint64_t time)
+{
+  uint64_t end = (time * a->rate) / ((uint64_t) CHIP8_TIMER_HZ << TIME_SHIFT);
+  /* Bits of the pattern played per sample. */
+  double step = 4000.0 * pow(2.0, (a->pitch - 64) / 48.0) / a->rate;
+  int16_t buf[CHUNK];
+
+  while (a->samples < end) {
+    size_t n = end - a->samples < CHUNK ? end - a->samples : CHUNK;
+    for (size_t i = 0; i < n; ++i) {
+      if (!a->on) {
+        buf[i] = 0;
+        continue;
+      }
+      unsigned bit = (unsigned) a->phase;
+      bool set = (a->pattern[bit / 8] >> (7 - bit % 8)) & 1;
+      buf[i] = set ? AMPLITUDE : -AMPLITUDE;
+      a->phase += step;
+      if (a->phase >= 128) {
+        a->phase -= 128;
+      }
+    }
+    write_samples(a, buf, n);
+  }
+}
+
+static void *consume(void *arg)
+{
+  chip8_audio *a = arg;
+  for (;;) {
+    size_t head = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE);
+    if (a->tail == head) {
+      struct timespec idle = { 0, IDLE_NS };
+      nanosleep(&idle, NULL);
+      continue;
+    }
+    struct event e = a->ring[a->tail % RING_SIZE];
+    __atomic_store_n(&a->tail, a->tail + 1, __ATOMIC_RELEASE);
+    render(a, e.time);
+    switch (e.type) {
+    case EVENT_ON:
+      a->on = true;
+      a->phase = 0;
+      break;
+    case EVENT_OFF:
+      a->on = false;
+      break;
+    case EVENT_PITCH:
+      a->pitch = e.pitch;
+      break;
+    case EVENT_PATTERN:
+      memcpy(a->pattern, e.pattern, sizeof(a->pattern));
+      break;
+    case EVENT_END:
+      return NULL;
+    }
+  }
+}
+
+chip8_audio *chip8_audio_open(const struct chip8_audio_sink *sink,
+                              unsigned rate)
+{
+  chip8_audio *a = calloc(1, sizeof(*a));
+  if (!a) {
+    return NULL;
+  }
+  a->sink = *sink;
+  a->rate = rate;
+  a->pitch = 64;
+  memcpy(a->pattern, square_wave, sizeof(a->pattern));
+  if (pthread_create(&a->thread, NULL, consume, a) != 0) {
+    sink->close(sink->ctx);
+    free(a);
+    return NULL;
+  }
+  return a;
+}
+
+bool chip8_audio_close(chip8_audio *a)
+{
+  struct event end = { .time = a->ticks << TIME_SHIFT, .type = EVENT_END };
+  while (!push(a, &end)) {
+    struct timespec wait = { 0, IDLE_NS };
+    nanosleep(&wait, NULL);
+  }
+  pthread_join(a->thread, NULL);
+  bool ok = a->sink.close(a->sink.ctx) && !a->failed;
+  free(a);
+  return ok;
+}
+
+uint64_t chip8_audio_dropped(const chip8_audio *a)
+{
+  return a->dropped;
+}
+
+uint64_t chip8_audio_samples(const chip8_audio *a)
+{
+  return __atomic_load_n(&a->samples, __ATOMIC_RELAXED);
+}
+
+/* Writes little-endian numbers to a WAV file. */
+static void put_le(FILE *f, uint32_t v, int nbytes)
+{
+  for (int i = 0; i < nbytes; ++i) {
+    fputc((v >> (8 * i)) & 0xFF, f);
+  }
+}
+
+struct wav {
+  FILE *f;
+  uint32_t bytes;   /* Of samples written */
+};
+
+static bool wav_write(void *ctx, const int16_t *samples, size_t n)
+{
+  struct wav *w = ctx;
+  if (n > (UINT32_MAX - 36 - w->bytes) / 2) {
+    return false;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    put_le(w->f, (uint16_t) samples[i], 2);
+  }
+  w->bytes += 2 * n;
+  return !ferror(w->f);
+}
+
+/* Fills in the sizes left blank in the header. */
+static bool wav_close(void *ctx)
+{
+  struct wav *w = ctx;
+  bool ok = fseek(w->f, 4, SEEK_SET) == 0;
+  put_le(w->f, 36 + w->bytes, 4);
+  ok &= fseek(w->f, 40, SEEK_SET) == 0;
+  put_le(w->f, w->bytes, 4);
+  ok &= !ferror(w->f);
+  ok &= fclose(w->f) == 0;
+  free(w);
+  return ok;
+}
+
+bool chip8_audio_wav_sink(struct chip8_audio_sink *sink, const char *path,
+                          unsigned rate)
+{
+  struct wav *w = malloc(sizeof(*w));
+  if (!w) {
+    return false;
+  }
+  w->f = fopen(path, "wb");
+  if (!w->f) {
+    free(w);
+    return false;
+  }
+  w->bytes = 0;
+  /* RIFF header and a PCM format chunk: 1 channel of 16-bit samples. */
+  fputs("RIFF", w->f);
+  put_le(w->f, 0, 4);
+  fputs("WAVEfmt ", w->f);
+  put_le(w->f, 16, 4);
+  put_le(w->f, 1, 2);
+  put_le(w->f, 1, 2);
+  put_le(w->f, rate, 4);
+  put_le(w->f, 2 * rate, 4);
+  put_le(w->f, 2, 2);
+  put_le(w->f, 16, 2);
+  fputs("data", w->f);
+  put_le(w->f, 0, 4);
+  sink->write = wav_write;
+  sink->close = wav_close;
+  sink->ctx = w;
+  return true;
+}
+
+static bool null_write(void *ctx, const int16_t *samples, size_t n)
+{
+  (void) ctx;
+  (void) samples;
+  (void) n;
+  return true;
+}
+
+static bool null_close(void *ctx)
+{
+  (void) ctx;
+  return true;
+}
+
+void chip8_audio_null_sink(struct chip8_audio_sink *sink)
+{
+  sink->write = null_write;
+  sink->close = null_close;
+  sink->ctx = NULL;
+}
+
+/* Silence is the only sample that is 0, so a sound starts at the first
+   nonzero sample after a zero one. */
+static bool bell_write(void *ctx, const int16_t *samples, size_t n)
+{
+  bool *sounding = ctx;
+  bool rang = false;
+  for (size_t i = 0; i < n; ++i) {
+    if (samples[i] != 0 && !*sounding) {
+      rang = true;
+    }
+    *sounding = samples[i] != 0;
+  }
+  if (rang) {
+    printf("\a");
+    fflush(stdout);
+  }
+  return true;
+}
+
+static bool bell_close(void *ctx)
+{
+  free(ctx);
+  return true;
+}
+
+void chip8_audio_bell_sink(struct chip8_audio_sink *sink)
+{
+  chip8_audio_null_sink(sink);
+  bool *sounding = calloc(1, sizeof(*sounding));
+  if (sounding) {
+    sink->write = bell_write;
+    sink->close = bell_close;
+    sink->ctx = sounding;
+  }
+}
@@ -0,0 +1,60 @@
+#ifndef CHIP8_AUDIO_H
+#define CHIP8_AUDIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/* Sound, synthesized off the emulation thread. A machine with an output
+   attached queues an event whenever its sound starts or stops, and when
+   XO-CHIP code loads an audio pattern or sets the pitch, stamped with the
+   guest time. Events go through a lock-free single-producer single-consumer
+   ring to a thread that renders them to 16-bit mono PCM for a sink. The
+   emulation thread never blocks: when the ring is full the event is
+   dropped, and a sound left on or off by a dropped event is put right at
+   the next timer tick.
+
+   The sound is the XO-CHIP pattern: 128 one-bit samples played in a loop at
+   4000 * 2^((pitch - 64) / 48) bits per second. Until a pattern is loaded,
+   it is a 250 Hz square wave. */
+typedef struct chip8_audio chip8_audio;
+
+/* Sample rate of the frontends. */
+#define CHIP8_AUDIO_RATE 44100
+
+/* Where the PCM goes. write returns false on failure, after which the sink
+   gets no more samples. */
+struct chip8_audio_sink {
+  bool (*write)(void *ctx, const int16_t *samples, size_t n);
+  bool (*close)(void *ctx);
+  void *ctx;
+};
+
+/* Sinks writing a WAV file, discarding the samples, or ringing the terminal
+   bell on stdout at the start of each sound. chip8_audio_wav_sink returns
+   false if the file could not be created. */
+bool chip8_audio_wav_sink(struct chip8_audio_sink *, const char *path,
+                          unsigned rate);
+void chip8_audio_null_sink(struct chip8_audio_sink *);
+void chip8_audio_bell_sink(struct chip8_audio_sink *);
+
+/* Starts the thread rendering to the sink at the given sample rate. The
+   output takes the sink over, closing it on failure. Returns NULL if the
+   thread could not be started. */
+chip8_audio *chip8_audio_open(const struct chip8_audio_sink *, unsigned rate);
+/* Sends the sound of a machine to the output, or stops if it is NULL. Guest
+   time starts when first attached. The output is not owned by the machine,
+   and takes the events of one machine at a time. */
+void chip8_audio_attach(chip8 *, chip8_audio *);
+/* Renders the sound up to the last timer tick of the machine attached,
+   stops the thread and closes the sink. Detach it from the machine first.
+   Returns false if the sink failed. */
+bool chip8_audio_close(chip8_audio *);
+/* Events dropped because the ring was full. */
+uint64_t chip8_audio_dropped(const chip8_audio *);
+/* Samples rendered so far. */
+uint64_t chip8_audio_samples(const chip8_audio *);
+
+#endif
@@ -0,0 +1,554 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "chip8_internal.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Lanes are processed in chunks of CHUNK, the width of an SSE register in
+   bytes. */
+#define CHUNK 16
+#define MEMORY_SIZE 0x1000
+#define STACK_SIZE 0x10
+
+struct chip8_batch {
+  size_t nlanes;   /* Multiple of CHUNK */
+  size_t nvisible; /* As requested by the user */
+  /* Arrays below are indexed by [element * nlanes + lane], except gfx which
+     is indexed by [lane * DISPLAY_HEIGHT + row]. */
+  uint8_t *memory;
+  uint8_t *V;
+  uint16_t *I;
+  uint16_t *pc;
+  uint16_t *sp;
+  uint16_t *stack;
+  uint8_t *delay_timer;
+  uint8_t *sound_timer;
+  uint8_t *key;
+  uint64_t *gfx;
+  bool *draw_flag;
+  uint64_t *rng;
+  /* Shared by all lanes, which run at the default CPU rate. */
+  uint64_t cycles;
+  uint32_t cycles_per_tick;
+  uint32_t tick_cycles;
+};
+
+#define MEM(b, addr, lane) \
+  ((b)->memory[((addr) & 0xFFF) * (b)->nlanes + (lane)])
+#define REG(b, x, lane) ((b)->V[(x) * (b)->nlanes + (lane)])
+#define STACK(b, i, lane) ((b)->stack[((i) & 0xF) * (b)->nlanes + (lane)])
+#define KEY(b, k, lane) ((b)->key[((k) & 0xF) * (b)->nlanes + (lane)])
+
+chip8_batch *chip8_batch_init(size_t nvisible)
+{
+  chip8_batch *b = calloc(1, sizeof(*b));
+  if (!b) {
+    return NULL;
+  }
+  size_t n = (nvisible + CHUNK - 1) / CHUNK * CHUNK;
+  b->nlanes = n;
+  b->nvisible = nvisible;
+  b->memory = calloc(MEMORY_SIZE * n, sizeof(*b->memory));
+  b->V = calloc(0x10 * n, sizeof(*b->V));
+  b->I = calloc(n, sizeof(*b->I));
+  b->pc = calloc(n, sizeof(*b->pc));
+  b->sp = calloc(n, sizeof(*b->sp));
+  b->stack = calloc(STACK_SIZE * n, sizeof(*b->stack));
+  b->delay_timer = calloc(n, sizeof(*b->delay_timer));
+  b->sound_timer = calloc(n, sizeof(*b->sound_timer));
+  b->key = calloc(0x10 * n, sizeof(*b->key));
+  b->gfx = calloc(DISPLAY_HEIGHT * n, sizeof(*b->gfx));
+  b->draw_flag = calloc(n, sizeof(*b->draw_flag));
+  b->rng = calloc(n, sizeof(*b->rng));
+  if (!b->memory || !b->V || !b->I || !b->pc || !b->sp || !b->stack
+      || !b->delay_timer || !b->sound_timer || !b->key || !b->gfx
+      || !b->draw_flag || !b->rng) {
+    chip8_batch_destroy(b);
+    return NULL;
+  }
+
+  /* Start from the state of a freshly initialized machine. */
+  chip8 *c8 = chip8_init();
+  if (!c8) {
+    chip8_batch_destroy(b);
+    return NULL;
+  }
+  for (size_t lane = 0; lane < n; ++lane) {
+    chip8_batch_set(b, lane, c8);
+  }
+  b->cycles_per_tick = c8->cycles_per_tick;
+  chip8_destroy(c8);
+  return b;
+}
+
+void chip8_batch_destroy(chip8_batch *b)
+{
+  free(b->memory);
+  free(b->V);
+  free(b->I);
+  free(b->pc);
+  free(b->sp);
+  free(b->stack);
+  free(b->delay_timer);
+  free(b->sound_timer);
+  free(b->key);
+  free(b->gfx);
+  free(b->draw_flag);
+  free(b->rng);
+  free(b);
+}
+
+size_t chip8_batch_lanes(const chip8_batch *b)
+{
+  return b->nvisible;
+}
+
+bool chip8_batch_load_rom(chip8_batch *b, char *rom_path)
+{
+  chip8 *c8 = chip8_init();
+  if (!c8) {
+    return false;
+  }
+  if (!chip8_load_rom(c8, rom_path)) {
+    chip8_destroy(c8);
+    return false;
+  }
+  for (size_t lane = 0; lane < b->nlanes; ++lane) {
+    for (size_t addr = 0x200; addr < MEMORY_SIZE; ++addr) {
+      MEM(b, addr, lane) = c8->memory[addr];
+    }
+  }
+  chip8_destroy(c8);
+  return true;
+}
+
+void chip8_batch_set_key(chip8_batch *b, size_t lane, uint8_t key, bool down)
+{
+  KEY(b, key, lane) = down;
+}
+
+void chip8_batch_get(const chip8_batch *b, size_t lane, chip8 *c8)
+{
+  uint8_t memory[MEMORY_SIZE];
+  for (size_t addr = 0; addr < MEMORY_SIZE; ++addr) {
+    memory[addr] = MEM(b, addr, lane);
+  }
+  chip8_copy_to_memory(c8, 0, memory, sizeof(memory));
+  for (size_t x = 0; x < 0x10; ++x) {
+    c8->V[x] = REG(b, x, lane);
+    c8->key[x] = KEY(b, x, lane);
+  }
+  for (size_t i = 0; i < STACK_SIZE; ++i) {
+    c8->stack[i] = STACK(b, i, lane);
+  }
+  c8->I = b->I[lane];
+  c8->pc = b->pc[lane];
+  c8->sp = b->sp[lane];
+  c8->delay_timer = b->delay_timer[lane];
+  c8->sound_timer = b->sound_timer[lane];
+  uint64_t gfx[DISPLAY_PLANES][DISPLAY_HIRES_HEIGHT][DISPLAY_ROW_WORDS] = {0};
+  for (size_t y = 0; y < DISPLAY_HEIGHT; ++y) {
+    gfx[0][y][0] = b->gfx[lane * DISPLAY_HEIGHT + y];
+  }
+  chip8_copy_to_gfx(c8, &gfx[0][0][0]);
+  c8->draw_flag = b->draw_flag[lane];
+  c8->rng = b->rng[lane];
+  c8->cycles = b->cycles;
+  c8->cycles_per_tick = b->cycles_per_tick;
+  c8->tick_cycles = b->tick_cycles;
+}
+
+void chip8_batch_set(chip8_batch *b, size_t lane, const chip8 *c8)
+{
+  for (size_t addr = 0; addr < MEMORY_SIZE; ++addr) {
+    MEM(b, addr, lane) = c8->memory[addr];
+  }
+  for (size_t x = 0; x < 0x10; ++x) {
+    REG(b, x, lane) = c8->V[x];
+    KEY(b, x, lane) = c8->key[x];
+  }
+  for (size_t i = 0; i < STACK_SIZE; ++i) {
+    STACK(b, i, lane) = c8->stack[i];
+  }
+  b->I[lane] = c8->I;
+  b->pc[lane] = c8->pc;
+  b->sp[lane] = c8->sp;
+  b->delay_timer[lane] = c8->delay_timer;
+  b->sound_timer[lane] = c8->sound_timer;
+  for (size_t y = 0; y < DISPLAY_HEIGHT; ++y) {
+    b->gfx[lane * DISPLAY_HEIGHT + y] = c8->gfx[0][y][0];
+  }
+  b->draw_flag[lane] = c8->draw_flag;
+  b->rng[lane] = c8->rng;
+}
+
+static inline uint64_t rotr64(uint64_t v, unsigned n)
+{
+  return (v >> n) | (v << ((64 - n) & 63));
+}
+
+/* Executes an instruction in a single lane, with the same semantics as the
+   interpreter in chip8.c. */
+static void lane_execute(chip8_batch *b, size_t lane,
+                         const struct chip8_uop *u)
+{
+  uint8_t *VX = &REG(b, u->X, lane);
+  uint8_t *VY = &REG(b, u->Y, lane);
+  uint8_t *VF = &REG(b, 0xF, lane);
+  uint16_t *pc = &b->pc[lane];
+  uint16_t next = *pc + 2;
+
+  switch (u->op) {
+  case OP_00E0:
+    memset(&b->gfx[lane * DISPLAY_HEIGHT], 0, DISPLAY_HEIGHT * sizeof(*b->gfx));
+    b->draw_flag[lane] = true;
+    break;
+  case OP_00EE:
+    next = STACK(b, --b->sp[lane], lane) + 2;
+    break;
+  case OP_1NNN:
+    next = u->NNN;
+    break;
+  case OP_2NNN:
+    STACK(b, b->sp[lane]++, lane) = *pc;
+    next = u->NNN;
+    break;
+  case OP_3XNN: next += *VX == u->NN ? 2 : 0; break;
+  case OP_4XNN: next += *VX != u->NN ? 2 : 0; break;
+  case OP_5XY0: next += *VX == *VY ? 2 : 0; break;
+  case OP_6XNN: *VX = u->NN; break;
+  case OP_7XNN: *VX += u->NN; break;
+  case OP_8XY0: *VX = *VY; break;
+  case OP_8XY1: *VX |= *VY; break;
+  case OP_8XY2: *VX &= *VY; break;
+  case OP_8XY3: *VX ^= *VY; break;
+  case OP_8XY4:
+    *VF = (*VY > (0xFF - *VX)) ? 1 : 0;
+    *VX += *VY;
+    break;
+  case OP_8XY5:
+    *VF = (*VY > *VX) ? 0 : 1;
+    *VX -= *VY;
+    break;
+  case OP_8XY6:
+    *VF = *VX & 0x1;
+    *VX >>= 1;
+    break;
+  case OP_8XY7:
+    *VF = (*VX > *VY) ? 0 : 1;
+    *VX = *VY - *VX;
+    break;
+  case OP_8XYE:
+    *VF = (*VX & 0x80) >> 7;
+    *VX <<= 1;
+    break;
+  case OP_9XY0: next += *VX != *VY ? 2 : 0; break;
+  case OP_ANNN: b->I[lane] = u->NNN; break;
+  case OP_BNNN: next = u->NNN + REG(b, 0, lane); break;
+  case OP_CXNN: *VX = u->NN & chip8_random(&b->rng[lane]); break;
+  case OP_DXYN: {
+    uint64_t *gfx = &b->gfx[lane * DISPLAY_HEIGHT];
+    unsigned x = *VX % DISPLAY_WIDTH;
+    unsigned y = *VY % DISPLAY_HEIGHT;
+    uint64_t collision = 0;
+    for (uint8_t row = 0; row < u->N; ++row) {
+      uint64_t sprite = rotr64(
+        (uint64_t) MEM(b, b->I[lane] + row, lane) << 56, x);
+      uint64_t *line = &gfx[(y + row) % DISPLAY_HEIGHT];
+      collision |= *line & sprite;
+      *line ^= sprite;
+    }
+    *VF = collision != 0;
+    b->draw_flag[lane] = true;
+    break;
+  }
+  case OP_EX9E: next += KEY(b, *VX, lane) ? 2 : 0; break;
+  case OP_EXA1: next += !KEY(b, *VX, lane) ? 2 : 0; break;
+  case OP_FX07: *VX = b->delay_timer[lane]; break;
+  case OP_FX0A:
+    next = *pc;
+    for (uint8_t i = 0; i < 0x10; ++i) {
+      if (KEY(b, i, lane)) {
+        *VX = i;
+        next = *pc + 2;
+        break;
+      }
+    }
+    break;
+  case OP_FX15: b->delay_timer[lane] = *VX; break;
+  case OP_FX18: b->sound_timer[lane] = *VX; break;
+  case OP_FX1E:
+    *VF = (b->I[lane] > (0xFFF - *VX)) ? 1 : 0;
+    b->I[lane] += *VX;
+    break;
+  case OP_FX29: b->I[lane] = *VX * 5; break;
+  case OP_FX33: {
+    uint8_t v = *VX;
+    MEM(b, b->I[lane], lane) = v / 100;
+    MEM(b, b->I[lane] + 1, lane) = (v % 100) / 10;
+    MEM(b, b->I[lane] + 2, lane) = v % 10;
+    break;
+  }
+  case OP_FX55:
+    for (uint8_t i = 0; i <= u->X; ++i) {
+      MEM(b, b->I[lane] + i, lane) = REG(b, i, lane);
+    }
+    break;
+  case OP_FX65:
+    for (uint8_t i = 0; i <= u->X; ++i) {
+      REG(b, i, lane) = MEM(b, b->I[lane] + i, lane);
+    }
+    break;
+  default:
+    assert(0);
+  }
+  *pc = next;
+}
+
+#ifdef __SSE2__
+
+/* Byte mask with 0xFF in the lanes whose bit is set. */
+static inline __m128i lane_mask(unsigned bits)
+{
+  const __m128i sel = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                    1, 2, 4, 8, 16, 32, 64, -128);
+  __m128i v = _mm_unpacklo_epi64(_mm_set1_epi8((char) (bits & 0xFF)),
+                                 _mm_set1_epi8((char) (bits >> 8)));
+  return _mm_cmpeq_epi8(_mm_and_si128(v, sel), sel);
+}
+
+static inline __m128i load(const uint8_t *p)
+{
+  return _mm_loadu_si128((const __m128i *) p);
+}
+
+/* Stores v to the lanes in mask, keeping the others. */
+static inline void store(uint8_t *p, __m128i v, __m128i mask)
+{
+  __m128i old = load(p);
+  v = _mm_or_si128(_mm_and_si128(mask, v), _mm_andnot_si128(mask, old));
+  _mm_storeu_si128((__m128i *) p, v);
+}
+
+static inline void store16(uint16_t *p, __m128i v, __m128i mask)
+{
+  store((uint8_t *) p, v, mask);
+}
+
+static inline __m128i load16(const uint16_t *p)
+{
+  return load((const uint8_t *) p);
+}
+
+/* Sets pc of the lanes in mask to pc+2, or pc+4 where cond is set. */
+static void vector_skip(chip8_batch *b, size_t base, __m128i cond,
+                        __m128i mask)
+{
+  const __m128i two = _mm_set1_epi16(2);
+  for (int half = 0; half < 2; ++half) {
+    __m128i c = half ? _mm_unpackhi_epi8(cond, cond)
+                     : _mm_unpacklo_epi8(cond, cond);
+    __m128i m = half ? _mm_unpackhi_epi8(mask, mask)
+                     : _mm_unpacklo_epi8(mask, mask);
+    uint16_t *pc = &b->pc[base + 8*half];
+    __m128i next = _mm_add_epi16(load16(pc),
+                                 _mm_add_epi16(two, _mm_and_si128(c, two)));
+    store16(pc, next, m);
+  }
+}
+
+/* Sets the 16-bit values p of the lanes in mask to v. */
+static void vector_set16(uint16_t *p, uint16_t v, __m128i mask)
+{
+  __m128i value = _mm_set1_epi16(v);
+  store16(p, value, _mm_unpacklo_epi8(mask, mask));
+  store16(p + 8, value, _mm_unpackhi_epi8(mask, mask));
+}
+
+static void vector_inc_pc(chip8_batch *b, size_t base, __m128i mask)
+{
+  vector_skip(b, base, _mm_setzero_si128(), mask);
+}
+
+/* Executes an instruction in the lanes of the chunk starting at base that
+   are in mask. Returns false if the instruction has no vector
+   implementation. */
+static bool vector_execute(chip8_batch *b, size_t base, unsigned bits,
+                           const struct chip8_uop *u)
+{
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i mask = lane_mask(bits);
+  uint8_t *VX = &REG(b, u->X, base);
+  uint8_t *VY = &REG(b, u->Y, base);
+  uint8_t *VF = &REG(b, 0xF, base);
+  __m128i x = load(VX);
+  __m128i y = load(VY);
+
+  switch (u->op) {
+  case OP_1NNN:
+    vector_set16(&b->pc[base], u->NNN, mask);
+    return true;
+  case OP_3XNN:
+  case OP_4XNN: {
+    __m128i eq = _mm_cmpeq_epi8(x, _mm_set1_epi8((char) u->NN));
+    vector_skip(b, base, u->op == OP_3XNN ? eq : _mm_xor_si128(eq, mask),
+                mask);
+    return true;
+  }
+  case OP_5XY0:
+  case OP_9XY0: {
+    __m128i eq = _mm_cmpeq_epi8(x, y);
+    vector_skip(b, base, u->op == OP_5XY0 ? eq : _mm_xor_si128(eq, mask),
+                mask);
+    return true;
+  }
+  case OP_6XNN:
+    store(VX, _mm_set1_epi8((char) u->NN), mask);
+    break;
+  case OP_7XNN:
+    store(VX, _mm_add_epi8(x, _mm_set1_epi8((char) u->NN)), mask);
+    break;
+  case OP_8XY0:
+    store(VX, y, mask);
+    break;
+  case OP_8XY1:
+    store(VX, _mm_or_si128(x, y), mask);
+    break;
+  case OP_8XY2:
+    store(VX, _mm_and_si128(x, y), mask);
+    break;
+  case OP_8XY3:
+    store(VX, _mm_xor_si128(x, y), mask);
+    break;
+  /* As in the interpreter, VF is written first and the operands are read
+     again for the result, which matters when X or Y is F. */
+  case OP_8XY4: {
+    __m128i sum = _mm_add_epi8(x, y);
+    __m128i no_carry = _mm_cmpeq_epi8(_mm_adds_epu8(x, y), sum);
+    store(VF, _mm_andnot_si128(no_carry, one), mask);
+    store(VX, _mm_add_epi8(load(VX), load(VY)), mask);
+    break;
+  }
+  case OP_8XY5: {
+    __m128i no_borrow = _mm_cmpeq_epi8(_mm_max_epu8(x, y), x);
+    store(VF, _mm_and_si128(no_borrow, one), mask);
+    store(VX, _mm_sub_epi8(load(VX), load(VY)), mask);
+    break;
+  }
+  case OP_8XY6:
+    store(VF, _mm_and_si128(x, one), mask);
+    store(VX, _mm_and_si128(_mm_srli_epi16(load(VX), 1),
+                            _mm_set1_epi8(0x7F)), mask);
+    break;
+  case OP_8XY7: {
+    __m128i no_borrow = _mm_cmpeq_epi8(_mm_max_epu8(x, y), y);
+    store(VF, _mm_and_si128(no_borrow, one), mask);
+    store(VX, _mm_sub_epi8(load(VY), load(VX)), mask);
+    break;
+  }
+  case OP_8XYE:
+    store(VF, _mm_and_si128(_mm_srli_epi16(x, 7), one), mask);
+    x = load(VX);
+    store(VX, _mm_add_epi8(x, x), mask);
+    break;
+  case OP_ANNN:
+    vector_set16(&b->I[base], u->NNN, mask);
+    break;
+  default:
+    return false;
+  }
+  vector_inc_pc(b, base, mask);
+  return true;
+}
+
+/* Mask of the lanes in the chunk at the given pc with the given opcode. */
+static unsigned group_mask(const chip8_batch *b, size_t base, uint16_t pc,
+                           uint8_t hi, uint8_t lo)
+{
+  __m128i pcs = _mm_set1_epi16((short) pc);
+  __m128i same_pc = _mm_packs_epi16(
+    _mm_cmpeq_epi16(load16(&b->pc[base]), pcs),
+    _mm_cmpeq_epi16(load16(&b->pc[base + 8]), pcs));
+  __m128i same_op = _mm_and_si128(
+    _mm_cmpeq_epi8(load(&MEM(b, pc, base)), _mm_set1_epi8((char) hi)),
+    _mm_cmpeq_epi8(load(&MEM(b, pc + 1, base)), _mm_set1_epi8((char) lo)));
+  return _mm_movemask_epi8(_mm_and_si128(same_pc, same_op));
+}
+
+#else
+
+static unsigned group_mask(const chip8_batch *b, size_t base, uint16_t pc,
+                           uint8_t hi, uint8_t lo)
+{
+  unsigned bits = 0;
+  for (size_t i = 0; i < CHUNK; ++i) {
+    size_t lane = base + i;
+    bits |= (b->pc[lane] == pc && MEM(b, pc, lane) == hi
+             && MEM(b, pc + 1, lane) == lo) << i;
+  }
+  return bits;
+}
+
+static bool vector_execute(chip8_batch *b, size_t base, unsigned bits,
+                           const struct chip8_uop *u)
+{
+  return false;
+}
+
+#endif
+
+/* Executes one instruction in every visible lane of the chunk starting at
+   base: those padding the last chunk are left alone, as they may hold no
+   program. Lanes at the same pc with the same opcode are executed
+   together. */
+static void chunk_step(chip8_batch *b, size_t base)
+{
+  size_t n = b->nvisible - base < CHUNK ? b->nvisible - base : CHUNK;
+  unsigned remaining = (1u << n) - 1;
+  while (remaining) {
+    size_t leader = base + __builtin_ctz(remaining);
+    uint16_t pc = b->pc[leader];
+    uint8_t hi = MEM(b, pc, leader);
+    uint8_t lo = MEM(b, pc + 1, leader);
+
+    unsigned bits = group_mask(b, base, pc, hi, lo) & remaining;
+    remaining &= ~bits;
+
+    struct chip8_uop u;
+    chip8_decode_op(hi << 8 | lo, &u);
+    if (!vector_execute(b, base, bits, &u)) {
+      for (unsigned m = bits; m; m &= m - 1) {
+        lane_execute(b, base + __builtin_ctz(m), &u);
+      }
+    }
+  }
+}
+
+static void tick_timers(chip8_batch *b)
+{
+  if (++b->tick_cycles < b->cycles_per_tick) {
+    return;
+  }
+  b->tick_cycles = 0;
+  for (size_t lane = 0; lane < b->nlanes; ++lane) {
+    b->delay_timer[lane] -= b->delay_timer[lane] > 0;
+    b->sound_timer[lane] -= b->sound_timer[lane] > 0;
+  }
+}
+
+void chip8_batch_step(chip8_batch *b, uint64_t n)
+{
+  memset(b->draw_flag, 0, b->nlanes * sizeof(*b->draw_flag));
+  for (uint64_t i = 0; i < n; ++i) {
+    for (size_t base = 0; base < b->nlanes; base += CHUNK) {
+      chunk_step(b, base);
+    }
+    tick_timers(b);
+  }
+  b->cycles += n;
+}
@@ -0,0 +1,36 @@
+#ifndef CHIP8_BATCH_H
+#define CHIP8_BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/* A batch of machines ("lanes") running the same program in lockstep. The
+   machine state is stored as structure of arrays, so that lanes executing the
+   same instruction can do so with vector instructions. Lanes that have
+   diverged are executed one group at a time.
+
+   FX0A does not return to the caller: a lane without any key pressed stays
+   on the instruction, as if halted, until one is. The sound timer does not
+   beep. All lanes run at the default CPU rate, and their timers tick
+   together. Lanes run in CHIP-8 mode only: the instructions of SUPER-CHIP
+   and XO-CHIP are not supported. */
+typedef struct chip8_batch chip8_batch;
+
+chip8_batch *chip8_batch_init(size_t nlanes);
+void chip8_batch_destroy(chip8_batch *);
+size_t chip8_batch_lanes(const chip8_batch *);
+/* Loads the same ROM into every lane. */
+bool chip8_batch_load_rom(chip8_batch *, char *);
+void chip8_batch_set_key(chip8_batch *, size_t lane, uint8_t key, bool down);
+/* Executes the given number of instructions in every lane. */
+void chip8_batch_step(chip8_batch *, uint64_t);
+/* Copies the state of a lane from or to a single machine, which is to be in
+   CHIP-8 mode. Only the machine state is copied, not any engine state of the
+   chip8. */
+void chip8_batch_get(const chip8_batch *, size_t lane, chip8 *);
+void chip8_batch_set(chip8_batch *, size_t lane, const chip8 *);
+
+#endif
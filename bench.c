@@ -0,0 +1,343 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "render.h"
+
+/* Frames of each workload packed for drawing by the render benchmark. */
+#define RENDER_FRAMES 600
+#define RENDER_REPEAT 20
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s [-n cycles] [-w workload] [CHIP-8 ROM]...\n"
+    "  -n cycles    Number of instructions per run (default 20000000)\n"
+    "  -w workload  Run only the workloads whose name starts with this\n"
+    "Runs synthetic ROMs stressing each class of instructions, programs\n"
+    "resembling games and the given ROMs with every engine, and reports\n"
+    "guest MIPS, ns per instruction, the cost of packing a frame for\n"
+    "drawing and the peak RSS, one line per result as key=value pairs.\n",
+    prog);
+  exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct rom {
+  uint8_t data[0x1000 - 0x200];
+  size_t size;
+  enum chip8_mode mode;
+};
+
+static void emit(struct rom *rom, const uint16_t *ops, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    rom->data[rom->size++] = ops[i] >> 8;
+    rom->data[rom->size++] = ops[i] & 0xFF;
+  }
+}
+
+#define EMIT(rom, ...)                                            \
+  do {                                                            \
+    const uint16_t ops_[] = { __VA_ARGS__ };                      \
+    emit(rom, ops_, sizeof(ops_) / sizeof(*ops_));                \
+  } while (0)
+
+/* 8XYN arithmetic in a loop */
+static void rom_alu(struct rom *rom, unsigned arg)
+{
+  EMIT(rom, 0x6001, 0x6103, 0x6207, 0x630F);
+  EMIT(rom, 0x8014, 0x8125, 0x8206, 0x830E, 0x8417, 0x8501, 0x8632,
+            0x8743, 0x8010, 0x8123, 0x7005, 0x8134, 0x8245, 0x8356,
+            0x1208);
+}
+
+/* Skips and jumps */
+static void rom_branch(struct rom *rom, unsigned arg)
+{
+  EMIT(rom, 0x7001,   /* 200: V0 += 1 */
+            0x30FF,   /* 202: skip if V0 == FF */
+            0x1208,   /* 204: jump to 208 */
+            0x6000,   /* 206: V0 = 0 */
+            0x4000,   /* 208: skip if V0 != 0 */
+            0x7101,   /* 20A: V1 += 1 */
+            0x5010,   /* 20C: skip if V0 == V1 */
+            0x1210,   /* 20E: jump to 210 */
+            0x9010,   /* 210: skip if V0 != V1 */
+            0x7201,   /* 212: V2 += 1 */
+            0x1200);  /* 214: jump to 200 */
+}
+
+/* DXYN of height arg & 0xF, wrapping around the corner if arg & 0x10 */
+static void rom_draw(struct rom *rom, unsigned arg)
+{
+  bool wrap = arg & 0x10;
+  EMIT(rom, 0xA000,                          /* The font as sprite data */
+            0x6000 | (wrap ? 60 : 8),
+            0x6100 | (wrap ? 30 : 4),
+            0xD010 | (arg & 0xF),
+            0x1206);
+}
+
+/* FX33, FX55 and FX65 on memory away from the code */
+static void rom_memory(struct rom *rom, unsigned arg)
+{
+  EMIT(rom, 0xA400,   /* 200: I = 400 */
+            0xF333,   /* 202: BCD of V3 */
+            0xF755,   /* 204: store V0-V7 */
+            0xF765,   /* 206: load V0-V7 */
+            0x7301,   /* 208: V3 += 1 */
+            0x1200);  /* 20A: jump to 200 */
+}
+
+/* A game frame: clear the screen, draw eight sprites at random positions
+   and wait for the delay timer. */
+static void rom_sprites(struct rom *rom, unsigned arg)
+{
+  EMIT(rom, 0x00E0,   /* 200: clear */
+            0x6A00,   /* 202: VA = 0 */
+            0xC03F,   /* 204: V0 = random x */
+            0xC11F,   /* 206: V1 = random y */
+            0xFA29,   /* 208: I = digit VA */
+            0xD015,   /* 20A: draw */
+            0x7A01,   /* 20C: VA += 1 */
+            0x3A08,   /* 20E: skip if VA == 8 */
+            0x1204,   /* 210: jump to 204 */
+            0x6B02,   /* 212: VB = 2 */
+            0xFB15,   /* 214: delay = VB */
+            0xFC07,   /* 216: VC = delay */
+            0x3C00,   /* 218: skip if VC == 0 */
+            0x1216,   /* 21A: jump to 216 */
+            0x1200);  /* 21C: jump to 200 */
+}
+
+/* A score counter: draw its digits, erase them by drawing them again and
+   count up. */
+static void rom_score(struct rom *rom, unsigned arg)
+{
+  EMIT(rom, 0x6500,                         /* V5 = 0 */
+            0xA300, 0xF533, 0xF265,         /* V0-V2 = BCD of V5 */
+            0x6400);                        /* V4 = 0 */
+  for (int pass = 0; pass < 2; ++pass) {
+    EMIT(rom, 0x6300,                       /* V3 = 0 */
+              0xF029, 0xD345, 0x7305,       /* draw digit V0, V3 += 5 */
+              0xF129, 0xD345, 0x7305,       /* draw digit V1, V3 += 5 */
+              0xF229, 0xD345);              /* draw digit V2 */
+  }
+  EMIT(rom, 0x7501,                         /* V5 += 1 */
+            0x1202);                        /* jump to 202 */
+}
+
+/* SUPER-CHIP high resolution: 16x16 sprites moving across the screen,
+   scrolled down and right every frame. */
+static void rom_hires(struct rom *rom, unsigned arg)
+{
+  EMIT(rom, 0x00FF,   /* 200: high resolution */
+            0xA050,   /* 202: I = big font, as 16x16 sprite data */
+            0x7005,   /* 204: V0 += 5 */
+            0x7103,   /* 206: V1 += 3 */
+            0xD010,   /* 208: draw 16x16 */
+            0x00C1,   /* 20A: scroll down 1 */
+            0x00FB,   /* 20C: scroll right 4 */
+            0x1204);  /* 20E: jump to 204 */
+}
+
+struct workload {
+  const char *name;
+  void (*build)(struct rom *, unsigned);
+  unsigned arg;
+  enum chip8_mode mode;
+};
+
+static const struct workload workloads[] = {
+  { "alu",          rom_alu,     0 },
+  { "branch",       rom_branch,  0 },
+  { "draw_h1",      rom_draw,    1 },
+  { "draw_h8",      rom_draw,    8 },
+  { "draw_h15",     rom_draw,    15 },
+  { "draw_h1_wrap", rom_draw,    0x10 | 1 },
+  { "draw_h8_wrap", rom_draw,    0x10 | 8 },
+  { "draw_h15_wrap", rom_draw,   0x10 | 15 },
+  { "memory",       rom_memory,  0 },
+  { "sprites",      rom_sprites, 0 },
+  { "score",        rom_score,   0 },
+  { "hires",        rom_hires,   0, CHIP8_MODE_SCHIP },
+};
+
+/* chip8_emulate_cycle, one call per instruction */
+static uint64_t run_cycles(chip8 *c8, uint64_t ncycles)
+{
+  uint64_t n = 0;
+  while (n < ncycles && !c8->halted) {
+    chip8_emulate_cycle(c8);
+    ++n;
+  }
+  return n;
+}
+
+struct engine {
+  const char *name;
+  chip8_run_fun run;
+};
+
+static const struct engine engines[] = {
+  { "cycle",  run_cycles },
+  { "interp", chip8_run },
+  { "blocks", chip8_run_blocks },
+  { "jit",    chip8_run_jit },
+};
+
+static chip8 *load(const struct rom *rom)
+{
+  chip8 *c8 = chip8_init();
+  if (!c8 || !chip8_set_mode(c8, rom->mode)
+      || !chip8_load_rom_data(c8, rom->data, rom->size)) {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  /* The "cycle" engine executes polling loops, so the others do too, for
+     their MIPS to count the same instructions. */
+  chip8_set_idle_skip(c8, false);
+  return c8;
+}
+
+static void bench_engine(const char *name, const struct rom *rom,
+                         const struct engine *e, uint64_t ncycles)
+{
+  chip8 *c8 = load(rom);
+  uint64_t start = now_ns();
+  uint64_t n = e->run(c8, ncycles);
+  uint64_t elapsed = now_ns() - start;
+  printf("workload=%s engine=%s instructions=%" PRIu64 " seconds=%.4f"
+         " mips=%.2f ns_per_instruction=%.3f%s\n",
+         name, e->name, n, elapsed / 1e9,
+         elapsed ? n * 1e3 / elapsed : 0.0,
+         n ? (double) elapsed / n : 0.0,
+         c8->halted ? " halted=1" : "");
+  fflush(stdout);
+  chip8_destroy(c8);
+}
+
+/* Runs the workload frame by frame, keeping the framebuffer of each frame,
+   then times packing them as the GLFW frontend does before drawing. */
+static void bench_render(const char *name, const struct rom *rom)
+{
+  static uint64_t gfx[RENDER_FRAMES][DISPLAY_PLANES][DISPLAY_HIRES_HEIGHT]
+                    [DISPLAY_ROW_WORDS];
+  static uint64_t dirty[RENDER_FRAMES];
+  chip8 *c8 = load(rom);
+  size_t nframes = 0;
+  uint64_t rows = 0;
+  while (nframes < RENDER_FRAMES && !c8->halted) {
+    chip8_run(c8, c8->cycles_per_tick);
+    chip8_copy_from_gfx(c8, gfx[nframes][0][0]);
+    dirty[nframes] = c8->dirty_rows;
+    for (uint64_t d = c8->dirty_rows; d; d &= d - 1) {
+      ++rows;
+    }
+    c8->dirty_rows = 0;
+    ++nframes;
+  }
+
+  static render_words words;
+  struct render_run runs[DISPLAY_HIRES_HEIGHT];
+  uint64_t checksum = 0;
+  uint64_t start = now_ns();
+  for (size_t r = 0; r < RENDER_REPEAT; ++r) {
+    for (size_t f = 0; f < nframes; ++f) {
+      size_t nruns = render_pack_rows((const uint64_t (*)
+                                       [DISPLAY_HIRES_HEIGHT]
+                                       [DISPLAY_ROW_WORDS]) gfx[f],
+                                      chip8_height(c8), dirty[f], words,
+                                      runs);
+      checksum += nruns ? words[0][runs[0].start][0] : 0;
+    }
+  }
+  uint64_t elapsed = now_ns() - start;
+  printf("workload=%s render_frames=%zu render_ns_per_frame=%.1f"
+         " dirty_rows_per_frame=%.2f checksum=%" PRIu64 "\n",
+         name, nframes,
+         nframes ? (double) elapsed / (nframes * RENDER_REPEAT) : 0.0,
+         nframes ? (double) rows / nframes : 0.0, checksum);
+  fflush(stdout);
+  chip8_destroy(c8);
+}
+
+static void bench(const char *name, const struct rom *rom, uint64_t ncycles)
+{
+  for (size_t i = 0; i < sizeof(engines)/sizeof(*engines); ++i) {
+    bench_engine(name, rom, &engines[i], ncycles);
+  }
+  bench_render(name, rom);
+}
+
+static bool read_rom(const char *path, struct rom *rom)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return false;
+  }
+  rom->size = fread(rom->data, 1, sizeof(rom->data), f);
+  bool ok = !ferror(f) && fgetc(f) == EOF;
+  fclose(f);
+  return ok;
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t ncycles = 20000000;
+  const char *only = "";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:w:")) != -1) {
+    switch (opt) {
+    case 'n':
+      ncycles = strtoull(optarg, NULL, 10);
+      break;
+    case 'w':
+      only = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  /* One line per result, as key=value pairs. */
+  struct rom rom;
+  for (size_t i = 0; i < sizeof(workloads)/sizeof(*workloads); ++i) {
+    const struct workload *w = &workloads[i];
+    if (strncmp(w->name, only, strlen(only)) != 0) {
+      continue;
+    }
+    rom.size = 0;
+    rom.mode = w->mode;
+    w->build(&rom, w->arg);
+    bench(w->name, &rom, ncycles);
+  }
+  for (int i = optind; i < argc; ++i) {
+    rom.mode = CHIP8_MODE_CHIP8;
+    if (!read_rom(argv[i], &rom)) {
+      fprintf(stderr, "%s: could not load ROM\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+    bench(argv[i], &rom, ncycles);
+  }
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("peak_rss_kb=%ld\n", ru.ru_maxrss);
+  return EXIT_SUCCESS;
+}
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <inttypes.h>
 #include <stdio.h>
@@ -5,25 +7,27 @@
 #include <string.h>
 
 #include "chip8.h"
+#include "chip8_internal.h"
+
+/* Programs are loaded at 0x200, after the fonts. */
+#define PROGRAM_START 0x200
+#define BIG_FONT_START 0x50
+
+#define OPCODE_DECL(name) \
+  static inline void opcode_##name(chip8 *, const struct chip8_uop *);
+CHIP8_OPCODES(OPCODE_DECL)
+#undef OPCODE_DECL
+
+/* Computed goto is used for dispatch in chip8_run when the compiler supports
+   it, otherwise a switch. */
+#if defined(__GNUC__) && !defined(CHIP8_NO_COMPUTED_GOTO)
+#define CHIP8_COMPUTED_GOTO 1
+#else
+#define CHIP8_COMPUTED_GOTO 0
+#endif
 
-#define MAX_ROM_SIZE (0xFFF - 0x200 + 1)
-
-static inline void opcode_0x0000(chip8 *, opcode);
-static inline void opcode_0x1000(chip8 *, opcode);
-static inline void opcode_0x2000(chip8 *, opcode);
-static inline void opcode_0x3000(chip8 *, opcode);
-static inline void opcode_0x4000(chip8 *, opcode);
-static inline void opcode_0x5000(chip8 *, opcode);
-static inline void opcode_0x6000(chip8 *, opcode);
-static inline void opcode_0x7000(chip8 *, opcode);
-static inline void opcode_0x8000(chip8 *, opcode);
-static inline void opcode_0x9000(chip8 *, opcode);
-static inline void opcode_0xA000(chip8 *, opcode);
-static inline void opcode_0xB000(chip8 *, opcode);
-static inline void opcode_0xC000(chip8 *, opcode);
-static inline void opcode_0xD000(chip8 *, opcode);
-static inline void opcode_0xE000(chip8 *, opcode);
-static inline void opcode_0xF000(chip8 *, opcode, input_wait_fun);
+/* Maps every possible opcode to its instruction. Built by chip8_init. */
+static uint8_t decode_table[0x10000];
 
 static uint8_t chip8_fontset[80] =
 {
@@ -45,27 +49,384 @@ static uint8_t chip8_fontset[80] =
   0xF0, 0x80, 0xF0, 0x80, 0x80  /* F */
 };
 
+/* The 8x10 digits of SUPER-CHIP, and the letters added by XO-CHIP. */
+static uint8_t chip8_big_fontset[160] =
+{
+  0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, /* 0 */
+  0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, /* 1 */
+  0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, /* 2 */
+  0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, /* 3 */
+  0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, /* 4 */
+  0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, /* 5 */
+  0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, /* 6 */
+  0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, /* 7 */
+  0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, /* 8 */
+  0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, /* 9 */
+  0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, /* A */
+  0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, /* B */
+  0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, /* C */
+  0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, /* D */
+  0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, /* E */
+  0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  /* F */
+};
+
+static enum chip8_op chip8_decode(opcode op)
+{
+  switch (op & 0xF000) {
+  case 0x0000:
+    switch (op) {
+    case 0x00E0: return OP_00E0;
+    case 0x00EE: return OP_00EE;
+    case 0x00FB: return OP_00FB;
+    case 0x00FC: return OP_00FC;
+    case 0x00FD: return OP_00FD;
+    case 0x00FE: return OP_00FE;
+    case 0x00FF: return OP_00FF;
+    }
+    switch (op & 0xFFF0) {
+    case 0x00C0: return OP_00CN;
+    case 0x00D0: return OP_00DN;
+    }
+    break;
+  case 0x1000: return OP_1NNN;
+  case 0x2000: return OP_2NNN;
+  case 0x3000: return OP_3XNN;
+  case 0x4000: return OP_4XNN;
+  case 0x5000:
+    switch (op & 0x000F) {
+    case 0x0000: return OP_5XY0;
+    case 0x0002: return OP_5XY2;
+    case 0x0003: return OP_5XY3;
+    }
+    break;
+  case 0x6000: return OP_6XNN;
+  case 0x7000: return OP_7XNN;
+  case 0x8000:
+    switch (op & 0x000F) {
+    case 0x0000: return OP_8XY0;
+    case 0x0001: return OP_8XY1;
+    case 0x0002: return OP_8XY2;
+    case 0x0003: return OP_8XY3;
+    case 0x0004: return OP_8XY4;
+    case 0x0005: return OP_8XY5;
+    case 0x0006: return OP_8XY6;
+    case 0x0007: return OP_8XY7;
+    case 0x000E: return OP_8XYE;
+    }
+    break;
+  case 0x9000:
+    if ((op & 0x000F) == 0x0000) {
+      return OP_9XY0;
+    }
+    break;
+  case 0xA000: return OP_ANNN;
+  case 0xB000: return OP_BNNN;
+  case 0xC000: return OP_CXNN;
+  case 0xD000: return OP_DXYN;
+  case 0xE000:
+    switch (op & 0x00FF) {
+    case 0x009E: return OP_EX9E;
+    case 0x00A1: return OP_EXA1;
+    }
+    break;
+  case 0xF000:
+    switch (op) {
+    case 0xF000: return OP_F000;
+    case 0xF002: return OP_F002;
+    }
+    switch (op & 0x00FF) {
+    case 0x0001: return OP_FN01;
+    case 0x0007: return OP_FX07;
+    case 0x000A: return OP_FX0A;
+    case 0x0015: return OP_FX15;
+    case 0x0018: return OP_FX18;
+    case 0x001E: return OP_FX1E;
+    case 0x0029: return OP_FX29;
+    case 0x0033: return OP_FX33;
+    case 0x0055: return OP_FX55;
+    case 0x0065: return OP_FX65;
+    case 0x0030: return OP_FX30;
+    case 0x003A: return OP_FX3A;
+    case 0x0075: return OP_FX75;
+    case 0x0085: return OP_FX85;
+    }
+    break;
+  }
+  return OP_INVALID;
+}
+
+static inline void chip8_decode_uop(opcode op, struct chip8_uop *u)
+{
+  u->op  = decode_table[op];
+  u->X   = (op & 0x0F00) >> 8;
+  u->Y   = (op & 0x00F0) >> 4;
+  u->N   = op & 0x000F;
+  u->NN  = op & 0x00FF;
+  u->NNN = op & 0x0FFF;
+}
+
+void chip8_build_decode_table(void)
+{
+  static bool built = false;
+  if (built) {
+    return;
+  }
+  for (uint32_t op = 0; op < 0x10000; ++op) {
+    decode_table[op] = chip8_decode(op);
+  }
+  built = true;
+}
+
+static inline uint16_t block_last_page(const struct chip8_block *b)
+{
+  return (b->end - 1) >> PAGE_SHIFT;
+}
+
+/* Drops every cached block with code in [addr, addr+len). */
+static void bcache_invalidate(struct chip8_bcache *bc, uint16_t addr,
+                              size_t len)
+{
+  size_t first_page = addr >> PAGE_SHIFT;
+  size_t last_page = (addr + len - 1) >> PAGE_SHIFT;
+  bool has_code = false;
+  for (size_t p = first_page; p <= last_page && p < NPAGES; ++p) {
+    has_code |= bc->page_blocks[p] != 0;
+  }
+  if (!has_code) {
+    return;
+  }
+
+  size_t from = addr >= BLOCK_MAX_BYTES ? addr - BLOCK_MAX_BYTES : 0;
+  size_t to = addr + len;
+  for (size_t start = from; start < to && start < NPAGES << PAGE_SHIFT;
+       ++start) {
+    struct chip8_block *b = bc->blocks[start];
+    if (!b || b->end <= addr) {
+      continue;
+    }
+    for (size_t p = b->start >> PAGE_SHIFT; p <= block_last_page(b); ++p) {
+      --bc->page_blocks[p];
+    }
+    bc->blocks[start] = NULL;
+    free(b);
+    ++bc->invalidations;
+  }
+}
+
+/* All writes to memory go through here, so that decoded code stays in sync
+   with it and snapshots know which pages to copy. Writes past the end of
+   the memory of the mode wrap around to its start. */
+static inline void chip8_write_memory(chip8 *c8, uint16_t addr,
+                                      const void *src, size_t len)
+{
+  size_t size = chip8_memory_size(c8);
+  while (len > 0) {
+    size_t at = addr & (size - 1);
+    size_t n = len < size - at ? len : size - at;
+    memcpy(c8->memory + at, src, n);
+    chip8_mark_pages(c8, at >> PAGE_SHIFT, (at + n - 1) >> PAGE_SHIFT);
+    if (c8->bcache) {
+      bcache_invalidate(c8->bcache, at, n);
+    }
+    src = (const uint8_t *) src + n;
+    len -= n;
+    addr = 0;
+  }
+}
+
+/* Reads memory, wrapping around past its end. */
+static inline void chip8_read_memory(const chip8 *c8, uint16_t addr,
+                                     void *dst, size_t len)
+{
+  for (size_t i = 0; i < len; ++i) {
+    ((uint8_t *) dst)[i] = chip8_peek(c8, addr + i);
+  }
+}
+
+void chip8_copy_to_memory(chip8 *c8, uint16_t addr, const void *src,
+                          size_t len)
+{
+  chip8_write_memory(c8, addr, src, len);
+}
+
+void chip8_copy_to_gfx(chip8 *c8, const uint64_t *gfx)
+{
+  for (size_t r = 0; r < chip8_gfx_rows(c8); ++r) {
+    size_t y = r % DISPLAY_HIRES_HEIGHT;
+    uint64_t *row = c8->gfx[r / DISPLAY_HIRES_HEIGHT][y];
+    const uint64_t *from = &gfx[r * DISPLAY_ROW_WORDS];
+    if (memcmp(row, from, sizeof(c8->gfx[0][y])) != 0) {
+      memcpy(row, from, sizeof(c8->gfx[0][y]));
+      chip8_mark_rows(c8, UINT64_C(1) << y);
+    }
+  }
+}
+
+void chip8_copy_from_gfx(const chip8 *c8, uint64_t *gfx)
+{
+  size_t n = chip8_gfx_rows(c8) * DISPLAY_ROW_WORDS;
+  memcpy(gfx, c8->gfx, n * sizeof(*gfx));
+  memset(gfx + n, 0, (DISPLAY_PLANES * DISPLAY_HIRES_HEIGHT
+                      * DISPLAY_ROW_WORDS - n) * sizeof(*gfx));
+}
+
+void chip8_decode_op(opcode op, struct chip8_uop *u)
+{
+  chip8_build_decode_table();
+  chip8_decode_uop(op, u);
+}
+
+/* The state chip8_init leaves the registers and the framebuffer in, which
+   are zero otherwise, and memory, which is zero past the font. */
+static void set_defaults(chip8 *c8)
+{
+  chip8_write_memory(c8, 0, chip8_fontset, sizeof(chip8_fontset));
+  c8->pc = PROGRAM_START;
+  chip8_mark_rows(c8, CHIP8_ALL_ROWS);
+  c8->planes = 1;
+  c8->skip_idle = true;
+  chip8_set_cpu_rate(c8, CHIP8_DEFAULT_CPU_HZ);
+  chip8_seed(c8, CHIP8_DEFAULT_SEED);
+}
+
+/* Allocates memory and the framebuffer for the mode of a machine unless
+   they are large enough, keeping what they hold. */
+static bool alloc_storage(chip8 *c8)
+{
+  size_t memory = chip8_memory_size(c8);
+  size_t rows = chip8_gfx_rows(c8);
+  if (memory <= c8->memory_alloc && rows <= c8->gfx_alloc) {
+    return true;
+  }
+  memory = memory > c8->memory_alloc ? memory : c8->memory_alloc;
+  rows = rows > c8->gfx_alloc ? rows : c8->gfx_alloc;
+  uint8_t *p = calloc(1, memory + rows * sizeof(c8->gfx[0][0]));
+  if (!p) {
+    return false;
+  }
+  if (c8->memory) {
+    memcpy(p, c8->memory, c8->memory_alloc);
+    memcpy(p + memory, c8->gfx, c8->gfx_alloc * sizeof(c8->gfx[0][0]));
+    free(c8->memory);
+  }
+  c8->memory = p;
+  c8->gfx = (uint64_t (*)[DISPLAY_HIRES_HEIGHT][DISPLAY_ROW_WORDS])
+            (p + memory);
+  c8->memory_alloc = memory;
+  c8->gfx_alloc = rows;
+  return true;
+}
+
+bool chip8_init_at(chip8 *c8)
+{
+  chip8_build_decode_table();
+  memset(c8, 0, sizeof(*c8));
+  if (!alloc_storage(c8)) {
+    return false;
+  }
+  memset(c8->dirty_pages, 0xFF, sizeof(c8->dirty_pages));
+  set_defaults(c8);
+  return true;
+}
+
 chip8 *chip8_init(void)
 {
-  chip8 *c8 = malloc(sizeof(*c8));
-  if (!c8) {
+  void *p;
+  if (posix_memalign(&p, CHIP8_CACHE_LINE, sizeof(chip8)) != 0) {
     return NULL;
   }
-  memset(c8, 0, sizeof(*c8));
-  memcpy(c8->memory, chip8_fontset, sizeof(chip8_fontset));
-  c8->pc = 0x200;
+  if (!chip8_init_at(p)) {
+    free(p);
+    return NULL;
+  }
+  return p;
+}
 
-  return c8;
+void chip8_reset(chip8 *c8)
+{
+  /* Zeroed like any write, so that code decoded from the pages is dropped
+     and snapshots copy them. */
+  static const uint8_t zero[PAGE_SIZE];
+  for (size_t p = 0; p < NPAGES; ++p) {
+    if ((c8->written_pages[p / 64] >> (p % 64)) & 1) {
+      chip8_write_memory(c8, p << PAGE_SHIFT, zero, PAGE_SIZE);
+    }
+  }
+  memset(c8->written_pages, 0, sizeof(c8->written_pages));
+  memset(c8, 0, offsetof(chip8, memory));
+  memset(c8->gfx, 0, c8->gfx_alloc * sizeof(c8->gfx[0][0]));
+  set_defaults(c8);
+}
+
+static void bcache_free(struct chip8_bcache *bc)
+{
+  for (size_t i = 0; i < sizeof(bc->blocks)/sizeof(*bc->blocks); ++i) {
+    free(bc->blocks[i]);
+  }
+  free(bc);
+}
+
+void chip8_release(chip8 *c8)
+{
+  if (c8->bcache) {
+    bcache_free(c8->bcache);
+  }
+  if (c8->jit) {
+    chip8_jit_free(c8->jit);
+  }
+  if (c8->pages) {
+    chip8_pages_free(c8->pages);
+  }
+  free(c8->hash);
+  free(c8->memory);
 }
 
 void chip8_destroy(chip8 *c8)
 {
+  chip8_release(c8);
   free(c8);
 }
 
+bool chip8_switch_mode(chip8 *c8, enum chip8_mode mode)
+{
+  uint8_t from = c8->mode;
+  c8->mode = mode;
+  if (!alloc_storage(c8)) {
+    c8->mode = from;
+    return false;
+  }
+  if (mode != from) {
+    chip8_mark_rows(c8, CHIP8_ALL_ROWS);
+    /* Blocks are decoded as instructions are in the mode. */
+    if (c8->bcache) {
+      bcache_invalidate(c8->bcache, 0, c8->memory_alloc);
+    }
+  }
+  return true;
+}
+
+bool chip8_set_mode(chip8 *c8, enum chip8_mode mode)
+{
+  if (!chip8_switch_mode(c8, mode)) {
+    return false;
+  }
+  if (mode != CHIP8_MODE_CHIP8) {
+    chip8_write_memory(c8, BIG_FONT_START, chip8_big_fontset,
+                       sizeof(chip8_big_fontset));
+  }
+  return true;
+}
+
+/* Programs fill the memory of the mode from 0x200. */
+static size_t max_rom_size(const chip8 *c8)
+{
+  return chip8_memory_size(c8) - PROGRAM_START;
+}
+
 bool chip8_load_rom(chip8 *c8, char *rom_path)
 {
-  uint8_t buffer[MAX_ROM_SIZE + 1];
+  uint8_t buffer[XOCHIP_MEMORY_SIZE - PROGRAM_START + 1];
+  size_t max_size = max_rom_size(c8);
   size_t bytes_read;
   FILE *rom;
 
@@ -74,8 +435,8 @@ bool chip8_load_rom(chip8 *c8, char *rom_path)
     return false;
   }
 
-  bytes_read = fread(buffer, sizeof(*buffer), sizeof(buffer), rom);
-  if (bytes_read == sizeof(buffer)) {
+  bytes_read = fread(buffer, sizeof(*buffer), max_size + 1, rom);
+  if (bytes_read > max_size) {
     fprintf(stderr, "ROM file too big\n");
     fclose(rom);
     return false;
@@ -86,239 +447,696 @@ bool chip8_load_rom(chip8 *c8, char *rom_path)
     return false;
   }
 
-  memcpy(c8->memory + 0x200, buffer, bytes_read * sizeof(*buffer));
+  chip8_write_memory(c8, PROGRAM_START, buffer,
+                     bytes_read * sizeof(*buffer));
   fclose(rom);
   return true;
 }
 
-void chip8_emulate_cycle(chip8 *c8, input_wait_fun wait_for_input)
+bool chip8_load_rom_data(chip8 *c8, const uint8_t *rom, size_t size)
 {
-  opcode op;
+  if (size > max_rom_size(c8)) {
+    return false;
+  }
+  chip8_write_memory(c8, PROGRAM_START, rom, size);
+  return true;
+}
 
-  op = (c8->memory[c8->pc] << 8) | c8->memory[c8->pc+1];
-  c8->draw_flag = false;
+static inline opcode chip8_fetch(chip8 *c8)
+{
+  return (chip8_peek(c8, c8->pc) << 8) | chip8_peek(c8, c8->pc + 1);
+}
 
-  switch (op & 0xF000) {
-  case 0x0000: opcode_0x0000(c8, op); break;
-  case 0x1000: opcode_0x1000(c8, op); break;
-  case 0x2000: opcode_0x2000(c8, op); break;
-  case 0x3000: opcode_0x3000(c8, op); break;
-  case 0x4000: opcode_0x4000(c8, op); break;
-  case 0x5000: opcode_0x5000(c8, op); break;
-  case 0x6000: opcode_0x6000(c8, op); break;
-  case 0x7000: opcode_0x7000(c8, op); break;
-  case 0x8000: opcode_0x8000(c8, op); break;
-  case 0x9000: opcode_0x9000(c8, op); break;
-  case 0xA000: opcode_0xA000(c8, op); break;
-  case 0xB000: opcode_0xB000(c8, op); break;
-  case 0xC000: opcode_0xC000(c8, op); break;
-  case 0xD000: opcode_0xD000(c8, op); break;
-  case 0xE000: opcode_0xE000(c8, op); break;
-  case 0xF000: opcode_0xF000(c8, op, wait_for_input); break;
-  default:
-    fprintf(stderr, "Unknown opcode 0x%" PRIX16 "\n", op);
-    assert(0);
+void chip8_set_idle_skip(chip8 *c8, bool skip)
+{
+  c8->skip_idle = skip;
+}
+
+void chip8_set_cpu_rate(chip8 *c8, uint32_t hz)
+{
+  c8->cycles_per_tick = hz / CHIP8_TIMER_HZ;
+  if (c8->cycles_per_tick == 0) {
+    c8->cycles_per_tick = 1;
+  }
+  if (c8->tick_cycles >= c8->cycles_per_tick) {
+    c8->tick_cycles = 0;
   }
+}
+
+void chip8_seed(chip8 *c8, uint64_t seed)
+{
+  /* One round of splitmix64, so that nearby seeds give unrelated numbers and
+     no seed gives the state 0. */
+  uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  c8->rng = z ? z : CHIP8_DEFAULT_SEED;
+}
 
-  /* TODO timers should decrease at 60 hz */
+/* Counts an instruction, ticking the timers once every cycles_per_tick
+   instructions: at 60 Hz of guest time, however fast the host runs. */
+static inline void chip8_tick_timers(chip8 *c8)
+{
+  if (++c8->tick_cycles < c8->cycles_per_tick) {
+    return;
+  }
+  c8->tick_cycles = 0;
+  chip8_prof_tick(c8);
   if (c8->delay_timer > 0) {
     --c8->delay_timer;
   }
-  if (c8->sound_timer > 0) {
-    if (c8->sound_timer == 1) {
-      printf("\a");
-      fflush(stdout);
-    }
+  uint8_t sound = c8->sound_timer;
+  if (sound > 0) {
     --c8->sound_timer;
   }
+  if (c8->audio) {
+    chip8_audio_ticked(c8, 1, sound);
+  }
+}
+
+static inline void chip8_execute(chip8 *c8, const struct chip8_uop *u)
+{
+  switch (u->op) {
+#define OPCODE_CASE(name) \
+  case OP_##name: opcode_##name(c8, u); break;
+  CHIP8_OPCODES(OPCODE_CASE)
+#undef OPCODE_CASE
+  }
+}
+
+void chip8_step(chip8 *c8, const struct chip8_uop *u)
+{
+  chip8_execute(c8, u);
+}
+
+#define OPCODE_STEP(name)                                       \
+  static void step_##name(chip8 *c8, uint64_t bits)            \
+  {                                                             \
+    struct chip8_uop u;                                         \
+    memcpy(&u, &bits, sizeof(u));                               \
+    opcode_##name(c8, &u);                                      \
+  }
+CHIP8_OPCODES(OPCODE_STEP)
+#undef OPCODE_STEP
+
+#define OPCODE_STEP_ENTRY(name) step_##name,
+const chip8_step_fun chip8_steps[OP_COUNT] = {
+  CHIP8_OPCODES(OPCODE_STEP_ENTRY)
+};
+#undef OPCODE_STEP_ENTRY
+
+void chip8_interpret(chip8 *c8)
+{
+  struct chip8_uop u;
+  chip8_decode_uop(chip8_fetch(c8), &u);
+  chip8_prof_op(c8, u.op);
+  chip8_execute(c8, &u);
+  chip8_tick_timers(c8);
+  ++c8->cycles;
+}
+
+void chip8_tick_timers_n(chip8 *c8, uint64_t cycles)
+{
+  uint64_t total = c8->tick_cycles + cycles;
+  uint64_t n = total / c8->cycles_per_tick;
+  c8->tick_cycles = total % c8->cycles_per_tick;
+  uint8_t sound = c8->sound_timer;
+  c8->delay_timer = c8->delay_timer > n ? c8->delay_timer - n : 0;
+  c8->sound_timer = sound > n ? sound - n : 0;
+  if (c8->audio && n > 0) {
+    chip8_audio_ticked(c8, n, sound);
+  }
+}
+
+void chip8_idle(chip8 *c8, uint64_t cycles)
+{
+  chip8_tick_timers_n(c8, cycles);
+  c8->cycles += cycles;
+}
+
+static inline void decode_at(const chip8 *c8, uint16_t addr,
+                             struct chip8_uop *u)
+{
+  opcode op = (chip8_peek(c8, addr) << 8) | chip8_peek(c8, addr + 1);
+  chip8_decode_uop(op, u);
+}
+
+static inline bool jumps_to(const struct chip8_uop *u, uint16_t addr)
+{
+  return u->op == OP_1NNN && u->NNN == addr;
+}
+
+/* The loops recognized are
+     FX07, 3XNN or 4XNN, 1NNN  waiting for the delay timer,
+     EX9E or EXA1, 1NNN        waiting for the key in VX, and
+     6XNN, EX9E or EXA1, 1NNN  waiting for key NN,
+   each jumping back to its first instruction. Nothing but the timers
+   changes while they run, and the keys do not change during a run, so the
+   iteration that leaves is known in advance: for the delay timer, the first
+   whose FX07 comes after the tick that brings it to a value leaving. */
+uint64_t chip8_skip_idle(chip8 *c8, uint64_t max)
+{
+  if (!c8->skip_idle || chip8_profiling(c8)) {
+    return 0;
+  }
+  uint16_t head = c8->pc;
+  struct chip8_uop u[3];
+  decode_at(c8, head, &u[0]);
+  decode_at(c8, head + 2, &u[1]);
+
+  unsigned len;
+  uint8_t x = u[0].X;
+  uint8_t value;
+  bool reads_timer = u[0].op == OP_FX07;
+  if (reads_timer) {
+    decode_at(c8, head + 4, &u[2]);
+    if ((u[1].op != OP_3XNN && u[1].op != OP_4XNN) || u[1].X != x
+        || !jumps_to(&u[2], head)) {
+      return 0;
+    }
+    value = c8->delay_timer;
+    bool until_equal = u[1].op == OP_3XNN;
+    if ((value == u[1].NN) == until_equal) {
+      return 0;  /* Leaves the loop */
+    }
+    len = 3;
+    /* Counting down, it reaches NN or leaves it after this many ticks,
+       unless it stops at 0 first. */
+    if (until_equal ? u[1].NN < value : value > 0) {
+      uint64_t ticks = until_equal ? value - u[1].NN : 1;
+      uint64_t before = ticks * c8->cycles_per_tick - c8->tick_cycles;
+      uint64_t iterations = (before + len - 1) / len;
+      max = max < iterations * len ? max : iterations * len;
+    }
+  } else {
+    const struct chip8_uop *skip = &u[0];
+    value = c8->V[x];
+    len = 2;
+    if (u[0].op == OP_6XNN) {
+      decode_at(c8, head + 4, &u[2]);
+      if (u[1].X != x || !jumps_to(&u[2], head)) {
+        return 0;
+      }
+      skip = &u[1];
+      value = u[0].NN;
+      len = 3;
+    } else if (!jumps_to(&u[1], head)) {
+      return 0;
+    }
+    if ((skip->op != OP_EX9E && skip->op != OP_EXA1)
+        || c8->key[value & 0xF] == (skip->op == OP_EX9E)) {
+      return 0;
+    }
+  }
+
+  uint64_t skipped = max / len * len;
+  if (skipped == 0) {
+    return 0;
+  }
+  if (reads_timer) {
+    /* What the FX07 of the last iteration skipped read */
+    uint64_t ticks = (c8->tick_cycles + skipped - len) / c8->cycles_per_tick;
+    value = value > ticks ? value - ticks : 0;
+  }
+  c8->V[x] = value;
+  chip8_tick_timers_n(c8, skipped);
+  return skipped;
+}
+
+void chip8_key_event(chip8 *c8, uint8_t key, bool pressed)
+{
+  c8->key[key & 0xF] = pressed;
+  if (pressed) {
+    c8->halted = false;
+  }
+}
+
+void chip8_emulate_cycle(chip8 *c8)
+{
+  c8->draw_flag = false;
+  c8->halted = false;
+  chip8_prof_enter(c8);
+  chip8_interpret(c8);
+  chip8_prof_leave(c8);
+}
+
+#if CHIP8_COMPUTED_GOTO
+/* Labels as values are a GNU extension, used by chip8_run and
+   chip8_run_blocks. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+/* A halted FX0A or 00FD counts as an instruction, after which the engines
+   return. Checking the opcode first lets the check fold away for the
+   others. */
+#define HALTED(op) (((op) == OP_FX0A || (op) == OP_00FD) && c8->halted)
+
+/* Whether pc may be at a polling loop, by its first instruction. */
+static inline bool may_poll(chip8 *c8)
+{
+  switch (decode_table[chip8_fetch(c8)]) {
+  case OP_FX07: case OP_EX9E: case OP_EXA1: case OP_6XNN:
+    return c8->skip_idle;
+  default:
+    return false;
+  }
+}
+
+/* Polling loops are looked for at the target of each jump, see
+   chip8_skip_idle. */
+#define SKIP_IDLE(op)                             \
+  do {                                            \
+    if ((op) == OP_1NNN && may_poll(c8)) {        \
+      n += chip8_skip_idle(c8, ncycles - n);      \
+    }                                             \
+  } while (0)
+
+uint64_t chip8_run(chip8 *c8, uint64_t ncycles)
+{
+  uint64_t n = 0;
+  struct chip8_uop u;
+
+  c8->draw_flag = false;
+  c8->halted = false;
+  chip8_prof_enter(c8);
+
+#if CHIP8_COMPUTED_GOTO
+#define OPCODE_LABEL(name) &&do_##name,
+  static void *const dispatch[OP_COUNT] = { CHIP8_OPCODES(OPCODE_LABEL) };
+#undef OPCODE_LABEL
+
+#define DISPATCH()                        \
+  do {                                    \
+    if (n == ncycles) {                   \
+      goto done;                          \
+    }                                     \
+    chip8_decode_uop(chip8_fetch(c8), &u); \
+    goto *dispatch[u.op];                 \
+  } while (0)
+
+  DISPATCH();
+#define OPCODE_BODY(name)                   \
+  do_##name:                                \
+    chip8_prof_op(c8, OP_##name);           \
+    opcode_##name(c8, &u);                  \
+    chip8_tick_timers(c8);                  \
+    ++n;                                    \
+    if (HALTED(OP_##name)) {                \
+      goto done;                            \
+    }                                       \
+    SKIP_IDLE(OP_##name);                   \
+    DISPATCH();
+  CHIP8_OPCODES(OPCODE_BODY)
+#undef OPCODE_BODY
+#undef DISPATCH
+
+done:
+#else
+  while (n < ncycles) {
+    chip8_decode_uop(chip8_fetch(c8), &u);
+    chip8_prof_op(c8, u.op);
+    chip8_execute(c8, &u);
+    chip8_tick_timers(c8);
+    ++n;
+    if (HALTED(u.op)) {
+      break;
+    }
+    SKIP_IDLE(u.op);
+  }
+#endif
+
+  chip8_prof_leave(c8);
+  c8->cycles += n;
+  return n;
+}
+
+static inline bool ends_block(enum chip8_op op)
+{
+  switch (op) {
+  case OP_00EE: case OP_1NNN: case OP_2NNN: case OP_3XNN: case OP_4XNN:
+  case OP_5XY0: case OP_9XY0: case OP_BNNN: case OP_EX9E: case OP_EXA1:
+  case OP_00FD: case OP_INVALID:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static struct chip8_block *bcache_build(chip8 *c8, uint16_t start)
+{
+  struct chip8_bcache *bc = c8->bcache;
+  struct chip8_uop uops[BLOCK_MAX_UOPS];
+  uint16_t n = 0;
+  uint16_t pc = start;
+
+  do {
+    opcode op = (c8->memory[pc] << 8) | c8->memory[pc+1];
+    chip8_decode_uop(op, &uops[n++]);
+    /* In XO-CHIP, F000 is followed by its operand, which the instruction
+       reads. Elsewhere it is invalid, and as long as other instructions. */
+    pc += uops[n-1].op == OP_F000 && c8->mode == CHIP8_MODE_XOCHIP ? 4 : 2;
+  } while (!ends_block(uops[n-1].op) && n < BLOCK_MAX_UOPS
+           && pc < BLOCK_PC_LIMIT(c8));
+
+  /* One more for the end marker. */
+  struct chip8_block *b = malloc(sizeof(*b) + (n+1) * sizeof(*b->uops));
+  if (!b) {
+    return NULL;
+  }
+  b->start = start;
+  b->end = pc;
+  b->nuops = n;
+  b->native = NULL;
+  b->native_tried = false;
+  memcpy(b->uops, uops, n * sizeof(*uops));
+  b->uops[n].op = OP_COUNT;
+
+  for (size_t p = start >> PAGE_SHIFT; p <= block_last_page(b); ++p) {
+    ++bc->page_blocks[p];
+  }
+  bc->blocks[start] = b;
+  return b;
+}
+
+struct chip8_block *chip8_block_at(chip8 *c8, uint16_t pc)
+{
+  if (!c8->bcache) {
+    c8->bcache = calloc(1, sizeof(*c8->bcache));
+    if (!c8->bcache) {
+      return NULL;
+    }
+  }
+  if (pc >= BLOCK_PC_LIMIT(c8)) {
+    return NULL;
+  }
+  struct chip8_block *b = c8->bcache->blocks[pc];
+  return b ? b : bcache_build(c8, pc);
+}
+
+uint64_t chip8_run_blocks(chip8 *c8, uint64_t ncycles)
+{
+  uint64_t n = 0;
+
+  if (!c8->bcache) {
+    c8->bcache = calloc(1, sizeof(*c8->bcache));
+    if (!c8->bcache) {
+      return chip8_run(c8, ncycles);
+    }
+  }
+  struct chip8_bcache *bc = c8->bcache;
+
+#if CHIP8_COMPUTED_GOTO
+#define OPCODE_LABEL(name) &&do_##name,
+  static void *const dispatch[OP_COUNT + 1] = {
+    CHIP8_OPCODES(OPCODE_LABEL) &&block_end
+  };
+#undef OPCODE_LABEL
+#endif
+
+  c8->draw_flag = false;
+  c8->halted = false;
+  chip8_prof_enter(c8);
+  while (n < ncycles) {
+    struct chip8_block *b = NULL;
+    if (c8->pc < BLOCK_PC_LIMIT(c8)) {
+      b = bc->blocks[c8->pc];
+      if (!b) {
+        b = bcache_build(c8, c8->pc);
+      }
+    }
+    if (!b || n + b->nuops > ncycles) {
+      /* Out of memory, at the end of memory, or the block would overrun the
+         cycle budget: interpret the next instruction instead. */
+      struct chip8_uop u;
+      chip8_decode_uop(chip8_fetch(c8), &u);
+      chip8_prof_op(c8, u.op);
+      chip8_execute(c8, &u);
+      chip8_tick_timers(c8);
+      ++n;
+      if (HALTED(u.op)) {
+        goto done;
+      }
+      SKIP_IDLE(u.op);
+      continue;
+    }
+
+    /* The block is freed if an instruction in it overwrites its code, in
+       which case it is left right after that instruction. */
+    uint32_t invalidations = bc->invalidations;
+    const struct chip8_uop *u = b->uops;
+#if CHIP8_COMPUTED_GOTO
+    goto *dispatch[u->op];
+#define OPCODE_BODY(name)                         \
+  do_##name:                                      \
+    chip8_prof_op(c8, OP_##name);                 \
+    opcode_##name(c8, u);                         \
+    chip8_tick_timers(c8);                        \
+    ++n;                                          \
+    if (HALTED(OP_##name)) {                      \
+      goto done;                                  \
+    }                                             \
+    SKIP_IDLE(OP_##name);                         \
+    if (bc->invalidations != invalidations) {     \
+      continue;                                   \
+    }                                             \
+    ++u;                                          \
+    goto *dispatch[u->op];
+    CHIP8_OPCODES(OPCODE_BODY)
+#undef OPCODE_BODY
+  block_end:
+    ;
+#else
+    do {
+      chip8_prof_op(c8, u->op);
+      chip8_execute(c8, u);
+      chip8_tick_timers(c8);
+      ++n;
+      if (HALTED(u->op)) {
+        goto done;
+      }
+      SKIP_IDLE(u->op);
+    } while (bc->invalidations == invalidations && (++u)->op != OP_COUNT);
+#endif
+  }
+done:
+
+  chip8_prof_leave(c8);
+  c8->cycles += n;
+  return n;
+}
+
+#undef HALTED
+#undef SKIP_IDLE
+
+#if CHIP8_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+static inline uint64_t rotr64(uint64_t v, unsigned n)
+{
+  return (v >> n) | (v << ((64 - n) & 63));
+}
+
+static inline uint32_t rotl32(uint32_t v, unsigned n)
+{
+  return (v << n) | (v >> ((32 - n) & 31));
 }
 
 static inline void chip8_inc_pc(chip8 *c8, bool skip_next_instruction)
 {
-  c8->pc += skip_next_instruction ? 4 : 2;
+  if (!skip_next_instruction) {
+    c8->pc += 2;
+    return;
+  }
+  /* In XO-CHIP, skipping F000 skips its operand too. */
+  bool long_op = c8->mode == CHIP8_MODE_XOCHIP
+                 && chip8_peek(c8, c8->pc + 2) == 0xF0
+                 && chip8_peek(c8, c8->pc + 3) == 0x00;
+  c8->pc += long_op ? 6 : 4;
+}
+
+/* Whether the instructions of SUPER-CHIP, or of XO-CHIP, are available. */
+static inline bool schip(const chip8 *c8)
+{
+  return c8->mode != CHIP8_MODE_CHIP8;
+}
+
+static inline bool xochip(const chip8 *c8)
+{
+  return c8->mode == CHIP8_MODE_XOCHIP;
 }
 
 /* Opcode description taken from Wikipedia:
    http://en.wikipedia.org/wiki/CHIP-8#Opcode_table */
 
-static inline void opcode_0x0000(chip8 *c8, opcode op)
+static inline void opcode_00E0(chip8 *c8, const struct chip8_uop *u)
 {
-  assert((op & 0xFF00) == 0x0000);
-  switch (op & 0x00FF) {
-  case 0x00E0:
-    /* 00E0 Clears the screen. */
-    memset(c8->gfx, 0, sizeof(c8->gfx));
-    c8->draw_flag = true;
-    break;
-  case 0x00EE:
-    /* 00EE Returns from a subroutine. */
-    c8->pc = c8->stack[--c8->sp];
-    break;
-  default:
-    /* 0NNN Calls RCA 1802 program at address NNN. */
-    fprintf(stderr, "Unknown opcode 0x%" PRIX16 "\n", op);
-    assert(0);
+  /* 00E0 Clears the screen, or in XO-CHIP the selected planes. */
+  if (schip(c8)) {
+    chip8_clear_planes(c8);
+  } else {
+    memset(c8->gfx[0], 0, DISPLAY_HEIGHT * sizeof(c8->gfx[0][0]));
   }
+  c8->draw_flag = true;
+  c8->erased = true;
+  chip8_mark_rows(c8, CHIP8_ALL_ROWS);
   chip8_inc_pc(c8, false);
 }
 
-static inline void opcode_0x1000(chip8 *c8, opcode op)
+static inline void opcode_00EE(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 00EE Returns from a subroutine. */
+  c8->pc = c8->stack[--c8->sp];
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_1NNN(chip8 *c8, const struct chip8_uop *u)
 {
   /* 1NNN Jumps to address NNN. */
-  assert((op & 0xF000) == 0x1000);
-  c8->pc = op & 0xFFF;
+  c8->pc = u->NNN;
 }
 
-static inline void opcode_0x2000(chip8 *c8, opcode op)
+static inline void opcode_2NNN(chip8 *c8, const struct chip8_uop *u)
 {
   /* 2NNN Calls subroutine at NNN. */
-  assert((op & 0xF000) == 0x2000);
   c8->stack[c8->sp++] = c8->pc;
-  c8->pc = op & 0xFFF;
+  c8->pc = u->NNN;
 }
 
-static inline void opcode_0x3000(chip8 *c8, opcode op)
+static inline void opcode_3XNN(chip8 *c8, const struct chip8_uop *u)
 {
   /* 3XNN Skips the next instruction if VX equals NN. */
-  assert((op & 0xF000) == 0x3000);
-  uint8_t X  = (op & 0x0F00) >> 8;
-  uint8_t NN = op & 0x00FF;
-  chip8_inc_pc(c8, c8->V[X] == NN);
+  chip8_inc_pc(c8, c8->V[u->X] == u->NN);
 }
 
-static inline void opcode_0x4000(chip8 *c8, opcode op)
+static inline void opcode_4XNN(chip8 *c8, const struct chip8_uop *u)
 {
   /* 4XNN Skips the next instruction if VX doesn't equal NN. */
-  assert((op & 0xF000) == 0x4000);
-  uint8_t X  = (op & 0x0F00) >> 8;
-  uint8_t NN = op & 0x00FF;
-  chip8_inc_pc(c8, c8->V[X] != NN);
+  chip8_inc_pc(c8, c8->V[u->X] != u->NN);
 }
 
-static inline void opcode_0x5000(chip8 *c8, opcode op)
+static inline void opcode_5XY0(chip8 *c8, const struct chip8_uop *u)
 {
   /* 5XY0 Skips the next instruction if VX equals VY. */
-  assert((op & 0xF00F) == 0x5000);
-  uint8_t X = (op & 0x0F00) >> 8;
-  uint8_t Y = (op & 0x00F0) >> 4;
-  chip8_inc_pc(c8, c8->V[X] == c8->V[Y]);
+  chip8_inc_pc(c8, c8->V[u->X] == c8->V[u->Y]);
 }
 
-static inline void opcode_0x6000(chip8 *c8, opcode op)
+static inline void opcode_6XNN(chip8 *c8, const struct chip8_uop *u)
 {
   /* 6XNN Sets VX to NN. */
-  assert((op & 0xF000) == 0x6000);
-  uint8_t X  = (op & 0x0F00) >> 8;
-  uint8_t NN = op & 0x00FF;
-  c8->V[X] = NN;
+  c8->V[u->X] = u->NN;
   chip8_inc_pc(c8, false);
 }
 
-static inline void opcode_0x7000(chip8 *c8, opcode op)
+static inline void opcode_7XNN(chip8 *c8, const struct chip8_uop *u)
 {
   /* 7XNN Adds NN to VX. */
-  assert((op & 0xF000) == 0x7000);
-  uint8_t X  = (op & 0x0F00) >> 8;
-  uint8_t NN = op & 0x00FF;
-  c8->V[X] += NN;
+  c8->V[u->X] += u->NN;
   chip8_inc_pc(c8, false);
 }
 
-static inline void opcode_0x8000(chip8 *c8, opcode op)
+static inline void opcode_8XY0(chip8 *c8, const struct chip8_uop *u)
 {
-  /* 8XYN X and Y identify data registers, N the operation */
-  assert((op & 0xF000) == 0x8000);
-  uint8_t X = (op & 0x0F00) >> 8;
-  uint8_t Y = (op & 0x00F0) >> 4;
-  switch (op & 0x000F) {
-  case 0x0000:
-    /* 8XY0 Sets VX to the value of VY. */
-    c8->V[X] = c8->V[Y];
-    break;
-  case 0x0001:
-    /* 8XY1 Sets VX to VX or VY. */
-    c8->V[X] |= c8->V[Y];
-    break;
-  case 0x0002:
-    /* 8XY2 Sets VX to VX and VY. */
-    c8->V[X] &= c8->V[Y];
-    break;
-  case 0x0003:
-    /* 8XY3 Sets VX to VX xor VY. */
-    c8->V[X] ^= c8->V[Y];
-    break;
-  case 0x0004:
-    /* 8XY4 Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when
-       there isn't. */
-    c8->V[0xF] = (c8->V[Y] > (0xFF - c8->V[X])) ? 1 : 0;
-    c8->V[X] += c8->V[Y];
-    break;
-  case 0x0005:
-    /* 8XY5 VY is subtracted from VX. VF is set to 0 when there's a borrow, and
-       1 when there isn't. */
-    c8->V[0xF] = (c8->V[Y] > c8->V[X]) ? 0 : 1;
-    c8->V[X] -= c8->V[Y];
-    break;
-  case 0x0006:
-    /* 8XY6 Shifts VX right by one. VF is set to the value of the least
-       significant bit of VX before the shift. */
-    c8->V[0xF] = c8->V[X] & 0x1;
-    c8->V[X] >>= 1;
-    break;
-  case 0x0007:
-    /* 8XY7 Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1
-       when there isn't. */
-    c8->V[0xF] = (c8->V[X] > c8->V[Y]) ? 0 : 1;
-    c8->V[X] = c8->V[Y] - c8->V[X];
-    break;
-  case 0x000E:
-    /* 8XYE Shifts VX left by one. VF is set to the value of the most
-       significant bit of VX before the shift. */
-    c8->V[0xF] = (c8->V[X] & 0x80) >> 7;
-    c8->V[X] <<= 1;
-    break;
-  default:
-    fprintf(stderr, "Unknown opcode 0x%" PRIX16 "\n", op);
-    assert(0);
-  }
+  /* 8XY0 Sets VX to the value of VY. */
+  c8->V[u->X] = c8->V[u->Y];
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_8XY1(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 8XY1 Sets VX to VX or VY. */
+  c8->V[u->X] |= c8->V[u->Y];
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_8XY2(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 8XY2 Sets VX to VX and VY. */
+  c8->V[u->X] &= c8->V[u->Y];
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_8XY3(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 8XY3 Sets VX to VX xor VY. */
+  c8->V[u->X] ^= c8->V[u->Y];
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_8XY4(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 8XY4 Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when
+     there isn't. */
+  c8->V[0xF] = (c8->V[u->Y] > (0xFF - c8->V[u->X])) ? 1 : 0;
+  c8->V[u->X] += c8->V[u->Y];
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_8XY5(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 8XY5 VY is subtracted from VX. VF is set to 0 when there's a borrow, and
+     1 when there isn't. */
+  c8->V[0xF] = (c8->V[u->Y] > c8->V[u->X]) ? 0 : 1;
+  c8->V[u->X] -= c8->V[u->Y];
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_8XY6(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 8XY6 Shifts VX right by one. VF is set to the value of the least
+     significant bit of VX before the shift. */
+  c8->V[0xF] = c8->V[u->X] & 0x1;
+  c8->V[u->X] >>= 1;
   chip8_inc_pc(c8, false);
 }
 
-static inline void opcode_0x9000(chip8 *c8, opcode op)
+static inline void opcode_8XY7(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 8XY7 Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1
+     when there isn't. */
+  c8->V[0xF] = (c8->V[u->X] > c8->V[u->Y]) ? 0 : 1;
+  c8->V[u->X] = c8->V[u->Y] - c8->V[u->X];
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_8XYE(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 8XYE Shifts VX left by one. VF is set to the value of the most
+     significant bit of VX before the shift. */
+  c8->V[0xF] = (c8->V[u->X] & 0x80) >> 7;
+  c8->V[u->X] <<= 1;
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_9XY0(chip8 *c8, const struct chip8_uop *u)
 {
   /* 9XY0 Skips the next instruction if VX doesn't equal VY. */
-  assert((op & 0xF00F) == 0x9000);
-  uint8_t X = (op & 0x0F00) >> 8;
-  uint8_t Y = (op & 0x00F0) >> 4;
-  chip8_inc_pc(c8, c8->V[X] != c8->V[Y]);
+  chip8_inc_pc(c8, c8->V[u->X] != c8->V[u->Y]);
 }
 
-static inline void opcode_0xA000(chip8 *c8, opcode op)
+static inline void opcode_ANNN(chip8 *c8, const struct chip8_uop *u)
 {
   /* ANNN Sets I to the address NNN. */
-  assert((op & 0xF000) == 0xA000);
-  c8->I = op & 0xFFF;
+  c8->I = u->NNN;
   chip8_inc_pc(c8, false);
 }
 
-static inline void opcode_0xB000(chip8 *c8, opcode op)
+static inline void opcode_BNNN(chip8 *c8, const struct chip8_uop *u)
 {
   /* BNNN Jumps to the address NNN plus V0. */
-  assert((op & 0xF000) == 0xB000);
-  c8->pc = (op & 0xFFF) + c8->V[0];
+  c8->pc = u->NNN + c8->V[0];
 }
 
-static inline void opcode_0xC000(chip8 *c8, opcode op)
+static inline void opcode_CXNN(chip8 *c8, const struct chip8_uop *u)
 {
   /* CXNN Sets VX to a random number and NN. */
-  assert((op & 0xF000) == 0xC000);
-  uint8_t X  = (op & 0x0F00) >> 8;
-  uint8_t NN = op & 0x00FF;
-  c8->V[X] = NN & rand(); /* TODO */
+  c8->V[u->X] = u->NN & chip8_random(&c8->rng);
   chip8_inc_pc(c8, false);
 }
 
-static inline void opcode_0xD000(chip8 *c8, opcode op)
+static inline void opcode_DXYN(chip8 *c8, const struct chip8_uop *u)
 {
   /* DXYN Draws a sprite at coordinate (VX, VY) that has a width of 8 pixels
      and a height of N pixels. Each row of 8 pixels is read as bit-coded (with
@@ -327,116 +1145,355 @@ static inline void opcode_0xD000(chip8 *c8, opcode op)
      instruction. As described above, VF is set to 1 if any screen pixels are
      flipped from set to unset when the sprite is drawn, and to 0 if that
      doesn't happen. */
-  assert((op & 0xF000) == 0xD000);
-  uint8_t X = (op & 0x0F00) >> 8;
-  uint8_t Y = (op & 0x00F0) >> 4;
-  uint8_t N = op & 0x000F;
-
-  c8->V[0xF] = 0;
-  for (uint8_t row = 0; row < N; ++row) {
-    uint8_t sprite_row = c8->memory[c8->I+row];
-    for (uint8_t col = 0; col < 8; ++col) {
-      if ((sprite_row & (0x80 >> col)) != 0) {
-        /* Wrap around if sprite is at the edge. */
-        uint8_t x = (c8->V[X] + col) % DISPLAY_WIDTH;
-        uint8_t y = (c8->V[Y] + row) % DISPLAY_HEIGHT;
-        if (c8->gfx[x][y] == 1) {
-          c8->V[0xF] = 1;
-        }
-        c8->gfx[x][y] ^= 1;
-      }
+
+  /* In SUPER-CHIP and XO-CHIP, DXY0 draws a 16x16 sprite, and sprites may
+     be drawn in high resolution and to both planes. */
+  if (schip(c8)) {
+    bool erased = chip8_draw_sprite(c8, c8->V[u->X], c8->V[u->Y], u->N);
+    c8->V[0xF] = erased;
+    c8->draw_flag = true;
+    c8->erased = erased;
+    chip8_inc_pc(c8, false);
+    return;
+  }
+
+  /* Each sprite row is placed at the left edge of a display row and rotated
+     into position, which also wraps it around if it is at the edge. */
+  unsigned x = c8->V[u->X] % DISPLAY_WIDTH;
+  unsigned y = c8->V[u->Y] % DISPLAY_HEIGHT;
+  uint64_t collision = 0;
+  for (uint8_t row = 0; row < u->N; ++row) {
+    uint64_t sprite = rotr64(
+      (uint64_t) chip8_peek(c8, c8->I + row) << 56, x);
+    uint64_t *line = &c8->gfx[0][(y + row) % DISPLAY_HEIGHT][0];
+    collision |= *line & sprite;
+    *line ^= sprite;
+  }
+  c8->V[0xF] = collision != 0;
+  c8->draw_flag = true;
+  c8->erased = collision != 0;
+  chip8_mark_rows(c8, rotl32((UINT32_C(1) << u->N) - 1, y));
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_EX9E(chip8 *c8, const struct chip8_uop *u)
+{
+  /* EX9E Skips the next instruction if the key stored in VX is pressed. */
+  chip8_inc_pc(c8, c8->key[c8->V[u->X] & 0xF]);
+}
+
+static inline void opcode_EXA1(chip8 *c8, const struct chip8_uop *u)
+{
+  /* EXA1 Skips the next instruction if the key stored in VX isn't pressed. */
+  chip8_inc_pc(c8, !c8->key[c8->V[u->X] & 0xF]);
+}
+
+static inline void opcode_FX07(chip8 *c8, const struct chip8_uop *u)
+{
+  /* FX07 Sets VX to the value of the delay timer. */
+  c8->V[u->X] = c8->delay_timer;
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_FX0A(chip8 *c8, const struct chip8_uop *u)
+{
+  /* FX0A A key press is awaited, and then stored in VX. Without a key
+     pressed the machine halts on the instruction, which is executed again
+     once resumed. */
+  for (uint8_t i = 0; i < 0x10; ++i) {
+    if (c8->key[i]) {
+      c8->V[u->X] = i;
+      chip8_inc_pc(c8, false);
+      return;
     }
   }
+  c8->halted = true;
+}
+
+static inline void opcode_FX15(chip8 *c8, const struct chip8_uop *u)
+{
+  /* FX15 Sets the delay timer to VX. */
+  c8->delay_timer = c8->V[u->X];
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_FX18(chip8 *c8, const struct chip8_uop *u)
+{
+  /* FX18 Sets the sound timer to VX. */
+  c8->sound_timer = c8->V[u->X];
+  if (c8->audio) {
+    chip8_audio_sound(c8);
+  }
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_FX1E(chip8 *c8, const struct chip8_uop *u)
+{
+  /* FX1E Adds VX to I. */
+  c8->V[0xF] = (c8->I > (0xFFF - c8->V[u->X])) ? 1 : 0;
+  c8->I += c8->V[u->X];
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_FX29(chip8 *c8, const struct chip8_uop *u)
+{
+  /* FX29 Sets I to the location of the sprite for the character in VX.
+     Characters 0-F (in hexadecimal) are represented by a 4x5 font. */
+  assert(c8->V[u->X] <= 0xF);
+  c8->I = c8->V[u->X] * 5;
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_FX33(chip8 *c8, const struct chip8_uop *u)
+{
+  /* FX33 Stores the Binary-coded decimal representation of VX, with the
+     most significant of three digits at the address in I, the middle digit
+     at I plus 1, and the least significant digit at I plus 2. (In other
+     words, take the decimal representation of VX, place the hundreds digit
+     in memory at location in I, the tens digit at location I+1, and the
+     ones digit at location I+2.) */
+  uint8_t bcd[3] = {
+    c8->V[u->X] / 100,
+    (c8->V[u->X] % 100) / 10,
+    c8->V[u->X] % 10
+  };
+  chip8_write_memory(c8, c8->I, bcd, sizeof(bcd));
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_FX55(chip8 *c8, const struct chip8_uop *u)
+{
+  /* FX55 Stores V0 to VX in memory starting at address I. */
+  chip8_write_memory(c8, c8->I, c8->V, u->X+1);
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_FX65(chip8 *c8, const struct chip8_uop *u)
+{
+  /* FX65 Fills V0 to VX with values from memory starting at address I. */
+  chip8_read_memory(c8, c8->I, c8->V, u->X+1);
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_00CN(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 00CN Scrolls the display down by N pixels. (SUPER-CHIP) */
+  if (!schip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  chip8_scroll_down(c8, u->N);
   c8->draw_flag = true;
   chip8_inc_pc(c8, false);
 }
 
-static inline void opcode_0xE000(chip8 *c8, opcode op)
+static inline void opcode_00FB(chip8 *c8, const struct chip8_uop *u)
 {
-  assert((op & 0xF000) == 0xE000);
-  uint8_t X = (op & 0x0F00) >> 8;
-  switch (op & 0x00FF) {
-  case 0x009E:
-    /* EX9E Skips the next instruction if the key stored in VX is pressed. */
-    chip8_inc_pc(c8, c8->key[c8->V[X]]);
-    break;
-  case 0x00A1:
-    /* EXA1 Skips the next instruction if the key stored in VX isn't pressed.
-     */
-    chip8_inc_pc(c8, !c8->key[c8->V[X]]);
-    break;
-  default:
-    fprintf(stderr, "Unknown opcode 0x%" PRIX16 "\n", op);
-    assert(0);
+  /* 00FB Scrolls the display right by 4 pixels. (SUPER-CHIP) */
+  if (!schip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
   }
+  chip8_scroll_right(c8);
+  c8->draw_flag = true;
+  chip8_inc_pc(c8, false);
 }
 
-static inline void opcode_0xF000(chip8 *c8, opcode op,
-                                 void (*wait_for_input)(void))
+static inline void opcode_00FC(chip8 *c8, const struct chip8_uop *u)
 {
-  assert((op & 0xF000) == 0xF000);
-  uint8_t X = (op & 0x0F00) >> 8;
-  switch (op & 0x00FF) {
-  case 0x0007:
-    /* FX07 Sets VX to the value of the delay timer. */
-    c8->V[X] = c8->delay_timer;
-    break;
-  case 0x000A: {
-    /* FX0A A key press is awaited, and then stored in VX. */
-    bool key_pressed = false;
-    while (!key_pressed) {
-      wait_for_input();
-      for (uint8_t i = 0; i < 0x10; ++i) {
-        if (c8->key[i]) {
-          c8->V[X] = i;
-          key_pressed = true;
-          break;
-        }
-      }
+  /* 00FC Scrolls the display left by 4 pixels. (SUPER-CHIP) */
+  if (!schip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  chip8_scroll_left(c8);
+  c8->draw_flag = true;
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_00FD(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 00FD Exits the interpreter. (SUPER-CHIP) The machine halts on the
+     instruction for good. */
+  if (!schip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  c8->halted = true;
+}
+
+/* Switching resolution clears the display. */
+static inline void set_resolution(chip8 *c8, bool hires)
+{
+  c8->hires = hires;
+  memset(c8->gfx, 0, chip8_gfx_rows(c8) * sizeof(c8->gfx[0][0]));
+  c8->draw_flag = true;
+  c8->erased = true;
+  chip8_mark_rows(c8, CHIP8_ALL_ROWS);
+}
+
+static inline void opcode_00FE(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 00FE Switches to 64x32 low resolution. (SUPER-CHIP) */
+  if (!schip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  set_resolution(c8, false);
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_00FF(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 00FF Switches to 128x64 high resolution. (SUPER-CHIP) */
+  if (!schip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  set_resolution(c8, true);
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_FX30(chip8 *c8, const struct chip8_uop *u)
+{
+  /* FX30 Sets I to the location of the 8x10 sprite for the character in VX.
+     (SUPER-CHIP, with the letters A-F from XO-CHIP) */
+  if (!schip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  c8->I = BIG_FONT_START + (c8->V[u->X] & 0xF) * 10;
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_FX75(chip8 *c8, const struct chip8_uop *u)
+{
+  /* FX75 Stores V0 to VX in the flags registers. (SUPER-CHIP) */
+  if (!schip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  memcpy(c8->flags, c8->V, u->X+1);
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_FX85(chip8 *c8, const struct chip8_uop *u)
+{
+  /* FX85 Fills V0 to VX from the flags registers. (SUPER-CHIP) */
+  if (!schip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  memcpy(c8->V, c8->flags, u->X+1);
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_00DN(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 00DN Scrolls the selected planes up by N pixels. (XO-CHIP) */
+  if (!xochip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  chip8_scroll_up(c8, u->N);
+  c8->draw_flag = true;
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_5XY2(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 5XY2 Stores VX to VY, in either order, in memory starting at address I.
+     (XO-CHIP) */
+  if (!xochip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  int step = u->X <= u->Y ? 1 : -1;
+  uint16_t addr = c8->I;
+  for (int x = u->X; ; x += step) {
+    chip8_write_memory(c8, addr++, &c8->V[x], 1);
+    if (x == u->Y) {
+      break;
     }
-    break;
   }
-  case 0x0015:
-    /* FX15 Sets the delay timer to VX. */
-    c8->delay_timer = c8->V[X];
-    break;
-  case 0x0018:
-    /* FX18 Sets the sound timer to VX. */
-    c8->sound_timer = c8->V[X];
-    break;
-  case 0x001E:
-    /* FX1E Adds VX to I. */
-    c8->V[0xF] = (c8->I > (0xFFF - c8->V[X])) ? 1 : 0;
-    c8->I += c8->V[X];
-    break;
-  case 0x0029:
-    /* FX29 Sets I to the location of the sprite for the character in VX.
-       Characters 0-F (in hexadecimal) are represented by a 4x5 font. */
-    assert(c8->V[X] <= 0xF);
-    c8->I = c8->V[X] * 5;
-    break;
-  case 0x0033:
-    /* FX33 Stores the Binary-coded decimal representation of VX, with the
-       most significant of three digits at the address in I, the middle digit
-       at I plus 1, and the least significant digit at I plus 2. (In other
-       words, take the decimal representation of VX, place the hundreds digit
-       in memory at location in I, the tens digit at location I+1, and the
-       ones digit at location I+2.) */
-    c8->memory[c8->I]   = c8->V[X] / 100;
-    c8->memory[c8->I+1] = (c8->V[X] % 100) / 10;
-    c8->memory[c8->I+2] = c8->V[X] % 10;
-    break;
-  case 0x0055:
-    /* FX55 Stores V0 to VX in memory starting at address I. */
-    memcpy(c8->memory + c8->I, c8->V, X+1);
-    break;
-  case 0x0065:
-    /* FX65 Fills V0 to VX with values from memory starting at address I. */
-    memcpy(c8->V, c8->memory + c8->I, X+1);
-    break;
-  default:
-    fprintf(stderr, "Unknown opcode 0x%" PRIX16 "\n", op);
-    assert(0);
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_5XY3(chip8 *c8, const struct chip8_uop *u)
+{
+  /* 5XY3 Fills VX to VY, in either order, from memory starting at address
+     I. (XO-CHIP) */
+  if (!xochip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  int step = u->X <= u->Y ? 1 : -1;
+  uint16_t addr = c8->I;
+  for (int x = u->X; ; x += step) {
+    c8->V[x] = chip8_peek(c8, addr++);
+    if (x == u->Y) {
+      break;
+    }
   }
   chip8_inc_pc(c8, false);
 }
+
+static inline void opcode_F000(chip8 *c8, const struct chip8_uop *u)
+{
+  /* F000 NNNN Sets I to the 16-bit address NNNN following the instruction.
+     (XO-CHIP) */
+  if (!xochip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  c8->I = chip8_peek(c8, c8->pc + 2) << 8 | chip8_peek(c8, c8->pc + 3);
+  c8->pc += 4;
+}
+
+static inline void opcode_FN01(chip8 *c8, const struct chip8_uop *u)
+{
+  /* FN01 Selects the planes drawn to, scrolled and cleared as the bits of
+     N. (XO-CHIP) */
+  if (!xochip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  c8->planes = u->X & ((1u << DISPLAY_PLANES) - 1);
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_F002(chip8 *c8, const struct chip8_uop *u)
+{
+  /* F002 Loads the 16-byte audio pattern from memory at address I.
+     (XO-CHIP) */
+  if (!xochip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  chip8_read_memory(c8, c8->I, c8->pattern, sizeof(c8->pattern));
+  if (c8->audio) {
+    chip8_audio_pattern(c8);
+  }
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_FX3A(chip8 *c8, const struct chip8_uop *u)
+{
+  /* FX3A Sets the pitch of the audio pattern to VX. (XO-CHIP) */
+  if (!xochip(c8)) {
+    opcode_INVALID(c8, u);
+    return;
+  }
+  c8->pitch = c8->V[u->X];
+  if (c8->audio) {
+    chip8_audio_pitch(c8);
+  }
+  chip8_inc_pc(c8, false);
+}
+
+static inline void opcode_INVALID(chip8 *c8, const struct chip8_uop *u)
+{
+  fprintf(stderr, "Unknown opcode 0x%" PRIX16 "\n", chip8_fetch(c8));
+  assert(0);
+  chip8_inc_pc(c8, false);
+}
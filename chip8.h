@@ -1,30 +1,268 @@
+#ifndef CHIP8_H
+#define CHIP8_H
+
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define DISPLAY_WIDTH 64
 #define DISPLAY_HEIGHT 32
 
+/* SUPER-CHIP and XO-CHIP switch to a 128x64 high resolution, and XO-CHIP
+   draws to two bitplanes. The framebuffer holds both planes at the high
+   resolution, see chip8.gfx. */
+#define DISPLAY_HIRES_WIDTH 128
+#define DISPLAY_HIRES_HEIGHT 64
+#define DISPLAY_PLANES 2
+#define DISPLAY_ROW_WORDS (DISPLAY_HIRES_WIDTH / 64)
+
+/* Bytes of memory of CHIP-8 and SUPER-CHIP, and of XO-CHIP. */
+#define CHIP8_MEMORY_SIZE 0x1000
+#define XOCHIP_MEMORY_SIZE 0x10000
+
 #define RENDER_SCALE 15
 
+/* Seed of the random numbers of CXNN unless set with chip8_seed. */
+#define CHIP8_DEFAULT_SEED 0x43484950382D3821ULL
+
+/* Instructions per second of guest time unless set with chip8_set_cpu_rate.
+   The timers tick at 60 Hz of guest time, every 10 instructions. */
+#define CHIP8_DEFAULT_CPU_HZ 600
+#define CHIP8_TIMER_HZ 60
+
 typedef uint16_t opcode;
 
-typedef void(*input_wait_fun)(void);
+/* The instruction set of a machine, see chip8_set_mode. */
+enum chip8_mode {
+  CHIP8_MODE_CHIP8,   /* 64x32, 4 KB of memory */
+  CHIP8_MODE_SCHIP,   /* SUPER-CHIP 1.1: 128x64, scrolling, 16x16 sprites */
+  CHIP8_MODE_XOCHIP,  /* XO-CHIP: SUPER-CHIP, 64 KB of memory, two planes */
+};
+
+struct chip8;
+/* An execution engine: chip8_run, chip8_run_blocks or chip8_run_jit. */
+typedef uint64_t (*chip8_run_fun)(struct chip8 *, uint64_t);
+
+struct chip8_audio;
+struct chip8_bcache;
+struct chip8_hash;
+struct chip8_jit;
+struct chip8_pages;
+struct chip8_pool;
+struct chip8_profile;
+struct chip8_snapshot;
+
+/* Machines are aligned to cache lines, so that the registers used by every
+   instruction fill one line of their own. */
+#define CHIP8_CACHE_LINE 64
+#ifdef __GNUC__
+#define CHIP8_ALIGNED __attribute__((aligned(CHIP8_CACHE_LINE)))
+#else
+#define CHIP8_ALIGNED
+#endif
 
-typedef struct chip8 {
-  uint8_t memory[0x1000];
+/* Fields are laid out by how often they are used: the registers and state
+   of every instruction first, in one cache line, then the rest of the
+   registers, and last what chip8_reset keeps. */
+typedef struct CHIP8_ALIGNED chip8 {
   uint8_t V[0x10];  /* Data registers */
   uint16_t I;       /* Index register */
   uint16_t pc;
+  uint16_t sp;
   uint8_t delay_timer;
   uint8_t sound_timer;
-  uint16_t stack[0x10];
-  uint16_t sp;
-  uint8_t gfx[DISPLAY_WIDTH][DISPLAY_HEIGHT];
-  bool draw_flag;
+  uint32_t cycles_per_tick; /* Instructions per 60 Hz timer tick */
+  uint32_t tick_cycles;     /* Instructions since the last timer tick */
+  uint64_t cycles;  /* Instructions executed */
   bool key[0x10];
+  uint8_t mode;         /* enum chip8_mode */
+  bool hires;           /* 00FF switched to 128x64 */
+  uint8_t planes;       /* Bitplanes drawn to, selected with FN01 */
+  bool draw_flag;
+  bool halted;          /* Waiting in FX0A for a key press */
+  bool erased;          /* The last DXYN turned pixels off */
+  bool skip_idle;       /* See chip8_set_idle_skip */
+
+  uint16_t stack[0x10];
+  uint64_t rng;         /* State of the random numbers of CXNN */
+  uint64_t dirty_rows;  /* Bit y is set when row y changes, see below */
+  uint8_t flags[0x10];  /* Saved by FX75 */
+  uint8_t pitch;        /* Set by FX3A */
+  uint8_t pattern[16];  /* Audio pattern loaded by F002 */
+
+  /* chip8_memory_size bytes, allocated in one block with gfx */
+  uint8_t *memory;
+  /* Rows of each plane, MSB of the first word being the leftmost pixel,
+     of which the machine has chip8_gfx_rows. In low resolution only the
+     first word of the first 32 rows is used. */
+  uint64_t (*gfx)[DISPLAY_HIRES_HEIGHT][DISPLAY_ROW_WORDS];
+  uint32_t memory_alloc;        /* Bytes of memory allocated */
+  uint32_t gfx_alloc;           /* Rows of gfx allocated */
+
+  uint64_t dirty_pages[4];      /* Pages written since the last snapshot */
+  uint64_t written_pages[4];    /* Pages written since created or reset */
+  uint64_t unhashed_pages[4];   /* Pages written since chip8_state_hash */
+  uint64_t unhashed_rows;       /* Rows changed since chip8_state_hash */
+  struct chip8_bcache *bcache;  /* Used by chip8_run_blocks and the JIT */
+  struct chip8_jit *jit;        /* Used by chip8_run_jit */
+  struct chip8_pages *pages;    /* Pages shared with snapshots */
+  struct chip8_profile *profile; /* See profile.h */
+  struct chip8_audio *audio;     /* See audio.h */
+  struct chip8_hash *hash;       /* See chip8_state_hash */
 } chip8;
 
 chip8 *chip8_init(void);
 void chip8_destroy(chip8 *);
+/* Puts a machine back in the state chip8_init leaves it in, keeping the
+   code its engines decoded, its snapshots and what is attached to it. Only
+   the registers, the framebuffer and the memory pages written since it was
+   created or last reset are cleared. */
+void chip8_reset(chip8 *);
+
+/* Machines kept by the thousand are best created together: a pool holds n
+   machines, fresh from chip8_init, with their registers in one contiguous
+   block and their memory in blocks of their own. They are freed with the
+   pool rather than with chip8_destroy. Returns NULL if out of memory. */
+struct chip8_pool *chip8_pool_new(size_t n);
+void chip8_pool_free(struct chip8_pool *);
+size_t chip8_pool_size(const struct chip8_pool *);
+chip8 *chip8_pool_get(struct chip8_pool *, size_t i);
+/* Resets every machine of the pool with chip8_reset. */
+void chip8_pool_reset(struct chip8_pool *);
 bool chip8_load_rom(chip8 *, char *);
-void chip8_emulate_cycle(chip8 *, input_wait_fun);
+/* Loads a ROM from memory. Returns false if it is too big. */
+bool chip8_load_rom_data(chip8 *, const uint8_t *, size_t);
+/* Frontends upload the rows set in dirty_rows and clear it once drawn. Every
+   row is dirty after chip8_init, and rows replaced by restoring or rewinding
+   are marked dirty if they differ. */
+#define CHIP8_ALL_ROWS UINT64_MAX
+
+/* Switches a machine that has just been created to the instruction set of
+   SUPER-CHIP or XO-CHIP, loading their large font. Both add the 128x64 high
+   resolution, scrolling and 16x16 sprites; XO-CHIP adds 64 KB of memory, a
+   second bitplane and its audio registers. Other instructions keep their
+   semantics. Machines only allocate the memory and the framebuffer of
+   their mode, so this allocates more. Returns false if out of memory. */
+bool chip8_set_mode(chip8 *, enum chip8_mode);
+/* Makes the engines skip the iterations of polling loops, on by default.
+   A loop jumped to that reads the delay timer or a key and jumps back to
+   itself until it changes repeats the same state each iteration, so guest
+   time goes straight to the next timer tick, or for keys to the end of the
+   run, without executing it. Runs end in the same state either way, with
+   the skipped instructions counted as executed. */
+void chip8_set_idle_skip(chip8 *, bool);
+/* Sets the number of instructions per second of guest time. */
+void chip8_set_cpu_rate(chip8 *, uint32_t hz);
+/* Seeds the random numbers of CXNN. Each machine has its own, so runs with
+   the same seed and input are identical. */
+void chip8_seed(chip8 *, uint64_t seed);
+void chip8_emulate_cycle(chip8 *);
+/* Executes up to the given number of instructions without returning in
+   between, and returns the number executed. draw_flag is set if any of them
+   drew to the screen.
+
+   FX0A without a key pressed counts as an instruction and halts the machine:
+   halted is set, pc stays on FX0A and the engine returns right away. The
+   caller lets time pass with chip8_idle until a key is pressed with
+   chip8_key_event, or runs it again to retry. 00FD halts the same way, for
+   good, see chip8_exited. */
+uint64_t chip8_run(chip8 *, uint64_t);
+/* Like chip8_run, but decodes each basic block once and executes it from a
+   cache afterwards. Blocks are dropped when memory they were decoded from is
+   written. */
+uint64_t chip8_run_blocks(chip8 *, uint64_t);
+/* Like chip8_run_blocks, but translates blocks to native x86-64 code. Falls
+   back to chip8_run_blocks on other hosts. */
+uint64_t chip8_run_jit(chip8 *, uint64_t);
+/* Makes chip8_run_jit check every translated block against the interpreter,
+   aborting with a report on the first difference. */
+void chip8_jit_set_lockstep(chip8 *, bool);
+/* Presses or releases one of the 16 keys. Pressing a key resumes a halted
+   machine. */
+void chip8_key_event(chip8 *, uint8_t key, bool pressed);
+/* Lets guest time pass as if the given number of instructions had executed,
+   without executing any: the timers keep ticking while halted. */
+void chip8_idle(chip8 *, uint64_t cycles);
+
+/* Bytes of memory a machine has: 64 KB in XO-CHIP mode, 4 KB otherwise.
+   Addresses wrap around at the end. */
+static inline size_t chip8_memory_size(const chip8 *c8)
+{
+  return c8->mode == CHIP8_MODE_XOCHIP ? XOCHIP_MEMORY_SIZE
+                                       : CHIP8_MEMORY_SIZE;
+}
+
+/* Rows of the framebuffer a machine has, those of the first plane and then
+   those of the second: the 32 of low resolution in CHIP-8 mode, one plane
+   in SUPER-CHIP mode and both in XO-CHIP mode. */
+static inline size_t chip8_gfx_rows(const chip8 *c8)
+{
+  return c8->mode == CHIP8_MODE_CHIP8 ? DISPLAY_HEIGHT
+         : c8->mode == CHIP8_MODE_SCHIP ? DISPLAY_HIRES_HEIGHT
+         : DISPLAY_PLANES * DISPLAY_HIRES_HEIGHT;
+}
+
+/* Copies the framebuffer to gfx, laid out as both planes of chip8.gfx, with
+   the rows the machine does not have as 0. */
+void chip8_copy_from_gfx(const chip8 *, uint64_t *gfx);
+
+static inline uint8_t chip8_peek(const chip8 *c8, uint32_t addr)
+{
+  return c8->memory[addr & (chip8_memory_size(c8) - 1)];
+}
+
+/* Returns whether a halted machine stopped on the 00FD exit of SUPER-CHIP
+   and XO-CHIP rather than waiting for a key. */
+static inline bool chip8_exited(const chip8 *c8)
+{
+  return c8->halted && c8->mode != CHIP8_MODE_CHIP8
+         && chip8_peek(c8, c8->pc) == 0x00
+         && chip8_peek(c8, c8->pc + 1) == 0xFD;
+}
+
+/* Snapshots hold the whole machine state. Memory is kept in 256-byte pages,
+   shared between snapshots and the machines they were taken from or
+   restored to until written, so that both only copy the pages written since
+   the last snapshot or restore. Return NULL or false if out of memory. */
+struct chip8_snapshot *chip8_snapshot(chip8 *);
+bool chip8_restore(chip8 *, const struct chip8_snapshot *);
+void chip8_snapshot_free(struct chip8_snapshot *);
+/* Returns a new machine in the same state. */
+chip8 *chip8_fork(chip8 *);
+
+/* Returns a 64-bit hash of the state of a machine: its registers, memory
+   and framebuffer, leaving out the count of instructions executed and what
+   only frontends use. Machines in the same state hash the same, so hashes
+   can key tables of the states seen by a search. The hashes of the memory
+   pages and framebuffer rows are kept from one call to the next, and only
+   those written in between are hashed again. Built with CHIP8_VERIFY_HASH,
+   as by make debug, each call checks the result against
+   chip8_state_hash_full and aborts with a report if they differ. */
+uint64_t chip8_state_hash(chip8 *);
+/* Returns the same hash, computed over the whole state. */
+uint64_t chip8_state_hash_full(const chip8 *);
+
+/* The size of the display in its current resolution. */
+static inline unsigned chip8_width(const chip8 *c8)
+{
+  return c8->hires ? DISPLAY_HIRES_WIDTH : DISPLAY_WIDTH;
+}
+
+static inline unsigned chip8_height(const chip8 *c8)
+{
+  return c8->hires ? DISPLAY_HIRES_HEIGHT : DISPLAY_HEIGHT;
+}
+
+/* Returns the planes in which the pixel at (x, y) is set, as bits: 0 if it
+   is off, 1 if it is only set in the first plane. */
+static inline unsigned chip8_pixel(const chip8 *c8, unsigned x, unsigned y)
+{
+  unsigned color = 0;
+  for (unsigned p = 0; p * DISPLAY_HIRES_HEIGHT + y < chip8_gfx_rows(c8);
+       ++p) {
+    color |= ((c8->gfx[p][y][x / 64] >> (63 - x % 64)) & 1) << p;
+  }
+  return color;
+}
+
+#endif
@@ -0,0 +1,259 @@
+/* Internals of the core shared by the execution engines. */
+
+#ifndef CHIP8_INTERNAL_H
+#define CHIP8_INTERNAL_H
+
+#include <stddef.h>
+
+#include "chip8.h"
+
+/* All instructions, named after their opcode pattern. INVALID stands for any
+   opcode that does not decode to an instruction. The second group is only
+   valid in SUPER-CHIP mode, and the last in XO-CHIP mode; in other modes
+   they execute as INVALID. */
+#define CHIP8_OPCODES(X)                                                      \
+  X(00E0) X(00EE) X(1NNN) X(2NNN) X(3XNN) X(4XNN) X(5XY0) X(6XNN) X(7XNN)     \
+  X(8XY0) X(8XY1) X(8XY2) X(8XY3) X(8XY4) X(8XY5) X(8XY6) X(8XY7) X(8XYE)     \
+  X(9XY0) X(ANNN) X(BNNN) X(CXNN) X(DXYN) X(EX9E) X(EXA1) X(FX07) X(FX0A)     \
+  X(FX15) X(FX18) X(FX1E) X(FX29) X(FX33) X(FX55) X(FX65)                     \
+  X(00CN) X(00FB) X(00FC) X(00FD) X(00FE) X(00FF) X(FX30) X(FX75) X(FX85)     \
+  X(00DN) X(5XY2) X(5XY3) X(F000) X(FN01) X(F002) X(FX3A)                     \
+  X(INVALID)
+
+#define OPCODE_ENUM(name) OP_##name,
+enum chip8_op { CHIP8_OPCODES(OPCODE_ENUM) OP_COUNT };
+#undef OPCODE_ENUM
+
+/* A decoded instruction. */
+struct chip8_uop {
+  uint8_t op;    /* enum chip8_op */
+  uint8_t X;
+  uint8_t Y;
+  uint8_t N;
+  uint8_t NN;
+  uint16_t NNN;
+};
+
+#define BLOCK_MAX_UOPS 64
+#define BLOCK_MAX_BYTES (4 * BLOCK_MAX_UOPS)
+#define PAGE_SHIFT 8
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define NPAGES (XOCHIP_MEMORY_SIZE >> PAGE_SHIFT)
+
+static inline bool chip8_page_dirty(const chip8 *c8, size_t p)
+{
+  return (c8->dirty_pages[p / 64] >> (p % 64)) & 1;
+}
+
+/* Marks pages first to last as written. */
+static inline void chip8_mark_pages(chip8 *c8, size_t first, size_t last)
+{
+  for (size_t p = first; p <= last; ++p) {
+    c8->dirty_pages[p / 64] |= UINT64_C(1) << (p % 64);
+    c8->written_pages[p / 64] |= UINT64_C(1) << (p % 64);
+    c8->unhashed_pages[p / 64] |= UINT64_C(1) << (p % 64);
+  }
+}
+
+/* Marks rows of the framebuffer as changed, for frontends and hashing. */
+static inline void chip8_mark_rows(chip8 *c8, uint64_t rows)
+{
+  c8->dirty_rows |= rows;
+  c8->unhashed_rows |= rows;
+}
+
+/* Sets up a machine in memory allocated aligned to cache lines, as
+   chip8_init does. Returns false if out of memory. */
+bool chip8_init_at(chip8 *);
+/* Frees its memory and what the engines of a machine allocated, as
+   chip8_destroy does before freeing the machine. */
+void chip8_release(chip8 *);
+/* Sets the mode of a machine, as restoring a snapshot does, first growing
+   its memory and framebuffer if the mode has more. They never shrink, so
+   that going back and forth between modes allocates once. Marks every row
+   as changed if the mode changes. Returns false if out of memory. */
+bool chip8_switch_mode(chip8 *, enum chip8_mode);
+
+/* A basic block: a straight run of instructions ending with the first jump,
+   skip, call or return. uops[nuops] is an end marker with op OP_COUNT. */
+struct chip8_block {
+  uint16_t start;  /* Address of the first instruction */
+  uint16_t end;    /* Address after the last instruction */
+  uint16_t nuops;
+  void *native;      /* Code generated by the JIT, if any */
+  bool native_tried;
+  struct chip8_uop uops[];
+};
+
+/* Decoded blocks for chip8_run_blocks and chip8_run_jit, keyed by start
+   address. */
+struct chip8_bcache {
+  struct chip8_block *blocks[XOCHIP_MEMORY_SIZE];
+  uint16_t page_blocks[NPAGES];  /* Number of blocks with code in each page */
+  uint32_t invalidations;
+};
+
+/* Builds the table used to decode instructions, unless already built. This
+   is done on first use, which is not thread-safe. */
+void chip8_build_decode_table(void);
+/* Decodes an instruction. */
+void chip8_decode_op(opcode, struct chip8_uop *);
+
+/* Blocks start below this address, so that they end within memory. */
+#define BLOCK_PC_LIMIT(c8) (chip8_memory_size(c8) - 4)
+
+/* Returns the block starting at pc, decoding it first if needed. Returns NULL
+   if out of memory or if pc is not below BLOCK_PC_LIMIT(c8). */
+struct chip8_block *chip8_block_at(chip8 *, uint16_t pc);
+
+/* Called by the engines at the target of each 1NNN: if pc is at a polling
+   loop that would not leave in its next iteration, skips whole iterations,
+   up to max instructions, updating the timers but not cycles. Returns the
+   number of instructions skipped. */
+uint64_t chip8_skip_idle(chip8 *, uint64_t max);
+
+/* Executes one decoded instruction. Timers are not updated. */
+void chip8_step(chip8 *, const struct chip8_uop *);
+
+/* Executes one decoded instruction of the opcode indexing it, given the bits
+   of its uop, as chip8_step does: the JIT calls these directly. */
+typedef void (*chip8_step_fun)(chip8 *, uint64_t);
+extern const chip8_step_fun chip8_steps[OP_COUNT];
+
+/* Fetches, executes and counts one instruction, updating the timers. */
+void chip8_interpret(chip8 *);
+
+/* Updates the timers as if the given number of instructions had executed. */
+void chip8_tick_timers_n(chip8 *, uint64_t);
+
+/* Returns the next random byte of CXNN, from an xorshift64* generator. The
+   state must not be 0. */
+static inline uint8_t chip8_random(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return (x * 0x2545F4914F6CDD1DULL) >> 56;
+}
+
+/* What the profiler counts, see profile.h. */
+#define PROFILE_BUCKETS 64
+struct chip8_profile {
+  uint64_t ops[OP_COUNT];         /* Instructions executed of each kind */
+  uint64_t pcs[0x10000];          /* Instructions executed at each address */
+  uint64_t frames;                /* Timer ticks reached */
+  uint64_t run_ns;                /* Host time spent in the engines */
+  uint64_t frame_ns;              /* Of which since the last timer tick */
+  uint64_t max_frame_ns;
+  uint64_t frame_hist[PROFILE_BUCKETS]; /* Frames by log2 of their ns */
+  uint64_t stamp;                 /* When run_ns was last updated */
+};
+
+void chip8_profile_enter(struct chip8_profile *);
+void chip8_profile_tick(struct chip8_profile *);
+void chip8_profile_leave(struct chip8_profile *);
+
+/* Hooks of the engines into the profiler, which are empty unless built with
+   -DCHIP8_PROFILE, so that they compile to nothing. Engines call
+   chip8_prof_enter and chip8_prof_leave around their run, chip8_prof_op
+   before each instruction and chip8_prof_tick on each timer tick. */
+static inline bool chip8_profiling(const chip8 *c8)
+{
+#ifdef CHIP8_PROFILE
+  return c8->profile != NULL;
+#else
+  (void) c8;
+  return false;
+#endif
+}
+
+static inline void chip8_prof_enter(chip8 *c8)
+{
+  if (chip8_profiling(c8)) {
+    chip8_profile_enter(c8->profile);
+  }
+}
+
+static inline void chip8_prof_leave(chip8 *c8)
+{
+  if (chip8_profiling(c8)) {
+    chip8_profile_leave(c8->profile);
+  }
+}
+
+static inline void chip8_prof_tick(chip8 *c8)
+{
+  if (chip8_profiling(c8)) {
+    chip8_profile_tick(c8->profile);
+  }
+}
+
+static inline void chip8_prof_op(chip8 *c8, enum chip8_op op)
+{
+  if (chip8_profiling(c8)) {
+    ++c8->profile->ops[op];
+    ++c8->profile->pcs[c8->pc];
+  }
+}
+
+/* Hooks of the core into the audio output, see audio.h, called while one is
+   attached: chip8_audio_ticked after n timer ticks with the sound timer
+   they started from, chip8_audio_sound after FX18, chip8_audio_pitch after
+   FX3A and chip8_audio_pattern after F002. */
+void chip8_audio_ticked(chip8 *, uint64_t n, uint8_t sound_before);
+void chip8_audio_sound(chip8 *);
+void chip8_audio_pitch(chip8 *);
+void chip8_audio_pattern(chip8 *);
+
+/* Frees the code generated by the JIT. */
+void chip8_jit_free(struct chip8_jit *);
+
+/* Writes to memory like the instructions do, dropping cached code and
+   marking the pages written as dirty. */
+void chip8_copy_to_memory(chip8 *, uint16_t addr, const void *, size_t);
+/* Replaces the framebuffer, given in the layout of chip8.gfx, marking the
+   rows that change as dirty. */
+void chip8_copy_to_gfx(chip8 *, const uint64_t *gfx);
+
+/* Drawing in SUPER-CHIP and XO-CHIP modes, in display.c. These work on the
+   planes selected with FN01, at the current resolution, and mark the rows
+   they change as dirty. chip8_draw_sprite draws a sprite of n rows, or a
+   16x16 sprite if n is 0, and returns whether any pixel was erased. */
+bool chip8_draw_sprite(chip8 *, unsigned x, unsigned y, unsigned n);
+void chip8_clear_planes(chip8 *);
+void chip8_scroll_down(chip8 *, unsigned n);
+void chip8_scroll_up(chip8 *, unsigned n);
+void chip8_scroll_right(chip8 *);
+void chip8_scroll_left(chip8 *);
+
+/* Memory pages shared between a machine and its snapshots. A page is never
+   written once shared. */
+struct chip8_page {
+  uint32_t refs;
+  uint8_t data[PAGE_SIZE];
+};
+
+/* The pages a machine shares with snapshots. Unless marked in dirty_pages,
+   pages[p] has the same content as page p of memory. */
+struct chip8_pages {
+  struct chip8_page *pages[NPAGES];
+};
+
+/* Releases the pages shared with snapshots. */
+void chip8_pages_free(struct chip8_pages *);
+
+/* Upper bound of the size of an encoded delta of n words. */
+#define CHIP8_DELTA_BOUND(n) ((n) * (sizeof(uint64_t) + 2 * 10))
+
+/* Writes the difference between two arrays of n words to out as XOR with
+   runs of equal words left out, and returns its size. As XOR is its own
+   inverse, the same delta takes either array to the other. */
+size_t chip8_delta_encode(const uint64_t *from, const uint64_t *to, size_t n,
+                          uint8_t *out);
+/* Applies a delta to an array of n words. Returns false if it is
+   malformed. */
+bool chip8_delta_apply(uint64_t *, size_t n, const uint8_t *, size_t len);
+
+#endif
@@ -0,0 +1,91 @@
+#include <string.h>
+
+#include "chip8_internal.h"
+
+#define SKIP_WORDS 32
+
+static uint8_t *put_varint(uint8_t *p, size_t v)
+{
+  while (v >= 0x80) {
+    *p++ = (v & 0x7F) | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end,
+                                 size_t *v)
+{
+  *v = 0;
+  for (unsigned shift = 0; p < end; shift += 7) {
+    uint8_t b = *p++;
+    *v |= (size_t) (b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+/* The encoding is a sequence of runs, each a varint count of words that are
+   equal, a varint count of words that differ and the XOR of those words.
+   Equal words at the end are left out. */
+size_t chip8_delta_encode(const uint64_t *from, const uint64_t *to, size_t n,
+                          uint8_t *out)
+{
+  uint8_t *p = out;
+  size_t i = 0;
+  while (i < n) {
+    size_t same = i;
+    /* Most of the words are usually equal, skip them in bulk first. */
+    while (n - same >= SKIP_WORDS
+           && memcmp(&from[same], &to[same], SKIP_WORDS * sizeof(uint64_t))
+              == 0) {
+      same += SKIP_WORDS;
+    }
+    while (same < n && from[same] == to[same]) {
+      ++same;
+    }
+    if (same == n) {
+      break;
+    }
+    size_t differ = same;
+    while (differ < n && from[differ] != to[differ]) {
+      ++differ;
+    }
+    p = put_varint(p, same - i);
+    p = put_varint(p, differ - same);
+    for (size_t j = same; j < differ; ++j) {
+      uint64_t x = from[j] ^ to[j];
+      memcpy(p, &x, sizeof(x));
+      p += sizeof(x);
+    }
+    i = differ;
+  }
+  return p - out;
+}
+
+bool chip8_delta_apply(uint64_t *words, size_t n, const uint8_t *in,
+                       size_t len)
+{
+  const uint8_t *p = in, *end = in + len;
+  size_t i = 0;
+  while (p < end) {
+    size_t same, differ;
+    if (!(p = get_varint(p, end, &same)) ||
+        !(p = get_varint(p, end, &differ)) ||
+        same > n - i || differ > n - i - same ||
+        differ > (size_t) (end - p) / sizeof(uint64_t)) {
+      return false;
+    }
+    i += same;
+    for (size_t j = 0; j < differ; ++j, ++i) {
+      uint64_t x;
+      memcpy(&x, p, sizeof(x));
+      words[i] ^= x;
+      p += sizeof(x);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,182 @@
+/* Drawing in SUPER-CHIP and XO-CHIP modes.
+
+   Each row of a plane is two words, so that a sprite row is placed with a
+   128-bit rotation and a scroll by 4 pixels is a shift of each row, done
+   with SSE2 on a whole row at a time when available. In low resolution
+   only the first word of each row is used, as in CHIP-8 mode. */
+
+#include <string.h>
+
+#include "chip8.h"
+#include "chip8_internal.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static inline uint64_t rotr64(uint64_t v, unsigned n)
+{
+  return (v >> n) | (v << ((64 - n) & 63));
+}
+
+static inline uint64_t rotl64(uint64_t v, unsigned n)
+{
+  return (v << n) | (v >> ((64 - n) & 63));
+}
+
+/* Rows y to y+n-1 of a display of the given height, wrapping around. */
+static inline uint64_t row_mask(unsigned y, unsigned n, unsigned height)
+{
+  uint64_t rows = (UINT64_C(1) << n) - 1;
+  if (height == 64) {
+    return rotl64(rows, y);
+  }
+  rows = rotl64(rows, y);
+  return (rows | rows >> 32) & 0xFFFFFFFF;
+}
+
+bool chip8_draw_sprite(chip8 *c8, unsigned x, unsigned y, unsigned n)
+{
+  unsigned width = chip8_width(c8);
+  unsigned height = chip8_height(c8);
+  bool wide = n == 0;
+  unsigned rows = wide ? 16 : n;
+  uint16_t addr = c8->I;
+  uint64_t collision = 0;
+
+  x %= width;
+  y %= height;
+  for (unsigned p = 0; p < DISPLAY_PLANES; ++p) {
+    if (!(c8->planes & (1u << p))) {
+      continue;
+    }
+    /* Each plane drawn to takes the next sprite in memory. */
+    for (unsigned row = 0; row < rows; ++row) {
+      uint64_t bits;
+      if (wide) {
+        bits = (uint64_t) chip8_peek(c8, addr) << 56
+             | (uint64_t) chip8_peek(c8, addr + 1) << 48;
+        addr += 2;
+      } else {
+        bits = (uint64_t) chip8_peek(c8, addr++) << 56;
+      }
+      uint64_t *line = c8->gfx[p][(y + row) % height];
+      if (!c8->hires) {
+        uint64_t sprite = rotr64(bits, x);
+        collision |= line[0] & sprite;
+        line[0] ^= sprite;
+        continue;
+      }
+      /* Rotate the 128-bit row (bits, 0) right by x. */
+      uint64_t s0 = x < 64 ? bits : 0;
+      uint64_t s1 = x < 64 ? 0 : bits;
+      unsigned shift = x % 64;
+      if (shift) {
+        uint64_t t0 = s0 >> shift | s1 << (64 - shift);
+        s1 = s1 >> shift | s0 << (64 - shift);
+        s0 = t0;
+      }
+      collision |= (line[0] & s0) | (line[1] & s1);
+      line[0] ^= s0;
+      line[1] ^= s1;
+    }
+  }
+  chip8_mark_rows(c8, row_mask(y, rows, height));
+  return collision != 0;
+}
+
+void chip8_clear_planes(chip8 *c8)
+{
+  for (unsigned p = 0; p < DISPLAY_PLANES; ++p) {
+    if (c8->planes & (1u << p)) {
+      memset(c8->gfx[p], 0, sizeof(c8->gfx[p]));
+    }
+  }
+  chip8_mark_rows(c8, CHIP8_ALL_ROWS);
+}
+
+void chip8_scroll_down(chip8 *c8, unsigned n)
+{
+  unsigned height = chip8_height(c8);
+  n = n < height ? n : height;
+  for (unsigned p = 0; p < DISPLAY_PLANES; ++p) {
+    if (c8->planes & (1u << p)) {
+      memmove(c8->gfx[p][n], c8->gfx[p][0],
+              (height - n) * sizeof(c8->gfx[p][0]));
+      memset(c8->gfx[p][0], 0, n * sizeof(c8->gfx[p][0]));
+    }
+  }
+  chip8_mark_rows(c8, CHIP8_ALL_ROWS);
+}
+
+void chip8_scroll_up(chip8 *c8, unsigned n)
+{
+  unsigned height = chip8_height(c8);
+  n = n < height ? n : height;
+  for (unsigned p = 0; p < DISPLAY_PLANES; ++p) {
+    if (c8->planes & (1u << p)) {
+      memmove(c8->gfx[p][0], c8->gfx[p][n],
+              (height - n) * sizeof(c8->gfx[p][0]));
+      memset(c8->gfx[p][height - n], 0, n * sizeof(c8->gfx[p][0]));
+    }
+  }
+  chip8_mark_rows(c8, CHIP8_ALL_ROWS);
+}
+
+/* Shifts the rows of a plane 4 pixels to the right, or to the left. In low
+   resolution, the second word of the rows stays zero. */
+static void shift_rows(uint64_t (*rows)[DISPLAY_ROW_WORDS], unsigned height,
+                       bool hires, bool right)
+{
+#ifdef __SSE2__
+  for (unsigned y = 0; y < height; ++y) {
+    __m128i v = _mm_loadu_si128((const __m128i *) rows[y]);
+    __m128i r;
+    if (right) {
+      r = _mm_srli_epi64(v, 4);
+      if (hires) {
+        /* The low bits of the first word move into the second. */
+        r = _mm_or_si128(r, _mm_slli_si128(_mm_slli_epi64(v, 60), 8));
+      }
+    } else {
+      r = _mm_slli_epi64(v, 4);
+      if (hires) {
+        r = _mm_or_si128(r, _mm_srli_si128(_mm_srli_epi64(v, 60), 8));
+      }
+    }
+    _mm_storeu_si128((__m128i *) rows[y], r);
+  }
+#else
+  for (unsigned y = 0; y < height; ++y) {
+    uint64_t w0 = rows[y][0];
+    uint64_t w1 = rows[y][1];
+    if (right) {
+      rows[y][0] = w0 >> 4;
+      rows[y][1] = w1 >> 4 | (hires ? w0 << 60 : 0);
+    } else {
+      rows[y][0] = w0 << 4 | (hires ? w1 >> 60 : 0);
+      rows[y][1] = w1 << 4;
+    }
+  }
+#endif
+}
+
+static void scroll_sideways(chip8 *c8, bool right)
+{
+  for (unsigned p = 0; p < DISPLAY_PLANES; ++p) {
+    if (c8->planes & (1u << p)) {
+      shift_rows(c8->gfx[p], chip8_height(c8), c8->hires, right);
+    }
+  }
+  chip8_mark_rows(c8, CHIP8_ALL_ROWS);
+}
+
+void chip8_scroll_right(chip8 *c8)
+{
+  scroll_sideways(c8, true);
+}
+
+void chip8_scroll_left(chip8 *c8)
+{
+  scroll_sideways(c8, false);
+}
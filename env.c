@@ -0,0 +1,348 @@
+/* syscall, for futexes */
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "env.h"
+#include "sched.h"
+
+#define ENV_MAGIC 0x56453843  /* "C8EV" */
+/* Loads of a counter before sleeping on it: steps of a few frames take
+   less time than going to sleep and waking up. */
+#define SPINS 4096
+
+enum command {
+  COMMAND_RESET,
+  COMMAND_STEP,
+  COMMAND_QUIT,
+};
+
+struct shared {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t n;
+  uint32_t nwatch;
+  uint16_t watch[CHIP8_ENV_WATCH];
+  /* Written by the client before it bumps request. */
+  uint32_t command;  /* enum command */
+  uint32_t nframes;
+  /* Bumped by the client for each request, then set to the same value by
+     the server once done, each on a cache line of its own. */
+  char pad[CHIP8_CACHE_LINE];
+  uint32_t request;
+  char pad2[CHIP8_CACHE_LINE];
+  uint32_t done;
+};
+
+typedef char header_fits[
+  sizeof(struct shared) <= CHIP8_ENV_HEADER_SIZE ? 1 : -1];
+typedef char obs_aligned[
+  CHIP8_ENV_HEADER_SIZE % CHIP8_CACHE_LINE == 0 ? 1 : -1];
+
+struct chip8_env {
+  struct shared *sh;
+  size_t size;
+  char *name;  /* To remove, if created */
+};
+
+static struct chip8_env_obs *obs_of(const chip8_env *e)
+{
+  return (struct chip8_env_obs *) ((char *) e->sh + CHIP8_ENV_HEADER_SIZE);
+}
+
+uint16_t *chip8_env_actions(chip8_env *e)
+{
+  return (uint16_t *) (obs_of(e) + e->sh->n);
+}
+
+static size_t size_of(size_t n)
+{
+  return CHIP8_ENV_HEADER_SIZE
+         + n * (sizeof(struct chip8_env_obs) + sizeof(uint16_t));
+}
+
+#ifdef __linux__
+/* The memory is shared between processes, so the futexes are not private
+   ones. */
+static void futex_wait(uint32_t *word, uint32_t value)
+{
+  syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word)
+{
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#else
+static void futex_wait(uint32_t *word, uint32_t value)
+{
+  (void) word;
+  (void) value;
+  struct timespec ts = { .tv_nsec = 50000 };
+  nanosleep(&ts, NULL);
+}
+
+static void futex_wake(uint32_t *word)
+{
+  (void) word;
+}
+#endif
+
+/* Waits for a counter to move on from the given value, and returns its
+   new one. */
+static uint32_t wait_change(uint32_t *word, uint32_t value)
+{
+  uint32_t now;
+  for (int i = 0; i < SPINS; ++i) {
+    if ((now = __atomic_load_n(word, __ATOMIC_ACQUIRE)) != value) {
+      return now;
+    }
+  }
+  while ((now = __atomic_load_n(word, __ATOMIC_ACQUIRE)) == value) {
+    futex_wait(word, value);
+  }
+  return now;
+}
+
+static void signal_change(uint32_t *word, uint32_t value)
+{
+  __atomic_store_n(word, value, __ATOMIC_RELEASE);
+  futex_wake(word);
+}
+
+/* Maps shared memory, closing its descriptor. */
+static chip8_env *map(int fd, size_t size)
+{
+  chip8_env *e = calloc(1, sizeof(*e));
+  void *p = MAP_FAILED;
+  if (e) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (p == MAP_FAILED) {
+    free(e);
+    return NULL;
+  }
+  e->sh = p;
+  e->size = size;
+  return e;
+}
+
+chip8_env *chip8_env_create(const char *name, size_t n,
+                            const uint16_t *watch, size_t nwatch)
+{
+  if (n == 0 || n > UINT32_MAX || nwatch > CHIP8_ENV_WATCH) {
+    return NULL;
+  }
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    return NULL;
+  }
+  size_t size = size_of(n);
+  chip8_env *e = NULL;
+  if (ftruncate(fd, size) == 0) {
+    e = map(fd, size);
+  } else {
+    close(fd);
+  }
+  if (!e || !(e->name = strdup(name))) {
+    if (e) {
+      chip8_env_close(e);
+    }
+    shm_unlink(name);
+    return NULL;
+  }
+  struct shared *sh = e->sh;
+  sh->version = CHIP8_ENV_VERSION;
+  sh->n = n;
+  sh->nwatch = nwatch;
+  memcpy(sh->watch, watch, nwatch * sizeof(*watch));
+  /* Last, as clients check it to tell the memory is set up. */
+  __atomic_store_n(&sh->magic, ENV_MAGIC, __ATOMIC_RELEASE);
+  return e;
+}
+
+/* Writes the bytes of a word, MSB first. */
+static void put_be64(uint8_t *p, uint64_t v)
+{
+  for (int i = 0; i < 8; ++i) {
+    p[i] = v >> (56 - 8 * i);
+  }
+}
+
+/* Only rows changed since the last observation are packed again: the
+   others are still as packed then. Rows the mode lacks are 0. */
+static void observe(const struct shared *sh, chip8 *c8,
+                    struct chip8_env_obs *o)
+{
+  for (uint64_t m = c8->dirty_rows; m; m &= m - 1) {
+    unsigned y = __builtin_ctzll(m);
+    for (unsigned p = 0; p < DISPLAY_PLANES; ++p) {
+      bool has = p * DISPLAY_HIRES_HEIGHT + y < chip8_gfx_rows(c8);
+      for (unsigned w = 0; w < DISPLAY_ROW_WORDS; ++w) {
+        put_be64(&o->pixels[p][y][8 * w], has ? c8->gfx[p][y][w] : 0);
+      }
+    }
+  }
+  c8->dirty_rows = 0;
+  for (uint32_t k = 0; k < sh->nwatch; ++k) {
+    o->watched[k] = chip8_peek(c8, sh->watch[k]);
+  }
+  memcpy(o->V, c8->V, sizeof(o->V));
+  memcpy(o->stack, c8->stack, sizeof(o->stack));
+  o->I = c8->I;
+  o->pc = c8->pc;
+  o->sp = c8->sp;
+  o->delay_timer = c8->delay_timer;
+  o->sound_timer = c8->sound_timer;
+  o->hires = c8->hires;
+  o->halted = c8->halted;
+  o->exited = chip8_exited(c8);
+  o->cycles = c8->cycles;
+}
+
+static void step(chip8 *c8, chip8_run_fun run, uint16_t keys,
+                 uint32_t nframes)
+{
+  for (uint8_t k = 0; k < 0x10; ++k) {
+    bool down = (keys >> k) & 1;
+    if (c8->key[k] != down) {
+      chip8_key_event(c8, k, down);
+    }
+  }
+  struct chip8_sched sched;
+  chip8_sched_init(&sched, CHIP8_PACE_TURBO, 1);
+  for (uint32_t f = 0; f < nframes; ++f) {
+    chip8_sched_run(&sched, c8, run, UINT64_MAX);
+  }
+}
+
+bool chip8_env_serve(chip8_env *e, chip8 *start, chip8_run_fun run,
+                     uint64_t seed)
+{
+  struct shared *sh = e->sh;
+  struct chip8_env_obs *obs = obs_of(e);
+  const uint16_t *actions = chip8_env_actions(e);
+  struct chip8_snapshot *initial = chip8_snapshot(start);
+  struct chip8_pool *pool = chip8_pool_new(sh->n);
+  bool ok = initial && pool;
+  /* A client may have made a request before the server got here. */
+  uint32_t seen = __atomic_load_n(&sh->done, __ATOMIC_ACQUIRE);
+
+  while (ok) {
+    seen = wait_change(&sh->request, seen);
+    if (sh->command == COMMAND_QUIT) {
+      signal_change(&sh->done, seen);
+      break;
+    }
+    for (uint32_t i = 0; i < sh->n && ok; ++i) {
+      chip8 *c8 = chip8_pool_get(pool, i);
+      if (sh->command == COMMAND_RESET) {
+        ok = chip8_restore(c8, initial);
+        chip8_seed(c8, seed + i);
+        obs[i].frames = 0;
+      } else {
+        step(c8, run, actions[i], sh->nframes);
+        obs[i].frames += sh->nframes;
+      }
+      observe(sh, c8, &obs[i]);
+    }
+    signal_change(&sh->done, seen);
+  }
+
+  if (pool) {
+    chip8_pool_free(pool);
+  }
+  if (initial) {
+    chip8_snapshot_free(initial);
+  }
+  return ok;
+}
+
+chip8_env *chip8_env_connect(const char *name)
+{
+  int fd = shm_open(name, O_RDWR, 0);
+  struct stat st;
+  if (fd < 0) {
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < CHIP8_ENV_HEADER_SIZE) {
+    close(fd);
+    return NULL;
+  }
+  chip8_env *e = map(fd, st.st_size);
+  if (!e) {
+    return NULL;
+  }
+  struct shared *sh = e->sh;
+  if (__atomic_load_n(&sh->magic, __ATOMIC_ACQUIRE) != ENV_MAGIC
+      || sh->version != CHIP8_ENV_VERSION || size_of(sh->n) != e->size) {
+    chip8_env_close(e);
+    return NULL;
+  }
+  return e;
+}
+
+size_t chip8_env_size(const chip8_env *e)
+{
+  return e->sh->n;
+}
+
+static void request(chip8_env *e, enum command command, uint32_t nframes)
+{
+  struct shared *sh = e->sh;
+  sh->command = command;
+  sh->nframes = nframes;
+  uint32_t seq = sh->request + 1;
+  signal_change(&sh->request, seq);
+  uint32_t done = __atomic_load_n(&sh->done, __ATOMIC_ACQUIRE);
+  while (done != seq) {
+    done = wait_change(&sh->done, done);
+  }
+}
+
+void chip8_env_reset(chip8_env *e)
+{
+  request(e, COMMAND_RESET, 0);
+}
+
+void chip8_env_step(chip8_env *e, const uint16_t *actions, uint32_t nframes)
+{
+  uint16_t *shared = chip8_env_actions(e);
+  if (actions != shared) {
+    memcpy(shared, actions, e->sh->n * sizeof(*shared));
+  }
+  request(e, COMMAND_STEP, nframes);
+}
+
+const struct chip8_env_obs *chip8_env_obs(const chip8_env *e, size_t i)
+{
+  return &obs_of(e)[i];
+}
+
+void chip8_env_quit(chip8_env *e)
+{
+  request(e, COMMAND_QUIT, 0);
+}
+
+void chip8_env_close(chip8_env *e)
+{
+  munmap(e->sh, e->size);
+  if (e->name) {
+    shm_unlink(e->name);
+    free(e->name);
+  }
+  free(e);
+}
@@ -0,0 +1,83 @@
+#ifndef CHIP8_ENV_H
+#define CHIP8_ENV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/* An environment for agents running in other processes. A server, such as
+   chip8-env, runs n machines of one ROM side by side. A client resets them
+   all or steps them a number of frames with the keys each is to hold. The
+   server writes what the agents observe of each machine straight into POSIX
+   shared memory, where the client reads it in place. Requests and their
+   completion are signalled through two counters in the shared memory,
+   waited on with futexes on Linux. One client drives a server at a time.
+
+   The shared memory holds a header of CHIP8_ENV_HEADER_SIZE bytes, then
+   struct chip8_env_obs for each machine, then the keys of each machine as
+   16-bit masks, bit k holding key k down. */
+#define CHIP8_ENV_VERSION 1
+#define CHIP8_ENV_HEADER_SIZE 256
+/* Memory addresses of which the value is observed, such as a score. */
+#define CHIP8_ENV_WATCH 16
+
+typedef struct chip8_env chip8_env;
+
+/* What is observed of a machine after each reset or step. Its layout does
+   not depend on the host beyond its byte order, and is the same in every
+   mode: the framebuffer is in its high resolution size, with only the
+   first 32 rows and 8 bytes of each used in low resolution. */
+struct CHIP8_ALIGNED chip8_env_obs {
+  /* Rows of each plane, 8 pixels per byte, the MSB of the first byte being
+     the leftmost pixel. */
+  uint8_t pixels[DISPLAY_PLANES][DISPLAY_HIRES_HEIGHT][DISPLAY_HIRES_WIDTH / 8];
+  uint8_t watched[CHIP8_ENV_WATCH];  /* At the addresses watched */
+  uint8_t V[0x10];
+  uint16_t stack[0x10];
+  uint16_t I;
+  uint16_t pc;
+  uint8_t sp;
+  uint8_t delay_timer;
+  uint8_t sound_timer;
+  uint8_t hires;
+  uint8_t halted;   /* Waiting for a key, or exited */
+  uint8_t exited;   /* By 00FD, see chip8_exited */
+  uint64_t frames;  /* Run since the last reset */
+  uint64_t cycles;  /* Instructions executed */
+};
+
+/* Creates the shared memory of a server of n machines under the given name,
+   which starts with a slash, and watching the given addresses. Returns NULL
+   if it exists already or could not be created. */
+chip8_env *chip8_env_create(const char *name, size_t n,
+                            const uint16_t *watch, size_t nwatch);
+/* Serves the requests of clients until one quits. Resetting restores each
+   machine to the state start was in when called and seeds instance i with
+   seed + i. Steps run each frame with the given engine. Returns false if out
+   of memory. */
+bool chip8_env_serve(chip8_env *, chip8 *start, chip8_run_fun,
+                     uint64_t seed);
+
+/* Maps the shared memory of a server. Returns NULL if there is none under
+   the name or it was created by another version. */
+chip8_env *chip8_env_connect(const char *name);
+size_t chip8_env_size(const chip8_env *);
+/* Resets every machine, waiting until done. */
+void chip8_env_reset(chip8_env *);
+/* Steps every machine the given number of frames, machine i holding the
+   keys of actions[i] down and the others up, and waits until done. actions
+   may be chip8_env_actions, for clients writing the keys in place. */
+void chip8_env_step(chip8_env *, const uint16_t *actions, uint32_t nframes);
+uint16_t *chip8_env_actions(chip8_env *);
+/* Returns what was observed of machine i, in the shared memory. It changes
+   on the next reset or step. */
+const struct chip8_env_obs *chip8_env_obs(const chip8_env *, size_t i);
+/* Makes the server return from chip8_env_serve. */
+void chip8_env_quit(chip8_env *);
+
+/* Unmaps the shared memory, and removes it if created by this process. */
+void chip8_env_close(chip8_env *);
+
+#endif
@@ -0,0 +1,157 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "env.h"
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s [-n machines] [-e engine] [-c hz] [-x mode] [-S seed]"
+    " [-w addr,...] name <CHIP-8 ROM>\n"
+    "  -n machines  Number of machines (default 16)\n"
+    "  -e engine    interp, blocks or jit (default)\n"
+    "  -c hz        Instructions per second of guest time (default %d)\n"
+    "  -x mode      chip8 (default), schip or xochip\n"
+    "  -S seed      Seed of the first machine, the next ones taking the\n"
+    "               seeds after it (default %" PRIu64 ")\n"
+    "  -w addr,...  Hexadecimal addresses of memory to observe, at most %d\n"
+    "Serves the machines under the shared memory name, such as /chip8, until\n"
+    "a client quits.\n",
+    prog, CHIP8_DEFAULT_CPU_HZ, (uint64_t) CHIP8_DEFAULT_SEED,
+    CHIP8_ENV_WATCH);
+  exit(EXIT_FAILURE);
+}
+
+static const char *shm_name;
+
+/* Removes the shared memory when killed. shm_unlink is an unlink of a file
+   on the systems it is used on. */
+static void remove_shared(int sig)
+{
+  shm_unlink(shm_name);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/* Parses a list of addresses, returning their number or -1. */
+static int parse_watch(char *list, uint16_t *watch)
+{
+  int n = 0;
+  for (char *s = strtok(list, ","); s; s = strtok(NULL, ",")) {
+    char *end;
+    unsigned long addr = strtoul(s, &end, 16);
+    if (n == CHIP8_ENV_WATCH || *end || end == s
+        || addr >= XOCHIP_MEMORY_SIZE) {
+      return -1;
+    }
+    watch[n++] = addr;
+  }
+  return n;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long n = 16;
+  chip8_run_fun run = chip8_run_jit;
+  uint32_t cpu_hz = CHIP8_DEFAULT_CPU_HZ;
+  enum chip8_mode mode = CHIP8_MODE_CHIP8;
+  uint64_t seed = CHIP8_DEFAULT_SEED;
+  uint16_t watch[CHIP8_ENV_WATCH];
+  int nwatch = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:e:c:x:S:w:")) != -1) {
+    switch (opt) {
+    case 'n':
+      n = strtoul(optarg, NULL, 10);
+      if (n == 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 'e':
+      if (strcmp(optarg, "interp") == 0) {
+        run = chip8_run;
+      } else if (strcmp(optarg, "blocks") == 0) {
+        run = chip8_run_blocks;
+      } else if (strcmp(optarg, "jit") == 0) {
+        run = chip8_run_jit;
+      } else {
+        usage(argv[0]);
+      }
+      break;
+    case 'c':
+      cpu_hz = strtoul(optarg, NULL, 10);
+      break;
+    case 'x':
+      if (strcmp(optarg, "chip8") == 0) {
+        mode = CHIP8_MODE_CHIP8;
+      } else if (strcmp(optarg, "schip") == 0) {
+        mode = CHIP8_MODE_SCHIP;
+      } else if (strcmp(optarg, "xochip") == 0) {
+        mode = CHIP8_MODE_XOCHIP;
+      } else {
+        usage(argv[0]);
+      }
+      break;
+    case 'S':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    case 'w':
+      if ((nwatch = parse_watch(optarg, watch)) < 0) {
+        usage(argv[0]);
+      }
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv[0]);
+  }
+  shm_name = argv[optind];
+  char *rom_path = argv[optind + 1];
+
+  /* The machines are reset to this one. */
+  chip8 *start = chip8_init();
+  if (!start || !chip8_set_mode(start, mode)) {
+    fprintf(stderr, "out of memory\n");
+    if (start) {
+      chip8_destroy(start);
+    }
+    return EXIT_FAILURE;
+  }
+  if (!chip8_load_rom(start, rom_path)) {
+    fprintf(stderr, "%s: could not load ROM\n", rom_path);
+    chip8_destroy(start);
+    return EXIT_FAILURE;
+  }
+  chip8_set_cpu_rate(start, cpu_hz);
+
+  chip8_env *env = chip8_env_create(shm_name, n, watch, nwatch);
+  if (!env) {
+    fprintf(stderr, "%s: could not create shared memory\n", shm_name);
+    chip8_destroy(start);
+    return EXIT_FAILURE;
+  }
+  struct sigaction sa = { .sa_handler = remove_shared };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  int status = EXIT_SUCCESS;
+  if (!chip8_env_serve(env, start, run, seed)) {
+    fprintf(stderr, "out of memory\n");
+    status = EXIT_FAILURE;
+  }
+  chip8_env_close(env);
+  chip8_destroy(start);
+  return status;
+}
@@ -0,0 +1,159 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "farm.h"
+#include "chip8_internal.h"
+
+/* Maximum number of instructions executed per call into the interpreter. */
+#define SLICE 4096
+
+#define CACHE_LINE 64
+
+/* Each thread is dealt a range of the jobs up front. It takes jobs from the
+   bottom of its own range and, once that is empty, steals from the top of the
+   ranges of the others. As no jobs are added while running, top and bottom
+   fit in one word, which both ends update with compare-and-swap. */
+struct worker {
+  uint64_t ends __attribute__((aligned(CACHE_LINE))); /* top << 32 | bottom */
+  struct chip8_job *jobs;
+  /* Private to the thread of the worker. */
+  pthread_t thread __attribute__((aligned(CACHE_LINE)));
+  struct worker *all;
+  unsigned id, nworkers;
+};
+
+static struct chip8_job *pop(struct worker *w)
+{
+  uint64_t ends = __atomic_load_n(&w->ends, __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint32_t top = ends >> 32, bottom = (uint32_t) ends;
+    if (top == bottom) {
+      return NULL;
+    }
+    uint64_t taken = (uint64_t) top << 32 | (bottom - 1);
+    if (__atomic_compare_exchange_n(&w->ends, &ends, taken, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return &w->jobs[bottom - 1];
+    }
+  }
+}
+
+static struct chip8_job *steal(struct worker *victim)
+{
+  uint64_t ends = __atomic_load_n(&victim->ends, __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint32_t top = ends >> 32, bottom = (uint32_t) ends;
+    if (top == bottom) {
+      return NULL;
+    }
+    uint64_t taken = (uint64_t) (top + 1) << 32 | bottom;
+    if (__atomic_compare_exchange_n(&victim->ends, &ends, taken, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return &victim->jobs[top];
+    }
+  }
+}
+
+static struct chip8_job *take(struct worker *w)
+{
+  struct chip8_job *job = pop(w);
+  for (unsigned i = 1; !job && i < w->nworkers; ++i) {
+    job = steal(&w->all[(w->id + i) % w->nworkers]);
+  }
+  return job;
+}
+
+static void run_job(struct chip8_job *job)
+{
+  chip8 *c8 = job->c8 ? job->c8 : (job->c8 = chip8_init());
+  bool loaded = c8 && (job->pack
+    ? chip8_load_rom_from_pack(c8, job->pack, job->rom_index)
+    : chip8_load_rom(c8, job->rom_path));
+  if (!loaded) {
+    job->status = CHIP8_JOB_FAILED;
+    return;
+  }
+  const struct chip8_input_event *next = job->input;
+  const struct chip8_input_event *end = job->input + job->ninput;
+  while (c8->cycles < job->cycles) {
+    while (next != end && next->cycle <= c8->cycles) {
+      chip8_key_event(c8, next->key, next->down);
+      ++next;
+    }
+    uint64_t n = job->cycles - c8->cycles;
+    if (next != end && next->cycle - c8->cycles < n) {
+      n = next->cycle - c8->cycles;
+    }
+    uint64_t executed = chip8_run(c8, n < SLICE ? n : SLICE);
+    if (c8->halted) {
+      /* Waiting for a key press: skip ahead to the next event, if any. A
+         ROM without events left can never continue, so it is stopped. */
+      if (next == end) {
+        job->status = CHIP8_JOB_WAITING;
+        return;
+      }
+      chip8_idle(c8, n - executed);
+    }
+  }
+  job->status = CHIP8_JOB_DONE;
+}
+
+static void *work(void *arg)
+{
+  struct worker *w = arg;
+  struct chip8_job *job;
+  while ((job = take(w))) {
+    run_job(job);
+  }
+  return NULL;
+}
+
+bool chip8_farm_run(struct chip8_job *jobs, size_t njobs, unsigned nthreads)
+{
+  assert(njobs <= UINT32_MAX);
+  if (nthreads == 0) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpus > 0 ? ncpus : 1;
+  }
+
+  struct worker *workers;
+  if (posix_memalign((void **) &workers, CACHE_LINE,
+                     nthreads * sizeof(*workers)) != 0) {
+    return false;
+  }
+  for (unsigned i = 0; i < nthreads; ++i) {
+    size_t begin = njobs * i / nthreads;
+    size_t end = njobs * (i + 1) / nthreads;
+    workers[i].ends = end - begin;
+    workers[i].jobs = jobs + begin;
+    workers[i].all = workers;
+    workers[i].id = i;
+    workers[i].nworkers = nthreads;
+  }
+  for (size_t i = 0; i < njobs; ++i) {
+    jobs[i].status = CHIP8_JOB_PENDING;
+  }
+
+  chip8_build_decode_table();
+
+  /* The calling thread is the first worker. Threads that fail to start are
+     not waited for, their jobs are stolen by the others. */
+  bool started[nthreads];
+  for (unsigned i = 1; i < nthreads; ++i) {
+    started[i] = pthread_create(&workers[i].thread, NULL, work,
+                                &workers[i]) == 0;
+  }
+  work(&workers[0]);
+  for (unsigned i = 1; i < nthreads; ++i) {
+    if (started[i]) {
+      pthread_join(workers[i].thread, NULL);
+    }
+  }
+
+  free(workers);
+  return true;
+}
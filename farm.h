@@ -0,0 +1,49 @@
+#ifndef CHIP8_FARM_H
+#define CHIP8_FARM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+#include "pack.h"
+
+/* A key press or release, applied before the instruction with the given
+   number is executed. */
+struct chip8_input_event {
+  uint64_t cycle;
+  uint8_t key;
+  bool down;
+};
+
+enum chip8_job_status {
+  CHIP8_JOB_PENDING,
+  CHIP8_JOB_DONE,     /* Ran for the whole cycle budget */
+  CHIP8_JOB_WAITING,  /* Stopped waiting for a key press, script exhausted */
+  CHIP8_JOB_FAILED,   /* The ROM could not be loaded */
+};
+
+struct chip8_job {
+  /* Set by the caller. Events are sorted by cycle. The ROM is entry
+     rom_index of pack if pack is set, or else read from rom_path. */
+  char *rom_path;
+  const chip8_pack *pack;
+  size_t rom_index;
+  const struct chip8_input_event *input;
+  size_t ninput;
+  uint64_t cycles;
+  /* Set by chip8_farm_run. c8 holds the final state and framebuffer. If
+     left NULL by the caller, it is allocated, to be freed with
+     chip8_destroy. The caller may instead set c8 to a machine in the state
+     chip8_init or chip8_reset leaves it in, such as one of a pool, for the
+     job to run on. */
+  enum chip8_job_status status;
+  chip8 *c8;
+};
+
+/* Runs all jobs on the given number of threads, 0 meaning one per online
+   CPU, and returns when they are done. Returns false if the threads could
+   not be started. */
+bool chip8_farm_run(struct chip8_job *, size_t njobs, unsigned nthreads);
+
+#endif
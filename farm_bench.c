@@ -0,0 +1,155 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "farm.h"
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s [-j jobs] [-n cycles] [-t threads]"
+    " <CHIP-8 ROM>... | -k pack\n"
+    "  -j jobs     Number of jobs, cycling through the ROMs (default 256)\n"
+    "  -k pack     Take the ROMs from a pack made by chip8-pack instead\n"
+    "  -n cycles   Number of instructions per job (default 1000000)\n"
+    "  -t threads  Maximum number of threads (default one per online CPU)\n"
+    "Runs the jobs at 1, 2, 4, ... threads up to the maximum and reports the\n"
+    "throughput of each run.\n",
+    prog);
+  exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Runs all jobs on the given number of threads, each on a machine of the
+   pool, and returns the number of seconds taken, or a negative number on
+   failure. */
+static double run(struct chip8_job *jobs, size_t njobs, unsigned nthreads,
+                  struct chip8_pool *pool)
+{
+  chip8_pool_reset(pool);
+  for (size_t i = 0; i < njobs; ++i) {
+    jobs[i].c8 = chip8_pool_get(pool, i);
+  }
+  uint64_t start = now_ns();
+  if (!chip8_farm_run(jobs, njobs, nthreads)) {
+    return -1;
+  }
+  double seconds = (now_ns() - start) / 1e9;
+
+  bool ok = true;
+  for (size_t i = 0; i < njobs; ++i) {
+    if (jobs[i].c8 != chip8_pool_get(pool, i)) {
+      fprintf(stderr, "job %zu did not run on its machine of the pool\n", i);
+      ok = false;
+    } else if (jobs[i].status == CHIP8_JOB_FAILED) {
+      if (jobs[i].pack) {
+        fprintf(stderr, "ROM %zu of the pack could not be loaded\n",
+                jobs[i].rom_index);
+      } else {
+        fprintf(stderr, "%s: could not load ROM\n", jobs[i].rom_path);
+      }
+      ok = false;
+    }
+  }
+  return ok ? seconds : -1;
+}
+
+int main(int argc, char **argv)
+{
+  size_t njobs = 256;
+  uint64_t ncycles = 1000000;
+  long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  chip8_pack *pack = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:n:t:k:")) != -1) {
+    switch (opt) {
+    case 'j':
+      njobs = strtoull(optarg, NULL, 10);
+      break;
+    case 'n':
+      ncycles = strtoull(optarg, NULL, 10);
+      break;
+    case 't':
+      max_threads = strtol(optarg, NULL, 10);
+      break;
+    case 'k':
+      if (!(pack = chip8_pack_open(optarg))) {
+        fprintf(stderr, "%s: could not open pack\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  size_t nroms = pack ? chip8_pack_count(pack) : (size_t) (argc - optind);
+  if (nroms == 0 || njobs == 0 || (pack && optind != argc)) {
+    usage(argv[0]);
+  }
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+
+  /* The machines stay allocated from one run to the next. */
+  struct chip8_job *jobs = calloc(njobs, sizeof(*jobs));
+  struct chip8_pool *pool = chip8_pool_new(njobs);
+  if (!jobs || !pool) {
+    fprintf(stderr, "out of memory\n");
+    return EXIT_FAILURE;
+  }
+  for (size_t i = 0; i < njobs; ++i) {
+    if (pack) {
+      jobs[i].pack = pack;
+      jobs[i].rom_index = i % nroms;
+    } else {
+      jobs[i].rom_path = argv[optind + i % nroms];
+    }
+    jobs[i].cycles = ncycles;
+  }
+
+  /* One line per run, as key=value pairs. */
+  double base = 0;
+  for (long nthreads = 1; ; nthreads *= 2) {
+    if (nthreads > max_threads) {
+      nthreads = max_threads;
+    }
+    double seconds = run(jobs, njobs, nthreads, pool);
+    if (seconds < 0) {
+      chip8_pool_free(pool);
+      free(jobs);
+      if (pack) {
+        chip8_pack_close(pack);
+      }
+      return EXIT_FAILURE;
+    }
+    double rate = njobs / seconds;
+    if (nthreads == 1) {
+      base = rate;
+    }
+    printf("threads=%ld jobs=%zu cycles=%" PRIu64 " seconds=%.3f"
+           " jobs_per_sec=%.1f speedup=%.2f\n",
+           nthreads, njobs, ncycles, seconds, rate, rate / base);
+    fflush(stdout);
+    if (nthreads == max_threads) {
+      break;
+    }
+  }
+
+  chip8_pool_free(pool);
+  free(jobs);
+  if (pack) {
+    chip8_pack_close(pack);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "frames.h"
+
+/* The index of the buffer holding the newest frame is kept together with
+   a bit telling whether it was published since last acquired, so that both
+   are exchanged at once. */
+#define FRESH 4u
+#define CACHE_LINE 64
+
+struct chip8_frames {
+  struct chip8_frame buffers[3];
+  /* Exchanged by both threads, on a cache line of its own. */
+  char pad[CACHE_LINE];
+  unsigned newest;
+  char pad2[CACHE_LINE];
+  unsigned back;      /* Filled by the emulation thread */
+  uint64_t seq;
+  char pad3[CACHE_LINE];
+  unsigned front;     /* Presented */
+  uint64_t last_seq;  /* Of the frame presented */
+  bool presented;     /* Whether any frame was */
+};
+
+chip8_frames *chip8_frames_new(void)
+{
+  chip8_frames *f = calloc(1, sizeof(*f));
+  if (!f) {
+    return NULL;
+  }
+  f->front = 0;
+  f->newest = 1;
+  f->back = 2;
+  return f;
+}
+
+void chip8_frames_free(chip8_frames *f)
+{
+  free(f);
+}
+
+void chip8_frames_publish(chip8_frames *f, chip8 *c8)
+{
+  struct chip8_frame *frame = &f->buffers[f->back];
+  chip8_copy_from_gfx(c8, &frame->gfx[0][0][0]);
+  frame->hires = c8->hires;
+  frame->dirty_rows = c8->dirty_rows;
+  frame->seq = f->seq++;
+  c8->dirty_rows = 0;
+  /* Release the frame written, acquire the one given back, which the other
+     thread may have presented. */
+  f->back = __atomic_exchange_n(&f->newest, f->back | FRESH,
+                                __ATOMIC_ACQ_REL) & ~FRESH;
+}
+
+const struct chip8_frame *chip8_frames_acquire(chip8_frames *f)
+{
+  if (!(__atomic_load_n(&f->newest, __ATOMIC_RELAXED) & FRESH)) {
+    return NULL;
+  }
+  f->front = __atomic_exchange_n(&f->newest, f->front, __ATOMIC_ACQ_REL)
+             & ~FRESH;
+  struct chip8_frame *frame = &f->buffers[f->front];
+  /* The rows changed in frames skipped are not known. */
+  if (!f->presented || frame->seq != f->last_seq + 1) {
+    frame->dirty_rows = CHIP8_ALL_ROWS;
+  }
+  f->last_seq = frame->seq;
+  f->presented = true;
+  return frame;
+}
@@ -0,0 +1,38 @@
+#ifndef CHIP8_FRAMES_H
+#define CHIP8_FRAMES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/* Hands frames from the thread running a machine to the thread presenting
+   them, through three buffers and without locks: the emulation thread fills
+   one while the other presents another, and the third holds the newest frame
+   published. Neither thread ever waits for the other. The presenting thread
+   only sees the newest frame, skipping those published in between. */
+typedef struct chip8_frames chip8_frames;
+
+/* A copy of the framebuffer. */
+struct chip8_frame {
+  uint64_t gfx[DISPLAY_PLANES][DISPLAY_HIRES_HEIGHT][DISPLAY_ROW_WORDS];
+  bool hires;
+  /* Rows that changed since the frame published before. All rows are set
+     in the first frame acquired and in any frame that follows skipped
+     ones. */
+  uint64_t dirty_rows;
+  uint64_t seq;  /* Number of frames published before this one */
+};
+
+/* Returns NULL if out of memory. */
+chip8_frames *chip8_frames_new(void);
+void chip8_frames_free(chip8_frames *);
+/* Called by the emulation thread: copies the framebuffer of the machine to
+   a new frame, publishes it and clears dirty_rows. */
+void chip8_frames_publish(chip8_frames *, chip8 *);
+/* Called by the presenting thread: returns the newest frame published, or
+   NULL if there is none since the last call. The frame stays valid until
+   the next call. */
+const struct chip8_frame *chip8_frames_acquire(chip8_frames *);
+
+#endif
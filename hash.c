@@ -0,0 +1,154 @@
+/* Hashing of machine states.
+
+   The hash combines a hash of the registers with the XOR of a hash of each
+   memory page and each framebuffer row, keyed by its position, as in
+   Zobrist hashing. Replacing the hash of one page or row in the XOR is then
+   enough to follow a write to it, and the registers are few enough to be
+   hashed in full each time. */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "chip8_internal.h"
+
+#define KEY_REGS UINT64_C(0x243F6A8885A308D3)
+#define KEY_PAGE UINT64_C(0x13198A2E03707344)
+#define KEY_ROW UINT64_C(0xA4093822299F31D0)
+
+struct chip8_hash {
+  uint64_t memory;  /* XOR of pages */
+  uint64_t gfx;     /* XOR of rows */
+  uint8_t mode;     /* Of the machine, when last hashed */
+  uint64_t pages[NPAGES];
+  uint64_t rows[DISPLAY_HIRES_HEIGHT];
+};
+
+static inline uint64_t mix(uint64_t h, uint64_t v)
+{
+  h = (h ^ v) * UINT64_C(0x9E3779B97F4A7C15);
+  return h ^ h >> 32;
+}
+
+/* The finalizer of MurmurHash3, so that every bit of the input affects
+   every bit of the hash. */
+static inline uint64_t finish(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= UINT64_C(0xFF51AFD7ED558CCD);
+  h ^= h >> 33;
+  h *= UINT64_C(0xC4CEB9FE1A85EC53);
+  return h ^ h >> 33;
+}
+
+static uint64_t mix_bytes(uint64_t h, const void *p, size_t n)
+{
+  for (size_t i = 0; i < n; i += sizeof(uint64_t)) {
+    uint64_t w;
+    memcpy(&w, (const uint8_t *) p + i, sizeof(w));
+    h = mix(h, w);
+  }
+  return h;
+}
+
+/* Pages and rows the mode lacks hash as 0. */
+static uint64_t hash_page(const chip8 *c8, size_t p)
+{
+  if (p >= chip8_memory_size(c8) >> PAGE_SHIFT) {
+    return 0;
+  }
+  uint64_t h = mix(KEY_PAGE, p);
+  return finish(mix_bytes(h, &c8->memory[p << PAGE_SHIFT], PAGE_SIZE));
+}
+
+static uint64_t hash_row(const chip8 *c8, size_t y)
+{
+  uint64_t h = mix(KEY_ROW, y);
+  for (size_t p = 0; p * DISPLAY_HIRES_HEIGHT + y < chip8_gfx_rows(c8); ++p) {
+    h = mix_bytes(h, c8->gfx[p][y], sizeof(c8->gfx[p][y]));
+  }
+  return finish(h);
+}
+
+/* Field by field, so that padding is left out. cycles, draw_flag, erased,
+   skip_idle and dirty_rows do not change how the machine runs on. */
+static uint64_t hash_registers(const chip8 *c8)
+{
+  uint64_t h = mix_bytes(KEY_REGS, c8->V, sizeof(c8->V));
+  h = mix(h, c8->I | (uint64_t) c8->pc << 16 | (uint64_t) c8->sp << 32
+             | (uint64_t) c8->delay_timer << 48
+             | (uint64_t) c8->sound_timer << 56);
+  h = mix(h, c8->cycles_per_tick | (uint64_t) c8->tick_cycles << 32);
+  h = mix_bytes(h, c8->key, sizeof(c8->key));
+  h = mix(h, c8->mode | c8->hires << 8 | c8->planes << 16
+             | c8->halted << 24 | (uint64_t) c8->pitch << 32);
+  h = mix_bytes(h, c8->stack, sizeof(c8->stack));
+  h = mix(h, c8->rng);
+  h = mix_bytes(h, c8->flags, sizeof(c8->flags));
+  h = mix_bytes(h, c8->pattern, sizeof(c8->pattern));
+  return h;
+}
+
+static uint64_t combine(const chip8 *c8, uint64_t memory, uint64_t gfx)
+{
+  return finish(mix(mix(hash_registers(c8), memory), gfx));
+}
+
+uint64_t chip8_state_hash_full(const chip8 *c8)
+{
+  uint64_t memory = 0, gfx = 0;
+  for (size_t p = 0; p < NPAGES; ++p) {
+    memory ^= hash_page(c8, p);
+  }
+  for (size_t y = 0; y < DISPLAY_HIRES_HEIGHT; ++y) {
+    gfx ^= hash_row(c8, y);
+  }
+  return combine(c8, memory, gfx);
+}
+
+uint64_t chip8_state_hash(chip8 *c8)
+{
+  struct chip8_hash *h = c8->hash;
+  bool all = !h || h->mode != c8->mode;
+  if (!h && !(h = c8->hash = calloc(1, sizeof(*h)))) {
+    return chip8_state_hash_full(c8);
+  }
+  /* Every page and row is hashed on the first call, and again after
+     switching modes, which changes which pages and rows there are. */
+  if (all) {
+    memset(c8->unhashed_pages, 0xFF, sizeof(c8->unhashed_pages));
+    c8->unhashed_rows = CHIP8_ALL_ROWS;
+    h->mode = c8->mode;
+  }
+
+  for (size_t i = 0; i < NPAGES / 64; ++i) {
+    for (uint64_t m = c8->unhashed_pages[i]; m; m &= m - 1) {
+      size_t p = i * 64 + __builtin_ctzll(m);
+      uint64_t page = hash_page(c8, p);
+      h->memory ^= h->pages[p] ^ page;
+      h->pages[p] = page;
+    }
+    c8->unhashed_pages[i] = 0;
+  }
+  for (uint64_t m = c8->unhashed_rows; m; m &= m - 1) {
+    size_t y = __builtin_ctzll(m);
+    uint64_t row = hash_row(c8, y);
+    h->gfx ^= h->rows[y] ^ row;
+    h->rows[y] = row;
+  }
+  c8->unhashed_rows = 0;
+
+  uint64_t hash = combine(c8, h->memory, h->gfx);
+#ifdef CHIP8_VERIFY_HASH
+  uint64_t full = chip8_state_hash_full(c8);
+  if (hash != full) {
+    fprintf(stderr, "chip8_state_hash: 0x%016" PRIX64 " kept, 0x%016" PRIX64
+            " recomputed at pc 0x%03X after %" PRIu64 " instructions\n",
+            hash, full, c8->pc, c8->cycles);
+    abort();
+  }
+#endif
+  return hash;
+}
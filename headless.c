@@ -0,0 +1,411 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "audio.h"
+#include "chip8.h"
+#include "movie.h"
+#include "profile.h"
+#include "rewind.h"
+#include "sched.h"
+#include "video.h"
+
+struct options {
+  chip8_run_fun run;
+  enum chip8_mode mode;
+  uint64_t ncycles;
+  uint64_t nframes;  /* Instead of ncycles if not 0 */
+  uint32_t cpu_hz;
+  enum chip8_pace pace;
+  unsigned factor;
+  chip8_movie *movie;
+  chip8_audio *audio;
+  chip8_video *video;
+  bool record;
+  bool profile;
+  bool no_idle_skip;
+  bool show_registers;
+  bool show_screen;
+};
+
+/* Hottest addresses listed by the profile report. */
+#define PROFILE_TOP 20
+
+static volatile sig_atomic_t report_profile;
+
+static void request_profile_report(int sig)
+{
+  (void) sig;
+  report_profile = 1;
+}
+
+static uint64_t run_jit_lockstep(chip8 *c8, uint64_t ncycles)
+{
+  chip8_jit_set_lockstep(c8, true);
+  return chip8_run_jit(c8, ncycles);
+}
+
+static void errorf(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s [-n cycles] [-f frames] [-e engine] [-c hz] [-p pace]"
+    " [-x mode] [-m movie] [-a sound] [-o video] [-b] [-i] [-P] [-r]"
+    " [-s] <CHIP-8 ROM>...\n"
+    "  -n cycles  Number of instructions to execute per ROM (default 1000000)\n"
+    "  -f frames  Number of 60 Hz frames to execute per ROM\n"
+    "  -e engine  interp (default), blocks, jit or jit-lockstep\n"
+    "  -c hz      Instructions per second of guest time (default %d)\n"
+    "  -p pace    turbo (default), fixed for real time, or a speed-up such as\n"
+    "             4x\n"
+    "  -x mode    chip8 (default), schip or xochip\n"
+    "  -m movie   Play back the key presses of a movie, with its CPU rate and\n"
+    "             random numbers\n"
+    "  -a sound   Render the sound of the ROMs one after another to a WAV\n"
+    "             file, or null to render it without writing it anywhere\n"
+    "  -o video   Record the frames of the ROMs one after another to a\n"
+    "             video, see chip8-video\n"
+    "  -b         Record a rewind history of every frame and report its size\n"
+    "  -i         Execute polling loops instead of skipping to when they end\n"
+    "  -P         Profile each ROM, reporting when done and on SIGUSR1\n"
+    "  -r         Print the final registers of each ROM\n"
+    "  -s         Print the final screen of each ROM\n",
+    prog, CHIP8_DEFAULT_CPU_HZ);
+  exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void print_screen(chip8 *c8)
+{
+  /* By the planes the pixel is lit in */
+  static const char colors[] = ".#o@";
+  for (unsigned y = 0; y < chip8_height(c8); ++y) {
+    for (unsigned x = 0; x < chip8_width(c8); ++x) {
+      putchar(colors[chip8_pixel(c8, x, y)]);
+    }
+    putchar('\n');
+  }
+}
+
+static void print_registers(chip8 *c8)
+{
+  printf("pc=%03" PRIX16 " I=%03" PRIX16 " sp=%" PRIu16
+         " dt=%" PRIu8 " st=%" PRIu8 "\n",
+         c8->pc, c8->I, c8->sp, c8->delay_timer, c8->sound_timer);
+  for (size_t i = 0; i < 0x10; ++i) {
+    printf("V%zX=%02" PRIX8 "%c", i, c8->V[i], i == 0xF ? '\n' : ' ');
+  }
+}
+
+/* Runs frame by frame, pacing and recording each frame as asked. */
+static void run_frames(chip8 *c8, const struct options *o, uint64_t ncycles,
+                       chip8_rewind *r)
+{
+  struct chip8_sched sched;
+  chip8_sched_init(&sched, o->pace, o->factor);
+  if (r) {
+    chip8_rewind_record(r, c8);
+  }
+  if (o->video) {
+    chip8_video_frame(o->video, c8);
+  }
+  while (c8->cycles < ncycles) {
+    uint64_t until = o->movie ? chip8_movie_apply(o->movie, c8) : UINT64_MAX;
+    if (c8->halted && until == UINT64_MAX) {
+      break;
+    }
+    /* A frame stops at each event of the movie, and is recorded once
+       run to its end. */
+    for (;;) {
+      uint64_t n = ncycles - c8->cycles;
+      chip8_sched_run(&sched, c8, o->run, n < until ? n : until);
+      if (c8->tick_cycles == 0 || c8->cycles >= ncycles) {
+        break;
+      }
+      until = o->movie ? chip8_movie_apply(o->movie, c8) : UINT64_MAX;
+    }
+    if (r) {
+      chip8_rewind_record(r, c8);
+    }
+    if (o->video) {
+      chip8_video_frame(o->video, c8);
+    }
+    if (report_profile && c8->profile) {
+      chip8_profile_report(c8->profile, c8, stderr, PROFILE_TOP);
+      report_profile = 0;
+    }
+  }
+}
+
+/* Seeks to the oldest frame recorded and back to the newest. */
+static void report_rewind(chip8 *c8, chip8_rewind *r)
+{
+  long behind = chip8_rewind_behind(r);
+  uint64_t start = now_ns();
+  chip8_rewind_seek(r, c8, -behind);
+  uint64_t back = now_ns() - start;
+  chip8_rewind_seek(r, c8, behind);
+  uint64_t forward = now_ns() - start - back;
+  printf("rewind: %ld frames in %zu bytes, seeked back in %" PRIu64
+         " us and forward in %" PRIu64 " us\n",
+         behind, chip8_rewind_bytes(r), back / 1000, forward / 1000);
+}
+
+static bool run_rom(char *rom_path, const struct options *o)
+{
+  chip8 *c8 = chip8_init();
+  if (!c8 || !chip8_set_mode(c8, o->mode)) {
+    errorf("%s: out of memory\n", rom_path);
+    if (c8) {
+      chip8_destroy(c8);
+    }
+    return false;
+  }
+  if (!chip8_load_rom(c8, rom_path)) {
+    errorf("%s: could not load ROM\n", rom_path);
+    chip8_destroy(c8);
+    return false;
+  }
+  chip8_set_cpu_rate(c8, o->cpu_hz);
+  chip8_set_idle_skip(c8, !o->no_idle_skip);
+  if (o->movie && !chip8_movie_start(o->movie, c8)) {
+    errorf("%s: the movie was recorded with another ROM or mode\n",
+           rom_path);
+    chip8_destroy(c8);
+    return false;
+  }
+  uint64_t ncycles = o->nframes ? o->nframes * c8->cycles_per_tick
+                                : o->ncycles;
+
+  chip8_rewind *r = NULL;
+  if (o->record && !(r = chip8_rewind_init(REWIND_BYTES, REWIND_FRAMES))) {
+    errorf("%s: out of memory\n", rom_path);
+    chip8_destroy(c8);
+    return false;
+  }
+
+  struct chip8_profile *profile = NULL;
+  if (o->profile && !(profile = chip8_profile_new())) {
+    errorf("%s: out of memory\n", rom_path);
+    if (r) {
+      chip8_rewind_free(r);
+    }
+    chip8_destroy(c8);
+    return false;
+  }
+  chip8_profile_attach(c8, profile);
+  chip8_audio_attach(c8, o->audio);
+
+  /* There is no keyboard: a ROM waiting for a key press can never continue,
+     so the run of that ROM is stopped. Profiled runs go frame by frame to
+     report on SIGUSR1. */
+  uint64_t start = now_ns();
+  if (r || o->pace != CHIP8_PACE_TURBO || profile || o->video) {
+    run_frames(c8, o, ncycles, r);
+  } else if (o->movie) {
+    chip8_movie_play(o->movie, c8, o->run, ncycles);
+  } else {
+    o->run(c8, ncycles);
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  const char *stop = "";
+  if (c8->halted) {
+    stop = chip8_exited(c8) ? ", exited"
+                            : ", stopped waiting for key press";
+  }
+  printf("%s: %" PRIu64 " cycles in %" PRIu64 " us (%.2f MIPS)%s\n",
+         rom_path, c8->cycles, elapsed / 1000,
+         elapsed ? c8->cycles * 1e3 / elapsed : 0.0, stop);
+  if (o->show_registers) {
+    print_registers(c8);
+  }
+  if (o->show_screen) {
+    print_screen(c8);
+  }
+  if (profile) {
+    chip8_profile_report(profile, c8, stdout, PROFILE_TOP);
+    chip8_profile_free(profile);
+  }
+  /* Last, as it leaves the machine at the newest frame recorded. */
+  chip8_audio_attach(c8, NULL);
+  if (r) {
+    report_rewind(c8, r);
+    chip8_rewind_free(r);
+  }
+
+  chip8_destroy(c8);
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  struct options o = {
+    .run = chip8_run,
+    .ncycles = 1000000,
+    .cpu_hz = CHIP8_DEFAULT_CPU_HZ,
+    .pace = CHIP8_PACE_TURBO,
+  };
+  const char *video_path = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:f:e:c:p:x:m:a:o:biPrs")) != -1) {
+    switch (opt) {
+    case 'n':
+      o.ncycles = strtoull(optarg, NULL, 10);
+      o.nframes = 0;
+      break;
+    case 'f':
+      o.nframes = strtoull(optarg, NULL, 10);
+      break;
+    case 'e':
+      if (strcmp(optarg, "interp") == 0) {
+        o.run = chip8_run;
+      } else if (strcmp(optarg, "blocks") == 0) {
+        o.run = chip8_run_blocks;
+      } else if (strcmp(optarg, "jit") == 0) {
+        o.run = chip8_run_jit;
+      } else if (strcmp(optarg, "jit-lockstep") == 0) {
+        o.run = run_jit_lockstep;
+      } else {
+        usage(argv[0]);
+      }
+      break;
+    case 'c':
+      o.cpu_hz = strtoul(optarg, NULL, 10);
+      break;
+    case 'p': {
+      char *end;
+      if (strcmp(optarg, "turbo") == 0) {
+        o.pace = CHIP8_PACE_TURBO;
+      } else if (strcmp(optarg, "fixed") == 0) {
+        o.pace = CHIP8_PACE_FIXED;
+      } else if ((o.factor = strtoul(optarg, &end, 10)) > 0
+                 && strcmp(end, "x") == 0) {
+        o.pace = CHIP8_PACE_FAST_FORWARD;
+      } else {
+        usage(argv[0]);
+      }
+      break;
+    }
+    case 'x':
+      if (strcmp(optarg, "chip8") == 0) {
+        o.mode = CHIP8_MODE_CHIP8;
+      } else if (strcmp(optarg, "schip") == 0) {
+        o.mode = CHIP8_MODE_SCHIP;
+      } else if (strcmp(optarg, "xochip") == 0) {
+        o.mode = CHIP8_MODE_XOCHIP;
+      } else {
+        usage(argv[0]);
+      }
+      break;
+    case 'm':
+      if (!(o.movie = chip8_movie_load(optarg))) {
+        errorf("%s: could not read movie\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'a': {
+      struct chip8_audio_sink sink;
+      if (strcmp(optarg, "null") == 0) {
+        chip8_audio_null_sink(&sink);
+      } else if (!chip8_audio_wav_sink(&sink, optarg, CHIP8_AUDIO_RATE)) {
+        errorf("%s: could not create file\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      if (o.audio) {
+        chip8_audio_close(o.audio);
+      }
+      if (!(o.audio = chip8_audio_open(&sink, CHIP8_AUDIO_RATE))) {
+        errorf("could not start audio\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case 'o':
+      video_path = optarg;
+      break;
+    case 'b':
+      o.record = true;
+      break;
+    case 'i':
+      o.no_idle_skip = true;
+      break;
+    case 'P':
+      if (!chip8_profile_available()) {
+        errorf("built without profiling, see make profile\n");
+        exit(EXIT_FAILURE);
+      }
+      o.profile = true;
+      break;
+    case 'r':
+      o.show_registers = true;
+      break;
+    case 's':
+      o.show_screen = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind == argc) {
+    usage(argv[0]);
+  }
+  /* Once the mode is known. */
+  if (video_path && !(o.video = chip8_video_create(video_path, o.mode))) {
+    errorf("%s: could not create file\n", video_path);
+    exit(EXIT_FAILURE);
+  }
+
+  if (o.profile) {
+    struct sigaction sa = { .sa_handler = request_profile_report };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+  }
+
+  int status = EXIT_SUCCESS;
+  for (int i = optind; i < argc; ++i) {
+    if (!run_rom(argv[i], &o)) {
+      status = EXIT_FAILURE;
+    }
+  }
+  if (o.movie) {
+    chip8_movie_free(o.movie);
+  }
+  if (o.video && !chip8_video_close(o.video)) {
+    errorf("video: could not write the frames\n");
+    status = EXIT_FAILURE;
+  }
+  if (o.audio) {
+    if (chip8_audio_dropped(o.audio) > 0) {
+      errorf("audio: %" PRIu64 " events dropped\n",
+             chip8_audio_dropped(o.audio));
+    }
+    if (!chip8_audio_close(o.audio)) {
+      errorf("audio: could not write the sound\n");
+      status = EXIT_FAILURE;
+    }
+  }
+  return status;
+}
@@ -0,0 +1,794 @@
+/* Translates basic blocks to x86-64 machine code.
+
+   Translated code is entered through a stub taking the chip8 pointer, which
+   stays in rbx while it runs, and counts the instructions it executes in
+   r12. Simple instructions are translated to code operating directly on the
+   chip8 struct; DXYN, 00E0, CXNN and the memory instructions call the code of
+   the interpreter for them. The timers are only updated once translated code
+   returns, so FX07 computes what the delay timer would be from r12, while
+   FX15, FX18 and FX0A are always left to the interpreter: translation of a
+   block stops before them.
+
+   A block leaving to a known address returns through code that sets pc,
+   until the block there is translated: the jump to that code is then
+   patched to go straight to the next block, which chains blocks as long as
+   the cycle budget allows. Patched jumps are undone whenever cached code is
+   dropped. */
+
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "chip8_internal.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#define CHIP8_JIT 1
+#include <sys/mman.h>
+#else
+#define CHIP8_JIT 0
+#endif
+
+#define CODE_SIZE (1 << 20)
+#define MAX_UOP_CODE 64 /* Upper bound of code generated for one uop */
+
+/* What the entry stub returns: the number of instructions executed, and the
+   exit record of the exit taken, if it is to a known address. */
+struct native_exit {
+  uint64_t executed;
+  const uint8_t *record;
+};
+
+/* Runs the code of a block with the chip8 pointer, chaining to other blocks
+   while fewer than limit instructions have been executed. */
+typedef struct native_exit (*native_entry)(chip8 *, uint32_t limit,
+                                           const void *code);
+
+/* Follows the code of each exit to a known address. */
+struct exit_record {
+  uint32_t site;    /* Offset of the rel32 of the jump patched to chain */
+  uint16_t target;
+  bool jumps;       /* Left by 1NNN, at the target of which polling loops
+                       are looked for */
+};
+
+struct chip8_jit {
+  uint8_t *code;
+  size_t used;
+  size_t stubs;      /* Size of the entry stub and the epilogue */
+  uint8_t *epilogue; /* Returns from translated code */
+  /* Patched jumps, undone when the cache drops blocks */
+  uint32_t *chained;
+  size_t nchained;
+  size_t chained_cap;
+  uint32_t invalidations;  /* Of the block cache, when last undone */
+  bool skip_idle;          /* Of the machine, when last undone */
+  bool lockstep;
+  chip8 *reference; /* Interpreted copy used in lockstep mode */
+  chip8 *before;    /* State before the block checked in lockstep mode */
+};
+
+/* Uops are passed to the interpreter's code by value in a register. */
+typedef char uop_fits_register[sizeof(struct chip8_uop) == 8 ? 1 : -1];
+
+void chip8_jit_set_lockstep(chip8 *c8, bool lockstep)
+{
+  if (c8->jit) {
+    c8->jit->lockstep = lockstep;
+    return;
+  }
+  if (!lockstep) {
+    return;
+  }
+  c8->jit = calloc(1, sizeof(*c8->jit));
+  if (c8->jit) {
+    c8->jit->lockstep = true;
+  }
+}
+
+void chip8_jit_free(struct chip8_jit *jit)
+{
+#if CHIP8_JIT
+  if (jit->code) {
+    munmap(jit->code, CODE_SIZE);
+  }
+#endif
+  if (jit->reference) {
+    chip8_destroy(jit->reference);
+  }
+  if (jit->before) {
+    chip8_destroy(jit->before);
+  }
+  free(jit->chained);
+  free(jit);
+}
+
+#if CHIP8_JIT
+
+/* Allocates the machines lockstep mode checks blocks with. */
+static bool lockstep_init(struct chip8_jit *jit)
+{
+  if (!jit->reference) {
+    jit->reference = chip8_init();
+  }
+  if (!jit->before) {
+    jit->before = chip8_init();
+  }
+  return jit->reference && jit->before;
+}
+
+/* Copies the machine state of src to dst, leaving dst's engines alone.
+   Both are in CHIP-8 mode, the only one translated. */
+static void copy_state(chip8 *dst, const chip8 *src)
+{
+  uint8_t *memory = dst->memory;
+  uint64_t (*gfx)[DISPLAY_HIRES_HEIGHT][DISPLAY_ROW_WORDS] = dst->gfx;
+  uint32_t memory_alloc = dst->memory_alloc;
+  uint32_t gfx_alloc = dst->gfx_alloc;
+  struct chip8_bcache *bcache = dst->bcache;
+  struct chip8_jit *jit = dst->jit;
+  struct chip8_pages *pages = dst->pages;
+  struct chip8_profile *profile = dst->profile;
+  struct chip8_audio *audio = dst->audio;
+  struct chip8_hash *hash = dst->hash;
+  memcpy(dst, src, sizeof(*dst));
+  dst->bcache = bcache;
+  dst->jit = jit;
+  dst->pages = pages;
+  dst->profile = profile;
+  dst->audio = audio;
+  dst->hash = hash;
+  dst->memory = memory;
+  dst->gfx = gfx;
+  dst->memory_alloc = memory_alloc;
+  dst->gfx_alloc = gfx_alloc;
+  memcpy(dst->memory, src->memory, chip8_memory_size(src));
+  memcpy(dst->gfx, src->gfx, chip8_gfx_rows(src) * sizeof(src->gfx[0][0]));
+}
+
+static bool same(const char *name, long i, uint64_t a, uint64_t b)
+{
+  if (a == b) {
+    return true;
+  }
+  if (i < 0) {
+    fprintf(stderr, "  %s: 0x%" PRIX64 " (jit) != 0x%" PRIX64 "\n", name, a, b);
+  } else {
+    fprintf(stderr, "  %s[0x%lX]: 0x%" PRIX64 " (jit) != 0x%" PRIX64 "\n",
+            name, i, a, b);
+  }
+  return false;
+}
+
+static bool report_differences(const chip8 *a, const chip8 *b)
+{
+  bool ok = true;
+  ok &= same("pc", -1, a->pc, b->pc);
+  ok &= same("I", -1, a->I, b->I);
+  ok &= same("sp", -1, a->sp, b->sp);
+  ok &= same("delay_timer", -1, a->delay_timer, b->delay_timer);
+  ok &= same("sound_timer", -1, a->sound_timer, b->sound_timer);
+  ok &= same("cycles", -1, a->cycles, b->cycles);
+  ok &= same("tick_cycles", -1, a->tick_cycles, b->tick_cycles);
+  ok &= same("rng", -1, a->rng, b->rng);
+  for (long i = 0; i < (long) sizeof(a->V); ++i) {
+    ok &= same("V", i, a->V[i], b->V[i]);
+  }
+  for (long i = 0; i < (long) (sizeof(a->stack)/sizeof(*a->stack)); ++i) {
+    ok &= same("stack", i, a->stack[i], b->stack[i]);
+  }
+  for (long i = 0; i < (long) chip8_memory_size(a); ++i) {
+    ok &= same("memory", i, a->memory[i], b->memory[i]);
+  }
+  for (long i = 0; i < DISPLAY_HEIGHT; ++i) {
+    ok &= same("gfx", i, a->gfx[0][i][0], b->gfx[0][i][0]);
+  }
+  return ok;
+}
+
+/* Runs the interpreter from the state before a translated block for as many
+   instructions as the block executed, and compares the results. */
+static void check_lockstep(chip8 *c8, const chip8 *before, uint32_t n)
+{
+  chip8 *ref = c8->jit->reference;
+  copy_state(ref, before);
+  for (uint32_t i = 0; i < n; ++i) {
+    chip8_interpret(ref);
+  }
+  if (!report_differences(c8, ref)) {
+    fprintf(stderr, "JIT and interpreter differ after block at 0x%03" PRIX16
+            " (%" PRIu32 " instructions)\n", before->pc, n);
+    abort();
+  }
+}
+
+enum { AL = 0, CL = 1, DL = 2 };
+enum { CC_C = 0x2, CC_NC = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7 };
+
+#define OFF(field) ((int32_t) offsetof(chip8, field))
+#define OFF_V(x) (OFF(V) + (x))
+
+struct emitter {
+  uint8_t *p;
+  const struct chip8_jit *jit;
+};
+
+static void emit8(struct emitter *e, uint8_t b)
+{
+  *e->p++ = b;
+}
+
+static void emit16(struct emitter *e, uint16_t v)
+{
+  memcpy(e->p, &v, sizeof(v));
+  e->p += sizeof(v);
+}
+
+static void emit32(struct emitter *e, uint32_t v)
+{
+  memcpy(e->p, &v, sizeof(v));
+  e->p += sizeof(v);
+}
+
+static void emit64(struct emitter *e, uint64_t v)
+{
+  memcpy(e->p, &v, sizeof(v));
+  e->p += sizeof(v);
+}
+
+/* ModRM operand [rbx + disp32], with reg (or opcode extension) reg. */
+static void emit_mem(struct emitter *e, uint8_t reg, int32_t disp)
+{
+  emit8(e, 0x83 | reg << 3);
+  emit32(e, disp);
+}
+
+/* op reg8, byte [rbx + disp] */
+static void emit_op_load8(struct emitter *e, uint8_t op, uint8_t reg,
+                          int32_t disp)
+{
+  emit8(e, op);
+  emit_mem(e, reg, disp);
+}
+
+static void emit_load8(struct emitter *e, uint8_t reg, int32_t disp)
+{
+  emit_op_load8(e, 0x8A, reg, disp);
+}
+
+static void emit_store8(struct emitter *e, uint8_t reg, int32_t disp)
+{
+  emit_op_load8(e, 0x88, reg, disp);
+}
+
+/* movzx eax, byte [rbx + disp] */
+static void emit_movzx8(struct emitter *e, uint8_t reg, int32_t disp)
+{
+  emit8(e, 0x0F);
+  emit8(e, 0xB6);
+  emit_mem(e, reg, disp);
+}
+
+/* movzx reg32, word [rbx + disp] */
+static void emit_movzx16(struct emitter *e, uint8_t reg, int32_t disp)
+{
+  emit8(e, 0x0F);
+  emit8(e, 0xB7);
+  emit_mem(e, reg, disp);
+}
+
+/* mov word [rbx + disp], imm16 */
+static void emit_store16_imm(struct emitter *e, int32_t disp, uint16_t imm)
+{
+  emit8(e, 0x66);
+  emit8(e, 0xC7);
+  emit_mem(e, 0, disp);
+  emit16(e, imm);
+}
+
+/* setcc reg8 */
+static void emit_setcc(struct emitter *e, uint8_t cc, uint8_t reg)
+{
+  emit8(e, 0x0F);
+  emit8(e, 0x90 | cc);
+  emit8(e, 0xC0 | reg);
+}
+
+/* jmp rel32 to the given code */
+static void emit_jmp(struct emitter *e, const uint8_t *to)
+{
+  emit8(e, 0xE9);
+  emit32(e, (uint32_t) (to - (e->p + 4)));
+}
+
+/* Emits the entry stub, then the epilogue, which returns r12d and rdx. */
+static void emit_stubs(struct emitter *e, struct chip8_jit *jit)
+{
+  emit8(e, 0x53);                                   /* push rbx */
+  emit8(e, 0x41); emit8(e, 0x54);                   /* push r12 */
+  emit8(e, 0x41); emit8(e, 0x55);                   /* push r13 */
+  emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xFB);   /* mov rbx, rdi */
+  emit8(e, 0x45); emit8(e, 0x31); emit8(e, 0xE4);   /* xor r12d, r12d */
+  emit8(e, 0x41); emit8(e, 0x89); emit8(e, 0xF5);   /* mov r13d, esi */
+  emit8(e, 0xFF); emit8(e, 0xE2);                   /* jmp rdx */
+  jit->epilogue = e->p;
+  emit8(e, 0x44); emit8(e, 0x89); emit8(e, 0xE0);   /* mov eax, r12d */
+  emit8(e, 0x41); emit8(e, 0x5D);                   /* pop r13 */
+  emit8(e, 0x41); emit8(e, 0x5C);                   /* pop r12 */
+  emit8(e, 0x5B);                                   /* pop rbx */
+  emit8(e, 0xC3);                                   /* ret */
+}
+
+/* Counts n instructions executed, leaving the flags alone. */
+static void emit_count(struct emitter *e, uint32_t n)
+{
+  /* lea r12d, [r12 + n] */
+  emit8(e, 0x45); emit8(e, 0x8D); emit8(e, 0x64); emit8(e, 0x24);
+  emit8(e, n);
+}
+
+/* Returns to the caller, pc having been set. */
+static void emit_return(struct emitter *e)
+{
+  emit8(e, 0x31); emit8(e, 0xD2);                   /* xor edx, edx */
+  emit_jmp(e, e->jit->epilogue);
+}
+
+/* Leaves for the block at target: straight to its code once chained and if
+   the budget allows, or else returning with pc set to target. */
+static void emit_exit(struct emitter *e, uint16_t target, bool jumps)
+{
+  emit8(e, 0x45); emit8(e, 0x39); emit8(e, 0xEC);   /* cmp r12d, r13d */
+  emit8(e, 0x73); emit8(e, 5);                      /* jae over the jmp */
+  emit8(e, 0xE9);                                   /* jmp, patched */
+  struct exit_record r = { (uint32_t) (e->p - e->jit->code), target, jumps };
+  emit32(e, 0);
+  emit_store16_imm(e, OFF(pc), target);
+  emit8(e, 0x48); emit8(e, 0x8D); emit8(e, 0x15);   /* lea rdx, [rip + 5], */
+  emit32(e, 5);                                     /*   the record */
+  emit_jmp(e, e->jit->epilogue);
+  memcpy(e->p, &r, sizeof(r));
+  e->p += sizeof(r);
+}
+
+typedef bool (*callback)(chip8 *, uint64_t);
+
+/* Calls the function of which the pointer is at fun with the chip8 pointer
+   and the bits of the uop, leaving the third argument, rdx, alone. */
+static void emit_call(struct emitter *e, const void *fun,
+                      const struct chip8_uop *u)
+{
+  uint64_t bits;
+  uint64_t address;
+  memcpy(&bits, u, sizeof(bits));
+  memcpy(&address, fun, sizeof(address));
+  emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xDF);   /* mov rdi, rbx */
+  emit8(e, 0x48); emit8(e, 0xBE); emit64(e, bits);  /* mov rsi, bits */
+  emit8(e, 0x48); emit8(e, 0xB8);                   /* mov rax, fun */
+  emit64(e, address);
+  emit8(e, 0xFF); emit8(e, 0xD0);                   /* call rax */
+}
+
+/* Executes an instruction with the interpreter. Returns whether any cached
+   code was overwritten, which only instructions writing memory can do. */
+static bool interpret(chip8 *c8, uint64_t bits)
+{
+  uint32_t invalidations = c8->bcache->invalidations;
+  struct chip8_uop u;
+  memcpy(&u, &bits, sizeof(u));
+  chip8_steps[u.op](c8, bits);
+  return c8->bcache->invalidations != invalidations;
+}
+
+/* FX07, executed after the given number of instructions of translated code,
+   for which the timers have not ticked yet. */
+static void read_delay(chip8 *c8, uint64_t bits, uint32_t executed)
+{
+  struct chip8_uop u;
+  memcpy(&u, &bits, sizeof(u));
+  uint64_t n = ((uint64_t) c8->tick_cycles + executed) / c8->cycles_per_tick;
+  c8->V[u.X] = c8->delay_timer > n ? c8->delay_timer - n : 0;
+}
+
+static bool translatable(const struct chip8_uop *u)
+{
+  switch (u->op) {
+  case OP_FX0A: case OP_FX15: case OP_FX18:
+    return false;
+  default:
+    return true;
+  }
+}
+
+/* How the code of an instruction leaves the block. */
+enum next {
+  NEXT_FALL,     /* Falls through to the next instruction */
+  NEXT_JUMP,     /* Jumps to NNN */
+  NEXT_SKIP,     /* Skips the next instruction if condition cc holds */
+  NEXT_RETURN,   /* Sets pc, and the block returns */
+};
+
+/* Emits code for instruction i of the block, at address addr. Returns how
+   it leaves the block, with the condition of a skip in cc. */
+static enum next emit_uop(struct emitter *e, const struct chip8_uop *u,
+                          uint16_t addr, uint32_t i, uint8_t *cc)
+{
+  int32_t VX = OFF_V(u->X);
+  int32_t VY = OFF_V(u->Y);
+  int32_t VF = OFF_V(0xF);
+
+  switch (u->op) {
+  case OP_00EE:
+    emit8(e, 0x66); emit8(e, 0x83); emit_mem(e, 5, OFF(sp)); emit8(e, 1);
+    emit_movzx16(e, AL, OFF(sp));
+    /* movzx eax, word [rbx + rax*2 + stack] */
+    emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0x84); emit8(e, 0x43);
+    emit32(e, OFF(stack));
+    emit8(e, 0x83); emit8(e, 0xC0); emit8(e, 2);    /* add eax, 2 */
+    emit8(e, 0x66); emit8(e, 0x89); emit_mem(e, AL, OFF(pc));
+    return NEXT_RETURN;
+  case OP_1NNN:
+    return NEXT_JUMP;
+  case OP_2NNN:
+    emit_movzx16(e, AL, OFF(sp));
+    /* mov word [rbx + rax*2 + stack], addr */
+    emit8(e, 0x66); emit8(e, 0xC7); emit8(e, 0x84); emit8(e, 0x43);
+    emit32(e, OFF(stack));
+    emit16(e, addr);
+    emit8(e, 0x66); emit8(e, 0x83); emit_mem(e, 0, OFF(sp)); emit8(e, 1);
+    return NEXT_JUMP;
+  case OP_3XNN:
+  case OP_4XNN:
+    emit8(e, 0x80); emit_mem(e, 7, VX); emit8(e, u->NN);  /* cmp */
+    *cc = u->op == OP_3XNN ? CC_E : CC_NE;
+    return NEXT_SKIP;
+  case OP_5XY0:
+  case OP_9XY0:
+    emit_load8(e, AL, VX);
+    emit_op_load8(e, 0x3A, AL, VY);                       /* cmp */
+    *cc = u->op == OP_5XY0 ? CC_E : CC_NE;
+    return NEXT_SKIP;
+  case OP_6XNN:
+    emit8(e, 0xC6); emit_mem(e, 0, VX); emit8(e, u->NN);
+    return NEXT_FALL;
+  case OP_7XNN:
+    emit8(e, 0x80); emit_mem(e, 0, VX); emit8(e, u->NN);
+    return NEXT_FALL;
+  case OP_8XY0:
+    emit_load8(e, AL, VY);
+    emit_store8(e, AL, VX);
+    return NEXT_FALL;
+  case OP_8XY1:
+  case OP_8XY2:
+  case OP_8XY3: {
+    static const uint8_t ops[] = { 0x0A, 0x22, 0x32 };    /* or, and, xor */
+    emit_load8(e, AL, VX);
+    emit_op_load8(e, ops[u->op - OP_8XY1], AL, VY);
+    emit_store8(e, AL, VX);
+    return NEXT_FALL;
+  }
+  /* The arithmetic instructions set VF before writing VX, and read their
+     operands again afterwards, exactly like the interpreter. This matters
+     when X or Y is F. */
+  case OP_8XY4:
+  case OP_8XY5:
+  case OP_8XY7: {
+    bool add = u->op == OP_8XY4;
+    int32_t a = u->op == OP_8XY7 ? VY : VX;
+    int32_t b = u->op == OP_8XY7 ? VX : VY;
+    emit_load8(e, AL, a);
+    emit_load8(e, CL, b);
+    emit8(e, add ? 0x00 : 0x28); emit8(e, 0xC8);          /* add/sub al, cl */
+    emit_setcc(e, add ? CC_C : CC_NC, DL);
+    emit_store8(e, DL, VF);
+    emit_load8(e, AL, a);
+    emit_op_load8(e, add ? 0x02 : 0x2A, AL, b);
+    emit_store8(e, AL, VX);
+    return NEXT_FALL;
+  }
+  case OP_8XY6:
+    emit_load8(e, AL, VX);
+    emit8(e, 0x24); emit8(e, 0x01);                       /* and al, 1 */
+    emit_store8(e, AL, VF);
+    emit8(e, 0xD0); emit_mem(e, 5, VX);                   /* shr byte, 1 */
+    return NEXT_FALL;
+  case OP_8XYE:
+    emit_load8(e, AL, VX);
+    emit8(e, 0xC0); emit8(e, 0xE8); emit8(e, 7);          /* shr al, 7 */
+    emit_store8(e, AL, VF);
+    emit8(e, 0xD0); emit_mem(e, 4, VX);                   /* shl byte, 1 */
+    return NEXT_FALL;
+  case OP_ANNN:
+    emit_store16_imm(e, OFF(I), u->NNN);
+    return NEXT_FALL;
+  case OP_BNNN:
+    emit_movzx8(e, AL, OFF_V(0));
+    emit8(e, 0x05); emit32(e, u->NNN);                    /* add eax, NNN */
+    emit8(e, 0x66); emit8(e, 0x89); emit_mem(e, AL, OFF(pc));
+    return NEXT_RETURN;
+  case OP_EX9E:
+  case OP_EXA1:
+    emit_movzx8(e, AL, VX);
+    emit8(e, 0x83); emit8(e, 0xE0); emit8(e, 0x0F);       /* and eax, 0xF */
+    /* movzx eax, byte [rbx + rax + key] */
+    emit8(e, 0x0F); emit8(e, 0xB6); emit8(e, 0x84); emit8(e, 0x03);
+    emit32(e, OFF(key));
+    emit8(e, 0x84); emit8(e, 0xC0);                       /* test al, al */
+    *cc = u->op == OP_EX9E ? CC_NE : CC_E;
+    return NEXT_SKIP;
+  case OP_FX1E:
+    emit_movzx8(e, AL, VX);
+    emit_movzx16(e, CL, OFF(I));
+    emit8(e, 0x01); emit8(e, 0xC1);                       /* add ecx, eax */
+    emit8(e, 0x81); emit8(e, 0xF9); emit32(e, 0xFFF);     /* cmp ecx, 0xFFF */
+    emit_setcc(e, CC_A, DL);
+    emit_store8(e, DL, VF);
+    emit_movzx8(e, AL, VX);
+    emit8(e, 0x66); emit8(e, 0x01); emit_mem(e, AL, OFF(I));
+    return NEXT_FALL;
+  case OP_FX07: {
+    typedef void (*reader)(chip8 *, uint64_t, uint32_t);
+    /* lea edx, [r12 + i] */
+    emit8(e, 0x41); emit8(e, 0x8D); emit8(e, 0x54); emit8(e, 0x24);
+    emit8(e, i);
+    emit_call(e, &(reader) { read_delay }, u);
+    return NEXT_FALL;
+  }
+  case OP_FX33:
+  case OP_FX55:
+    emit_store16_imm(e, OFF(pc), addr);
+    emit_call(e, &(callback) { interpret }, u);
+    emit8(e, 0x84); emit8(e, 0xC0);                       /* test al, al */
+    emit8(e, 0x74); emit8(e, 12);                         /* jz over ret */
+    emit_count(e, i + 1);
+    emit_return(e);
+    return NEXT_FALL;
+  default:
+    /* 00E0, CXNN, DXYN, FX29, FX65 and invalid opcodes, of which 00FD and
+       the invalid ones end the block */
+    emit_store16_imm(e, OFF(pc), addr);
+    emit_call(e, &chip8_steps[u->op], u);
+    return u->op == OP_00FD || u->op == OP_INVALID ? NEXT_RETURN : NEXT_FALL;
+  }
+}
+
+/* Forgets all translations, making room for new ones. */
+static void jit_flush(chip8 *c8)
+{
+  struct chip8_bcache *bc = c8->bcache;
+  for (size_t i = 0; i < sizeof(bc->blocks)/sizeof(*bc->blocks); ++i) {
+    if (bc->blocks[i]) {
+      bc->blocks[i]->native = NULL;
+      bc->blocks[i]->native_tried = false;
+    }
+  }
+  c8->jit->used = c8->jit->stubs;
+  c8->jit->nchained = 0;
+}
+
+/* Translates a block. Returns whether the translations were flushed to
+   make room for it. */
+static bool jit_translate(chip8 *c8, struct chip8_block *b)
+{
+  struct chip8_jit *jit = c8->jit;
+  uint32_t n = 0;
+  while (n < b->nuops && translatable(&b->uops[n])) {
+    ++n;
+  }
+  b->native_tried = true;
+  if (n == 0) {
+    return false;
+  }
+
+  /* Two more for the exits */
+  bool flushed = jit->used + (n+2) * MAX_UOP_CODE > CODE_SIZE;
+  if (flushed) {
+    jit_flush(c8);
+    b->native_tried = true;
+  }
+
+  struct emitter e = { jit->code + jit->used, jit };
+  enum next next = NEXT_FALL;
+  uint8_t cc = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    next = emit_uop(&e, &b->uops[i], b->start + 2*i, i, &cc);
+  }
+  const struct chip8_uop *last = &b->uops[n-1];
+  uint16_t addr = b->start + 2*(n-1);
+  emit_count(&e, n);
+  switch (next) {
+  case NEXT_FALL:
+    emit_exit(&e, addr + 2, false);
+    break;
+  case NEXT_JUMP:
+    emit_exit(&e, last->NNN, last->op == OP_1NNN);
+    break;
+  case NEXT_SKIP: {
+    emit8(&e, 0x0F); emit8(&e, 0x80 | cc);            /* jcc to the skip */
+    uint8_t *rel = e.p;
+    emit32(&e, 0);
+    emit_exit(&e, addr + 2, false);
+    uint32_t skip = e.p - (rel + 4);
+    memcpy(rel, &skip, sizeof(skip));
+    emit_exit(&e, addr + 4, false);
+    break;
+  }
+  case NEXT_RETURN:
+    emit_return(&e);
+    break;
+  }
+
+  b->native = jit->code + jit->used;
+  jit->used = (e.p - jit->code + 15) & ~(size_t) 15;
+  return flushed;
+}
+
+/* Whether a block may be a polling loop, by its first instruction, as
+   chip8_skip_idle checks at the target of each 1NNN. */
+static bool may_poll(const struct chip8_block *b)
+{
+  switch (b->uops[0].op) {
+  case OP_FX07: case OP_EX9E: case OP_EXA1: case OP_6XNN:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* Patches the exit of the given record to jump straight to the code of b,
+   the block at its target, unless done already. When idle skipping, exits
+   by 1NNN are left for the caller if b may be a polling loop. */
+static void chain(struct chip8_jit *jit, const uint8_t *record,
+                  const struct chip8_block *b)
+{
+  struct exit_record r;
+  memcpy(&r, record, sizeof(r));
+  uint8_t *site = jit->code + r.site;
+  uint32_t rel;
+  memcpy(&rel, site, sizeof(rel));
+  assert(r.target == b->start);
+  if (rel != 0 || (r.jumps && jit->skip_idle && may_poll(b))) {
+    return;
+  }
+  if (jit->nchained == jit->chained_cap) {
+    size_t cap = jit->chained_cap ? 2 * jit->chained_cap : 256;
+    uint32_t *chained = realloc(jit->chained, cap * sizeof(*chained));
+    if (!chained) {
+      return;
+    }
+    jit->chained = chained;
+    jit->chained_cap = cap;
+  }
+  rel = (uint32_t) ((const uint8_t *) b->native - (site + 4));
+  memcpy(site, &rel, sizeof(rel));
+  jit->chained[jit->nchained++] = r.site;
+}
+
+/* Undoes every patched jump, as blocks they lead to may have been dropped
+   from the cache since, or idle skipping turned on. */
+static void unchain(struct chip8_jit *jit, const chip8 *c8)
+{
+  for (size_t i = 0; i < jit->nchained; ++i) {
+    memset(jit->code + jit->chained[i], 0, sizeof(uint32_t));
+  }
+  jit->nchained = 0;
+  jit->invalidations = c8->bcache->invalidations;
+  jit->skip_idle = c8->skip_idle;
+}
+
+static bool jit_init(chip8 *c8)
+{
+  if (!c8->jit) {
+    c8->jit = calloc(1, sizeof(*c8->jit));
+    if (!c8->jit) {
+      return false;
+    }
+  }
+  if (!c8->jit->code) {
+    void *code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+      return false;
+    }
+    struct chip8_jit *jit = c8->jit;
+    jit->code = code;
+    struct emitter e = { jit->code, jit };
+    emit_stubs(&e, jit);
+    jit->stubs = (e.p - jit->code + 15) & ~(size_t) 15;
+    jit->used = jit->stubs;
+  }
+  return !c8->jit->lockstep || lockstep_init(c8->jit);
+}
+
+uint64_t chip8_run_jit(chip8 *c8, uint64_t ncycles)
+{
+  /* Translated code does not count instructions for the profiler, and
+     only knows the CHIP-8 instruction set. */
+  if (chip8_profiling(c8) || c8->mode != CHIP8_MODE_CHIP8 || !jit_init(c8)) {
+    return chip8_run_blocks(c8, ncycles);
+  }
+  struct chip8_jit *jit = c8->jit;
+  native_entry enter;
+  void *stub = jit->code;
+  memcpy(&enter, &stub, sizeof(enter));
+  uint64_t n = 0;
+  /* Record of the exit the last code run left by, to chain */
+  const uint8_t *from = NULL;
+
+  c8->draw_flag = false;
+  c8->halted = false;
+  while (n < ncycles) {
+    struct chip8_block *b = chip8_block_at(c8, c8->pc);
+    if (b && !b->native_tried && jit_translate(c8, b)) {
+      from = NULL;
+    }
+    if (c8->bcache && (c8->bcache->invalidations != jit->invalidations ||
+                       c8->skip_idle != jit->skip_idle)) {
+      unchain(jit, c8);
+      from = NULL;
+    }
+    if (!b || !b->native || n + b->nuops > ncycles) {
+      /* Not translated, at the end of memory, or the block might overrun
+         the cycle budget: interpret the next instruction instead. */
+      chip8_interpret(c8);
+      ++n;
+      from = NULL;
+      if (c8->halted) {
+        break;
+      }
+      continue;
+    }
+    if (from) {
+      chain(jit, from, b);
+    }
+
+    if (jit->lockstep) {
+      copy_state(jit->before, c8);
+    }
+
+    /* Chains to the next block while one of the longest still fits in the
+       budget, but not in lockstep mode, which checks each block. The block
+       is freed if an instruction in it overwrites its code, so it is not
+       used after running. */
+    uint64_t left = ncycles - n;
+    uint32_t limit = 0;
+    if (!jit->lockstep && left > BLOCK_MAX_UOPS) {
+      limit = left - BLOCK_MAX_UOPS < UINT32_MAX / 2 ? left - BLOCK_MAX_UOPS
+                                                     : UINT32_MAX / 2;
+    }
+    struct native_exit x = enter(c8, limit, b->native);
+    chip8_tick_timers_n(c8, x.executed);
+    c8->cycles += x.executed;
+    n += x.executed;
+
+    if (jit->lockstep) {
+      check_lockstep(c8, jit->before, x.executed);
+    }
+    from = x.record;
+    if (from) {
+      struct exit_record r;
+      memcpy(&r, from, sizeof(r));
+      if (r.jumps) {
+        uint64_t skipped = chip8_skip_idle(c8, ncycles - n);
+        c8->cycles += skipped;
+        n += skipped;
+      }
+    }
+  }
+
+  return n;
+}
+
+#else
+
+uint64_t chip8_run_jit(chip8 *c8, uint64_t ncycles)
+{
+  return chip8_run_blocks(c8, ncycles);
+}
+
+#endif
@@ -1,36 +1,68 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
+#include "audio.h"
 #include "chip8.h"
-
+#include "frames.h"
+#include "movie.h"
+#include "profile.h"
+#include "render.h"
+#include "rewind.h"
+#include "sched.h"
+
+/* The framebuffer is drawn as a single quad covering the window. Each
+   fragment looks its pixel up in a texture holding the framebuffer rows as
+   they are stored in chip8.gfx, one bit per pixel, the rows of the second
+   plane below those of the first. Its color is picked by the planes it is
+   lit in, and size is the resolution in use. */
 const char *vertex_shader_glsl =
   "#version 410 core\n"
-  "in vec2 pos;\n"
+  "out vec2 corner;\n"
   "void main() {\n"
-  " gl_Position = vec4(pos, 0.0, 1.0);\n"
+  "  corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+  "  gl_Position = vec4(2.0*corner.x - 1.0, 1.0 - 2.0*corner.y, 0.0, 1.0);\n"
   "}";
 const char *fragment_shader_glsl =
   "#version 410 core\n"
+  "uniform usampler2D gfx;\n"
+  "uniform ivec2 size;\n"
+  "in vec2 corner;\n"
   "out vec4 color;\n"
+  "const vec4 palette[4] = vec4[4](vec4(0.1, 0.1, 0.1, 1.0),\n"
+  "                                vec4(0.85, 0.85, 0.85, 1.0),\n"
+  "                                vec4(0.9, 0.55, 0.1, 1.0),\n"
+  "                                vec4(0.4, 0.4, 0.4, 1.0));\n"
   "void main() {\n"
-  "  color = vec4(0.85, 0.85, 0.85, 1.0);\n"
+  "  ivec2 p = min(ivec2(corner * vec2(size)), size - 1);\n"
+  "  uint shift = uint(31 - (p.x & 31));\n"
+  "  uint lo = texelFetch(gfx, ivec2(p.x >> 5, p.y), 0).r;\n"
+  "  uint hi = texelFetch(gfx, ivec2(p.x >> 5, p.y + 64), 0).r;\n"
+  "  color = palette[((lo >> shift) & 1u) | (((hi >> shift) & 1u) << 1)];\n"
   "}";
 
-static size_t fill_vertices_to_draw(chip8 *, GLuint *);
+static void upload(const struct chip8_frame *);
+static void draw(bool hires);
 static void key_handler(GLFWwindow *, int, int, int, int);
 static void resize_handler(GLFWwindow *, GLsizei, GLsizei);
-static GLuint *gl_setup(void);
+static bool gl_setup(void);
 
 static void errorf(const char *fmt, ...)
 {
   va_list ap;
   va_start(ap, fmt);
-  fprintf(stderr, fmt, ap);
+  vfprintf(stderr, fmt, ap);
   va_end(ap);
 }
 
@@ -44,13 +76,132 @@ static void *emalloc(size_t size)
   exit(EXIT_FAILURE);
 }
 
+/* Speed while Tab is held. */
+#define FAST_FORWARD_FACTOR 4
+
+/* With -s, a frame whose last sprite erased pixels is held back, since the
+   game is likely to draw that sprite again in the next frame, unless this
+   many frames in a row were held back. */
+#define MAX_UNSTABLE_FRAMES 3
+
+/* Hottest addresses listed by the profile report. */
+#define PROFILE_TOP 20
+
+/* The machine runs on a thread of its own, which alone uses it and the
+   state below up to the frames. The main thread polls input and presents
+   the frames, so that waiting for either does not hold the machine up. */
 chip8 *c8;
+static chip8_movie *movie;
+static chip8_rewind *history;
+static struct chip8_profile *profile;
+static bool stable_only;
+static bool rewinding;
+static struct chip8_sched sched;
+static chip8_frames *frames;
+static bool quit;
+static bool resized;
+static GLint size_uniform;
+static volatile sig_atomic_t report_profile;
+
+/* Keys pressed and released, passed from key_handler to the emulation
+   thread. Events that do not fit are dropped. */
+#define INPUT_QUEUE_SIZE 64
+struct key_input {
+  int key;  /* GLFW key */
+  bool pressed;
+};
+static struct {
+  struct key_input events[INPUT_QUEUE_SIZE];
+  unsigned head;  /* Written by the main thread */
+  unsigned tail;  /* Written by the emulation thread */
+} input;
+
+static void request_profile_report(int sig)
+{
+  (void) sig;
+  report_profile = 1;
+}
+
+static void handle_input(void);
+
+static void *emulate(void *arg)
+{
+  (void) arg;
+  unsigned unstable_frames = 0;
+  while (!__atomic_load_n(&quit, __ATOMIC_ACQUIRE)) {
+    handle_input();
+    if (rewinding) {
+      /* Backspace is held: go back one frame at a time at 60 Hz. */
+      if (chip8_rewind_seek(history, c8, -1) && movie) {
+        chip8_movie_truncate(movie, c8);
+      }
+      struct timespec frame = { 0, 1000000000 / CHIP8_TIMER_HZ };
+      nanosleep(&frame, NULL);
+    } else {
+      /* One frame, paced to real time. */
+      chip8_sched_run(&sched, c8, chip8_run, UINT64_MAX);
+      chip8_rewind_record(history, c8);
+    }
+    /* Publish at most once per frame, however many times it was drawn to. */
+    if (c8->dirty_rows) {
+      if (stable_only && c8->erased && !rewinding
+          && unstable_frames++ < MAX_UNSTABLE_FRAMES) {
+        /* Wait for the erased sprites to be drawn again. */
+      } else {
+        chip8_frames_publish(frames, c8);
+        glfwPostEmptyEvent();
+        unstable_frames = 0;
+      }
+    }
+    if (report_profile) {
+      chip8_profile_report(profile, c8, stderr, PROFILE_TOP);
+      report_profile = 0;
+    }
+  }
+  return NULL;
+}
 
 int main(int argc, char **argv)
 {
-  if (argc != 2) {
-    errorf("Usage: %s <CHIP-8 ROM>\n", argv[0]);
-    exit(EXIT_FAILURE);
+  const char *movie_path = NULL;
+  enum chip8_mode mode = CHIP8_MODE_CHIP8;
+  const char *sound_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "sm:x:a:P")) != -1) {
+    switch (opt) {
+    case 's':
+      stable_only = true;
+      break;
+    case 'm':
+      movie_path = optarg;
+      break;
+    case 'x':
+      if (strcmp(optarg, "chip8") == 0) {
+        mode = CHIP8_MODE_CHIP8;
+      } else if (strcmp(optarg, "schip") == 0) {
+        mode = CHIP8_MODE_SCHIP;
+      } else if (strcmp(optarg, "xochip") == 0) {
+        mode = CHIP8_MODE_XOCHIP;
+      } else {
+        goto usage;
+      }
+      break;
+    case 'a':
+      sound_path = optarg;
+      break;
+    case 'P':
+      if (!chip8_profile_available()) {
+        errorf("Built without profiling, see make profile\n");
+        exit(EXIT_FAILURE);
+      }
+      profile = chip8_profile_new();
+      break;
+    default:
+      goto usage;
+    }
+  }
+  if (optind != argc - 1) {
+    goto usage;
   }
   if (!glfwInit()) {
     exit(EXIT_FAILURE);
@@ -74,28 +225,82 @@ int main(int argc, char **argv)
   resize_handler(window, width, height);
 
   c8 = chip8_init();
-  if (!c8 || !chip8_load_rom(c8, argv[1])) {
+  if (!c8 || !chip8_set_mode(c8, mode) || !chip8_load_rom(c8, argv[optind])) {
+    goto fail;
+  }
+
+  if (!gl_setup()) {
+    goto fail;
+  }
+  if (movie_path && !(movie = chip8_movie_new(c8))) {
+    goto fail;
+  }
+  struct chip8_audio_sink sink;
+  if (!sound_path) {
+    chip8_audio_bell_sink(&sink);
+  } else if (strcmp(sound_path, "null") == 0) {
+    chip8_audio_null_sink(&sink);
+  } else if (!chip8_audio_wav_sink(&sink, sound_path, CHIP8_AUDIO_RATE)) {
+    errorf("Could not create %s\n", sound_path);
+    goto fail;
+  }
+  chip8_audio *audio = chip8_audio_open(&sink, CHIP8_AUDIO_RATE);
+  if (!audio) {
     goto fail;
   }
+  chip8_audio_attach(c8, audio);
+  if (profile) {
+    struct sigaction sa = { .sa_handler = request_profile_report };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    chip8_profile_attach(c8, profile);
+  }
 
-  GLuint *vertex = gl_setup();
-  if (!vertex) {
+  history = chip8_rewind_init(REWIND_BYTES, REWIND_FRAMES);
+  if (!history || !(frames = chip8_frames_new())) {
     goto fail;
   }
+  chip8_rewind_record(history, c8);
+  chip8_sched_init(&sched, CHIP8_PACE_FIXED, 1);
 
-  glClearColor(.1, .1, .1, 0);
+  pthread_t emulation;
+  if (pthread_create(&emulation, NULL, emulate, NULL) != 0) {
+    goto fail;
+  }
+  /* Woken up by input and by the emulation thread publishing a frame. */
+  bool hires = false;
   while (!glfwWindowShouldClose(window)) {
-    chip8_emulate_cycle(c8, glfwWaitEvents);
-    if (c8->draw_flag) {
-      glClear(GL_COLOR_BUFFER_BIT);
-      size_t n = fill_vertices_to_draw(c8, vertex);
-      glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, n*sizeof(*vertex), vertex);
-      glDrawElements(GL_TRIANGLES, n, GL_UNSIGNED_INT, 0);
+    glfwWaitEvents();
+    const struct chip8_frame *frame = chip8_frames_acquire(frames);
+    if (frame) {
+      upload(frame);
+      hires = frame->hires;
+    }
+    if (frame || resized) {
+      draw(hires);
       glfwSwapBuffers(window);
+      resized = false;
     }
-    glfwPollEvents();
   }
+  __atomic_store_n(&quit, true, __ATOMIC_RELEASE);
+  pthread_join(emulation, NULL);
 
+  if (movie) {
+    if (!chip8_movie_save(movie, c8, movie_path)) {
+      errorf("Could not write %s\n", movie_path);
+    }
+    chip8_movie_free(movie);
+  }
+  if (profile) {
+    chip8_profile_report(profile, c8, stderr, PROFILE_TOP);
+    chip8_profile_free(profile);
+  }
+  chip8_audio_attach(c8, NULL);
+  if (!chip8_audio_close(audio)) {
+    errorf("Could not write %s\n", sound_path);
+  }
+  chip8_rewind_free(history);
+  chip8_frames_free(frames);
   chip8_destroy(c8);
   glfwTerminate();
   return 0;
@@ -103,36 +308,49 @@ int main(int argc, char **argv)
 fail:
   glfwTerminate();
   exit(EXIT_FAILURE);
+
+usage:
+  errorf("Usage: %s [-s] [-m movie] [-x mode] [-a sound] [-P]"
+         " <CHIP-8 ROM>\n"
+         "  -s        Present only stable frames, to remove sprite flicker\n"
+         "  -m movie  Record the key presses to a movie, written on exit\n"
+         "  -x mode   chip8 (default), schip or xochip\n"
+         "  -a sound  Write the sound to a WAV file, or null for none,\n"
+         "            instead of ringing the terminal bell\n"
+         "  -P        Profile the ROM, reporting on exit and on SIGUSR1\n",
+         argv[0]);
+  exit(EXIT_FAILURE);
 }
 
-static size_t fill_vertices_to_draw(chip8 *c8, GLuint *vertex)
+/* Uploads the dirty rows of each plane of a frame, 16 bytes each. */
+static void upload(const struct chip8_frame *frame)
 {
-  size_t h = DISPLAY_HEIGHT + 1;
-  size_t n = 0;
-  for (size_t x = 0; x < DISPLAY_WIDTH; ++x) {
-    for (size_t y = 0; y < DISPLAY_HEIGHT; ++y) {
-      if (c8->gfx[x][y] == 1) {
-        /* Corners of quad */
-        GLuint q1, q2, q3, q4;
-        q1 = x*h + y;
-        q2 = x*h + y + 1;
-        q3 = (x+1)*h + y;
-        q4 = (x+1)*h + y + 1;
-        vertex[n+0] = q1;
-        vertex[n+1] = q2;
-        vertex[n+2] = q3;
-        vertex[n+3] = q2;
-        vertex[n+4] = q3;
-        vertex[n+5] = q4;
-        n += 6;
-      }
+  static render_words words;
+  struct render_run runs[DISPLAY_HIRES_HEIGHT];
+  size_t height = frame->hires ? DISPLAY_HIRES_HEIGHT : DISPLAY_HEIGHT;
+  size_t nruns = render_pack_rows(frame->gfx, height, frame->dirty_rows,
+                                  words, runs);
+  /* One upload for each run of dirty rows in each plane */
+  for (size_t p = 0; p < DISPLAY_PLANES; ++p) {
+    for (size_t i = 0; i < nruns; ++i) {
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0,
+                      p * DISPLAY_HIRES_HEIGHT + runs[i].start, RENDER_WORDS,
+                      runs[i].count, GL_RED_INTEGER, GL_UNSIGNED_INT,
+                      words[p][runs[i].start]);
     }
   }
-  return n; /* Number of vertices */
 }
 
-static void
-key_handler(GLFWwindow *window, int key, int scancode, int action, int mods)
+/* Draws the frame last uploaded in the resolution it is in. */
+static void draw(bool hires)
+{
+  glUniform2i(size_uniform, hires ? DISPLAY_HIRES_WIDTH : DISPLAY_WIDTH,
+              hires ? DISPLAY_HIRES_HEIGHT : DISPLAY_HEIGHT);
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+/* Returns the keypad key for a keyboard key, or -1. */
+static int keypad_key(int key)
 {
   /*
    * Keypad         Keyboard
@@ -141,54 +359,86 @@ key_handler(GLFWwindow *window, int key, int scancode, int action, int mods)
    * |7|8|9|E|      |A|S|D|F|
    * |A|0|B|F|      |Z|X|C|V|
    */
-  switch (action) {
-  case GLFW_PRESS:
-    switch (key) {
-    case GLFW_KEY_1: c8->key[0x1] = true; break;
-    case GLFW_KEY_2: c8->key[0x2] = true; break;
-    case GLFW_KEY_3: c8->key[0x3] = true; break;
-    case GLFW_KEY_4: c8->key[0xC] = true; break;
-    case GLFW_KEY_Q: c8->key[0x4] = true; break;
-    case GLFW_KEY_W: c8->key[0x5] = true; break;
-    case GLFW_KEY_E: c8->key[0x6] = true; break;
-    case GLFW_KEY_R: c8->key[0xD] = true; break;
-    case GLFW_KEY_A: c8->key[0x7] = true; break;
-    case GLFW_KEY_S: c8->key[0x8] = true; break;
-    case GLFW_KEY_D: c8->key[0x9] = true; break;
-    case GLFW_KEY_F: c8->key[0xE] = true; break;
-    case GLFW_KEY_Z: c8->key[0xA] = true; break;
-    case GLFW_KEY_X: c8->key[0x0] = true; break;
-    case GLFW_KEY_C: c8->key[0xB] = true; break;
-    case GLFW_KEY_V: c8->key[0xF] = true; break;
-    case GLFW_KEY_ESCAPE: glfwSetWindowShouldClose(window, GL_TRUE); break;
+  switch (key) {
+  case GLFW_KEY_1: return 0x1;
+  case GLFW_KEY_2: return 0x2;
+  case GLFW_KEY_3: return 0x3;
+  case GLFW_KEY_4: return 0xC;
+  case GLFW_KEY_Q: return 0x4;
+  case GLFW_KEY_W: return 0x5;
+  case GLFW_KEY_E: return 0x6;
+  case GLFW_KEY_R: return 0xD;
+  case GLFW_KEY_A: return 0x7;
+  case GLFW_KEY_S: return 0x8;
+  case GLFW_KEY_D: return 0x9;
+  case GLFW_KEY_F: return 0xE;
+  case GLFW_KEY_Z: return 0xA;
+  case GLFW_KEY_X: return 0x0;
+  case GLFW_KEY_C: return 0xB;
+  case GLFW_KEY_V: return 0xF;
+  default: return -1;
+  }
+}
+
+static void
+key_handler(GLFWwindow *window, int key, int scancode, int action, int mods)
+{
+  if (action == GLFW_REPEAT) {
+    return;
+  }
+  bool pressed = action == GLFW_PRESS;
+  if (key == GLFW_KEY_ESCAPE) {
+    if (pressed) {
+      glfwSetWindowShouldClose(window, GL_TRUE);
     }
-    break;
-  case GLFW_RELEASE:
-    switch (key) {
-    case GLFW_KEY_1: c8->key[0x1] = false; break;
-    case GLFW_KEY_2: c8->key[0x2] = false; break;
-    case GLFW_KEY_3: c8->key[0x3] = false; break;
-    case GLFW_KEY_4: c8->key[0xC] = false; break;
-    case GLFW_KEY_Q: c8->key[0x4] = false; break;
-    case GLFW_KEY_W: c8->key[0x5] = false; break;
-    case GLFW_KEY_E: c8->key[0x6] = false; break;
-    case GLFW_KEY_R: c8->key[0xD] = false; break;
-    case GLFW_KEY_A: c8->key[0x7] = false; break;
-    case GLFW_KEY_S: c8->key[0x8] = false; break;
-    case GLFW_KEY_D: c8->key[0x9] = false; break;
-    case GLFW_KEY_F: c8->key[0xE] = false; break;
-    case GLFW_KEY_Z: c8->key[0xA] = false; break;
-    case GLFW_KEY_X: c8->key[0x0] = false; break;
-    case GLFW_KEY_C: c8->key[0xB] = false; break;
-    case GLFW_KEY_V: c8->key[0xF] = false; break;
+    return;
+  }
+  unsigned tail = __atomic_load_n(&input.tail, __ATOMIC_ACQUIRE);
+  if (input.head - tail == INPUT_QUEUE_SIZE) {
+    return;
+  }
+  input.events[input.head % INPUT_QUEUE_SIZE] =
+    (struct key_input) { key, pressed };
+  __atomic_store_n(&input.head, input.head + 1, __ATOMIC_RELEASE);
+}
+
+/* Applies the keys pressed and released since last called, on the
+   emulation thread. */
+static void handle_input(void)
+{
+  unsigned head = __atomic_load_n(&input.head, __ATOMIC_ACQUIRE);
+  for (unsigned tail = input.tail; tail != head; ++tail) {
+    struct key_input e = input.events[tail % INPUT_QUEUE_SIZE];
+    int k = keypad_key(e.key);
+    if (k >= 0) {
+      /* Resumes the machine if it is waiting for a key press. */
+      if (movie) {
+        chip8_movie_key(movie, c8, k, e.pressed);
+      }
+      chip8_key_event(c8, k, e.pressed);
+      continue;
+    }
+    switch (e.key) {
+    case GLFW_KEY_BACKSPACE:
+      rewinding = e.pressed;
+      break;
+    case GLFW_KEY_TAB:
+      if (e.pressed) {
+        chip8_sched_init(&sched, CHIP8_PACE_FAST_FORWARD,
+                         FAST_FORWARD_FACTOR);
+      } else {
+        chip8_sched_init(&sched, CHIP8_PACE_FIXED, 1);
+      }
+      break;
     }
-    break;
   }
+  __atomic_store_n(&input.tail, head, __ATOMIC_RELEASE);
 }
 
 static void resize_handler(GLFWwindow *window, GLsizei w, GLsizei h)
 {
   glViewport(0, 0, w, h);
+  resized = true;
 }
 
 static bool shader_error_occurred(GLuint shader)
@@ -211,77 +461,36 @@ static bool shader_error_occurred(GLuint shader)
   return false;
 }
 
-static GLuint *gl_setup(void)
+static bool gl_setup(void)
 {
   GLenum err = glewInit();
   if (err != GLEW_OK) {
     errorf("GLEW error: %s\n", glewGetErrorString(err));
-    return NULL;
+    return false;
   }
 
+  /* The quad corners come from gl_VertexID, so there are no vertex buffers,
+     but the core profile still needs a vertex array bound to draw. */
   GLuint vao;
   glGenVertexArrays(1, &vao);
   glBindVertexArray(vao);
 
-  /*
-   * Generate quad vertices.
-   *
-   * See the display pictured below. The vertices are numbered starting
-   * from the top left and going down, proceeding right after the last row is
-   * reached. The vertex at position (x,y) is numbered 33*x+y:
-   *   - (0,0) is vertex 0
-   *   - (0,1) is vertex 1
-   *   - (1,0) is vertex 33
-   *   - etc.
-   *
-   * The numbering is chosen to match the layout of chip8.gfx.
-   *
-   *      x  0 1     ...      64
-   *      --->
-   *  y |
-   *    |  +---------------------+
-   *  0 v  | . . . . . . . . . . |
-   *  1    | . . . . . . . . . . |
-   * ...   | . . . . . . . . . . |
-   * 32    | . . . . . . . . . . |
-   *       +---------------------+
-   */
-  size_t w = DISPLAY_WIDTH + 1;
-  size_t h = DISPLAY_HEIGHT + 1;
-  size_t ncoords = w * h * 2; /* 2 coordinates for each vertex */
-  size_t half_width = DISPLAY_WIDTH / 2;
-  size_t half_height = DISPLAY_HEIGHT / 2;
-  GLfloat *coords = emalloc(ncoords * sizeof(*coords));
-  for (size_t x = 0; x < w; ++x) {
-    for (size_t y = 0; y < h; ++y) {
-      size_t i = 2 * (x*h + y);
-      coords[i] = -1 + ((GLfloat) x)/half_width;
-      coords[i+1] = 1 - ((GLfloat) y)/half_height;
-    }
-  }
-
-  GLuint vbo;
-  glGenBuffers(1, &vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, vbo);
-  glBufferStorage(GL_ARRAY_BUFFER, ncoords*sizeof(*coords), coords, 0);
-  free(coords);
-
-  /* 65*33 quads, each quad needs 6 vertices */
-  size_t nv = w * h * 6;
-  GLuint *vertex = emalloc(nv*sizeof(*vertex));
-
-  GLuint ebo;
-  glGenBuffers(1, &ebo);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-  glBufferData(
-    GL_ELEMENT_ARRAY_BUFFER, nv*sizeof(*vertex), vertex, GL_DYNAMIC_DRAW);
+  /* Each texel holds 32 pixels of a row, the leftmost in the MSB. */
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, RENDER_WORDS,
+               DISPLAY_PLANES * DISPLAY_HIRES_HEIGHT, 0, GL_RED_INTEGER,
+               GL_UNSIGNED_INT, NULL);
 
   GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
   glShaderSource(vertex_shader, 1, &vertex_shader_glsl, NULL);
   glCompileShader(vertex_shader);
 
   if (shader_error_occurred(vertex_shader)) {
-    return NULL;
+    return false;
   }
 
   GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
@@ -289,7 +498,7 @@ static GLuint *gl_setup(void)
   glCompileShader(fragment_shader);
 
   if (shader_error_occurred(fragment_shader)) {
-    return NULL;
+    return false;
   }
 
   GLuint program = glCreateProgram();
@@ -312,20 +521,17 @@ static GLuint *gl_setup(void)
     } else {
       errorf("Program link error\n");
     }
-    return NULL;
+    return false;
   }
 
-  glEnableVertexAttribArray(0);
-  glBindBuffer(GL_ARRAY_BUFFER, vbo);
-  glVertexAttribPointer(0, 2, GL_FLOAT, false, 0, 0);
-
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+  glUniform1i(glGetUniformLocation(program, "gfx"), 0);
+  size_uniform = glGetUniformLocation(program, "size");
 
   err = glGetError();
   if (err != GL_NO_ERROR) {
     errorf("GL error: 0x%x\n", err);
-    return NULL;
+    return false;
   }
 
-  return vertex;
+  return true;
 }
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8_internal.h"
+#include "movie.h"
+
+#define MOVIE_MAGIC "C8MV"
+#define MOVIE_VERSION 2
+
+struct event {
+  uint64_t cycle;
+  uint8_t key;
+  bool pressed;
+};
+
+struct chip8_movie {
+  uint8_t mode;
+  uint32_t cycles_per_tick;
+  uint64_t rng;
+  uint64_t memory_hash;
+  struct event *events;  /* Sorted by cycle */
+  size_t nevents, capacity;
+  size_t next;           /* Next event to play */
+};
+
+/* FNV-1a */
+static uint64_t memory_hash(const chip8 *c8)
+{
+  uint64_t h = 0xCBF29CE484222325ULL;
+  for (size_t i = 0; i < chip8_memory_size(c8); ++i) {
+    h = (h ^ c8->memory[i]) * 0x100000001B3ULL;
+  }
+  return h;
+}
+
+chip8_movie *chip8_movie_new(const chip8 *c8)
+{
+  chip8_movie *m = calloc(1, sizeof(*m));
+  if (!m) {
+    return NULL;
+  }
+  m->mode = c8->mode;
+  m->cycles_per_tick = c8->cycles_per_tick;
+  m->rng = c8->rng;
+  m->memory_hash = memory_hash(c8);
+  return m;
+}
+
+void chip8_movie_free(chip8_movie *m)
+{
+  free(m->events);
+  free(m);
+}
+
+static bool add(chip8_movie *m, uint64_t cycle, uint8_t key, bool pressed)
+{
+  if (m->nevents == m->capacity) {
+    size_t capacity = m->capacity ? 2 * m->capacity : 256;
+    struct event *events = realloc(m->events, capacity * sizeof(*events));
+    if (!events) {
+      return false;
+    }
+    m->events = events;
+    m->capacity = capacity;
+  }
+  m->events[m->nevents++] = (struct event) { cycle, key & 0xF, pressed };
+  return true;
+}
+
+bool chip8_movie_truncate(chip8_movie *m, const chip8 *c8)
+{
+  size_t n = m->nevents;
+  while (n > 0 && m->events[n-1].cycle > c8->cycles) {
+    --n;
+  }
+  if (n == m->nevents) {
+    return true;
+  }
+  m->nevents = n;
+  bool key[0x10] = {false};
+  for (size_t i = 0; i < n; ++i) {
+    key[m->events[i].key] = m->events[i].pressed;
+  }
+  for (uint8_t k = 0; k < 0x10; ++k) {
+    if (key[k] != c8->key[k] && !add(m, c8->cycles, k, c8->key[k])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool chip8_movie_key(chip8_movie *m, const chip8 *c8, uint8_t key,
+                     bool pressed)
+{
+  return chip8_movie_truncate(m, c8) && add(m, c8->cycles, key, pressed);
+}
+
+static void put_le(FILE *f, uint64_t v, size_t nbytes)
+{
+  for (size_t i = 0; i < nbytes; ++i) {
+    fputc((v >> (8 * i)) & 0xFF, f);
+  }
+}
+
+static bool get_le(FILE *f, uint64_t *v, size_t nbytes)
+{
+  *v = 0;
+  for (size_t i = 0; i < nbytes; ++i) {
+    int c = fgetc(f);
+    if (c == EOF) {
+      return false;
+    }
+    *v |= (uint64_t) c << (8 * i);
+  }
+  return true;
+}
+
+static void put_varint(FILE *f, uint64_t v)
+{
+  while (v >= 0x80) {
+    fputc((v & 0x7F) | 0x80, f);
+    v >>= 7;
+  }
+  fputc(v, f);
+}
+
+static bool get_varint(FILE *f, uint64_t *v)
+{
+  *v = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    int c = fgetc(f);
+    if (c == EOF) {
+      return false;
+    }
+    *v |= (uint64_t) (c & 0x7F) << shift;
+    if (!(c & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool chip8_movie_save(chip8_movie *m, const chip8 *c8, const char *path)
+{
+  if (!chip8_movie_truncate(m, c8)) {
+    return false;
+  }
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    return false;
+  }
+  fputs(MOVIE_MAGIC, f);
+  fputc(MOVIE_VERSION, f);
+  fputc(m->mode, f);
+  put_le(f, m->cycles_per_tick, 4);
+  put_le(f, m->rng, 8);
+  put_le(f, m->memory_hash, 8);
+  put_varint(f, m->nevents);
+  uint64_t cycle = 0;
+  for (size_t i = 0; i < m->nevents; ++i) {
+    const struct event *e = &m->events[i];
+    put_varint(f, e->cycle - cycle);
+    fputc(e->key | (e->pressed ? 0x80 : 0), f);
+    cycle = e->cycle;
+  }
+  bool ok = !ferror(f);
+  return fclose(f) == 0 && ok;
+}
+
+chip8_movie *chip8_movie_load(const char *path)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+  chip8_movie *m = calloc(1, sizeof(*m));
+  char magic[sizeof(MOVIE_MAGIC) - 1];
+  uint64_t cycles_per_tick, nevents;
+  int version, mode = CHIP8_MODE_CHIP8;
+  if (!m || fread(magic, sizeof(magic), 1, f) != 1
+      || memcmp(magic, MOVIE_MAGIC, sizeof(magic)) != 0
+      || (version = fgetc(f)) < 1 || version > MOVIE_VERSION
+      /* Version 1 movies were all recorded in CHIP-8 mode. */
+      || (version >= 2 && (mode = fgetc(f)) > CHIP8_MODE_XOCHIP)
+      || mode < 0
+      || !get_le(f, &cycles_per_tick, 4) || cycles_per_tick == 0
+      || !get_le(f, &m->rng, 8) || m->rng == 0
+      || !get_le(f, &m->memory_hash, 8)
+      || !get_varint(f, &nevents)) {
+    goto fail;
+  }
+  m->mode = mode;
+  m->cycles_per_tick = cycles_per_tick;
+
+  uint64_t cycle = 0;
+  for (uint64_t i = 0; i < nevents; ++i) {
+    uint64_t delta;
+    int c;
+    if (!get_varint(f, &delta) || (c = fgetc(f)) == EOF
+        || !add(m, cycle += delta, c & 0xF, c & 0x80)) {
+      goto fail;
+    }
+  }
+  fclose(f);
+  return m;
+
+fail:
+  if (m) {
+    chip8_movie_free(m);
+  }
+  fclose(f);
+  return NULL;
+}
+
+bool chip8_movie_start(chip8_movie *m, chip8 *c8)
+{
+  if (c8->mode != m->mode || memory_hash(c8) != m->memory_hash) {
+    return false;
+  }
+  c8->cycles_per_tick = m->cycles_per_tick;
+  c8->tick_cycles = 0;
+  c8->rng = m->rng;
+  m->next = 0;
+  return true;
+}
+
+uint64_t chip8_movie_apply(chip8_movie *m, chip8 *c8)
+{
+  while (m->next < m->nevents && m->events[m->next].cycle <= c8->cycles) {
+    const struct event *e = &m->events[m->next++];
+    chip8_key_event(c8, e->key, e->pressed);
+  }
+  if (m->next == m->nevents) {
+    return UINT64_MAX;
+  }
+  return m->events[m->next].cycle - c8->cycles;
+}
+
+bool chip8_movie_play(chip8_movie *m, chip8 *c8, chip8_run_fun run,
+                      uint64_t ncycles)
+{
+  while (c8->cycles < ncycles) {
+    uint64_t n = ncycles - c8->cycles;
+    uint64_t until = chip8_movie_apply(m, c8);
+    if (until < n) {
+      n = until;
+    }
+    uint64_t executed = run(c8, n);
+    if (c8->halted) {
+      if (m->next == m->nevents) {
+        return false;
+      }
+      chip8_idle(c8, n - executed);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,54 @@
+#ifndef CHIP8_MOVIE_H
+#define CHIP8_MOVIE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/* A recording of the key presses and releases of a run, each stamped with
+   the number of instructions executed before it. Together with the ROM, the
+   CPU rate and the seed of the random numbers, which the movie holds, the
+   key events determine the whole run, so playing a movie back repeats it
+   exactly.
+
+   The file starts with the magic "C8MV", a version byte and a byte holding
+   the enum chip8_mode, followed by the instructions per timer tick (32
+   bits), the random state and a hash of the initial memory (64 bits each),
+   all little endian, and a varint number of events. Each event is a varint
+   of the instructions since the event before and a byte holding the key in
+   the low nibble and whether it was pressed in the top bit. Version 1 files
+   have no mode byte and are played in CHIP-8 mode. */
+typedef struct chip8_movie chip8_movie;
+
+/* Starts a recording of a machine that has just loaded its ROM. */
+chip8_movie *chip8_movie_new(const chip8 *);
+void chip8_movie_free(chip8_movie *);
+/* Records a key event at the current instruction of the machine. Returns
+   false if out of memory. */
+bool chip8_movie_key(chip8_movie *, const chip8 *, uint8_t key, bool pressed);
+/* To be called after rewinding the machine: drops the events after its
+   current instruction, and records the keys it holds differently than the
+   events left have them, as key state is not rewound. Returns false if out
+   of memory. */
+bool chip8_movie_truncate(chip8_movie *, const chip8 *);
+/* Writes the movie up to the current instruction of the machine. */
+bool chip8_movie_save(chip8_movie *, const chip8 *, const char *path);
+
+/* Reads a movie, returning NULL if it could not be read. */
+chip8_movie *chip8_movie_load(const char *path);
+/* Sets the CPU rate and the random state of a machine that has just loaded
+   its ROM, and rewinds playback to the first event. Returns false if the
+   machine is not in the mode or does not start from the memory the movie was
+   recorded from. */
+bool chip8_movie_start(chip8_movie *, chip8 *);
+/* Applies the events due at the current instruction of the machine, and
+   returns the number of instructions until the next one, or UINT64_MAX if
+   none are left. */
+uint64_t chip8_movie_apply(chip8_movie *, chip8 *);
+/* Plays the movie on a started machine up to the given number of
+   instructions, letting time pass while it is halted until the next key
+   event. Returns false if it stopped halted with no events left. */
+bool chip8_movie_play(chip8_movie *, chip8 *, chip8_run_fun, uint64_t ncycles);
+
+#endif
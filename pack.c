@@ -0,0 +1,224 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pack.h"
+
+#define PACK_MAGIC "C8PK"
+#define PACK_VERSION 1
+#define HEADER_SIZE 12
+#define ENTRY_SIZE 16
+/* ROMs are loaded at 0x200, up to the end of XO-CHIP memory. */
+#define MAX_ROM_SIZE (XOCHIP_MEMORY_SIZE - 0x200)
+
+struct chip8_pack {
+  const uint8_t *map;
+  size_t size;
+  size_t count;
+};
+
+/* FNV-1a */
+uint64_t chip8_rom_hash(const uint8_t *data, size_t size)
+{
+  uint64_t h = 0xCBF29CE484222325ULL;
+  for (size_t i = 0; i < size; ++i) {
+    h = (h ^ data[i]) * 0x100000001B3ULL;
+  }
+  return h;
+}
+
+static uint64_t get_le(const uint8_t *p, int nbytes)
+{
+  uint64_t v = 0;
+  for (int i = nbytes - 1; i >= 0; --i) {
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+static void put_le(FILE *f, uint64_t v, int nbytes)
+{
+  for (int i = 0; i < nbytes; ++i) {
+    fputc((v >> (8 * i)) & 0xFF, f);
+  }
+}
+
+/* A ROM being packed, with its hash. */
+struct packed {
+  uint64_t hash;
+  const struct chip8_pack_rom *rom;
+};
+
+static int by_hash(const void *a, const void *b)
+{
+  uint64_t ha = ((const struct packed *) a)->hash;
+  uint64_t hb = ((const struct packed *) b)->hash;
+  return ha < hb ? -1 : ha > hb;
+}
+
+bool chip8_pack_write(const char *path, const struct chip8_pack_rom *roms,
+                      size_t n)
+{
+  struct packed *packed = malloc((n ? n : 1) * sizeof(*packed));
+  if (!packed) {
+    return false;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    if (roms[i].size > MAX_ROM_SIZE) {
+      free(packed);
+      return false;
+    }
+    packed[i].hash = chip8_rom_hash(roms[i].data, roms[i].size);
+    packed[i].rom = &roms[i];
+  }
+  qsort(packed, n, sizeof(*packed), by_hash);
+
+  /* Keep the first of each run of identical ROMs. Different ROMs with the
+     same hash cannot both be indexed. */
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (count > 0 && packed[count - 1].hash == packed[i].hash) {
+      const struct chip8_pack_rom *a = packed[count - 1].rom;
+      const struct chip8_pack_rom *b = packed[i].rom;
+      if (a->size != b->size || memcmp(a->data, b->data, a->size) != 0) {
+        free(packed);
+        return false;
+      }
+      continue;
+    }
+    packed[count++] = packed[i];
+  }
+  uint64_t end = HEADER_SIZE + ENTRY_SIZE * (uint64_t) count;
+  for (size_t i = 0; i < count; ++i) {
+    end += packed[i].rom->size;
+  }
+
+  FILE *f = end <= UINT32_MAX ? fopen(path, "wb") : NULL;
+  if (!f) {
+    free(packed);
+    return false;
+  }
+  fputs(PACK_MAGIC, f);
+  put_le(f, PACK_VERSION, 4);
+  put_le(f, count, 4);
+  uint64_t offset = HEADER_SIZE + ENTRY_SIZE * (uint64_t) count;
+  for (size_t i = 0; i < count; ++i) {
+    put_le(f, packed[i].hash, 8);
+    put_le(f, offset, 4);
+    put_le(f, packed[i].rom->size, 4);
+    offset += packed[i].rom->size;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    fwrite(packed[i].rom->data, 1, packed[i].rom->size, f);
+  }
+  free(packed);
+  bool ok = !ferror(f);
+  return fclose(f) == 0 && ok;
+}
+
+/* Checks that every ROM lies within the file and that the index is sorted,
+   so that entries can be used without further checks. */
+static bool valid(const chip8_pack *pack)
+{
+  if (pack->size < HEADER_SIZE
+      || memcmp(pack->map, PACK_MAGIC, 4) != 0
+      || get_le(pack->map + 4, 4) != PACK_VERSION
+      || (pack->size - HEADER_SIZE) / ENTRY_SIZE < pack->count) {
+    return false;
+  }
+  for (size_t i = 0; i < pack->count; ++i) {
+    struct chip8_pack_entry e;
+    chip8_pack_entry(pack, i, &e);
+    if (e.offset > pack->size || e.length > pack->size - e.offset
+        || e.length > MAX_ROM_SIZE) {
+      return false;
+    }
+    if (i > 0 && get_le(pack->map + HEADER_SIZE + ENTRY_SIZE * (i - 1), 8)
+                 >= e.hash) {
+      return false;
+    }
+  }
+  return true;
+}
+
+chip8_pack *chip8_pack_open(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  chip8_pack *pack = malloc(sizeof(*pack));
+  if (!pack || fstat(fd, &st) != 0 || st.st_size < HEADER_SIZE) {
+    free(pack);
+    close(fd);
+    return NULL;
+  }
+  pack->size = st.st_size;
+  void *map = mmap(NULL, pack->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  /* The mapping outlives the descriptor. */
+  close(fd);
+  if (map == MAP_FAILED) {
+    free(pack);
+    return NULL;
+  }
+  pack->map = map;
+  pack->count = get_le(pack->map + 8, 4);
+  if (!valid(pack)) {
+    chip8_pack_close(pack);
+    return NULL;
+  }
+  return pack;
+}
+
+void chip8_pack_close(chip8_pack *pack)
+{
+  munmap((void *) pack->map, pack->size);
+  free(pack);
+}
+
+size_t chip8_pack_count(const chip8_pack *pack)
+{
+  return pack->count;
+}
+
+void chip8_pack_entry(const chip8_pack *pack, size_t i,
+                      struct chip8_pack_entry *e)
+{
+  const uint8_t *p = pack->map + HEADER_SIZE + ENTRY_SIZE * i;
+  e->hash = get_le(p, 8);
+  e->offset = get_le(p + 8, 4);
+  e->length = get_le(p + 12, 4);
+}
+
+size_t chip8_pack_find(const chip8_pack *pack, uint64_t hash)
+{
+  size_t lo = 0;
+  size_t hi = pack->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    uint64_t h = get_le(pack->map + HEADER_SIZE + ENTRY_SIZE * mid, 8);
+    if (h == hash) {
+      return mid;
+    }
+    if (h < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return CHIP8_PACK_NONE;
+}
+
+bool chip8_load_rom_from_pack(chip8 *c8, const chip8_pack *pack, size_t i)
+{
+  struct chip8_pack_entry e;
+  chip8_pack_entry(pack, i, &e);
+  return chip8_load_rom_data(c8, pack->map + e.offset, e.length);
+}
@@ -0,0 +1,61 @@
+#ifndef CHIP8_PACK_H
+#define CHIP8_PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/* A ROM pack: many ROMs in one file, mapped into memory once, so that batch
+   runs load each ROM with a single copy from the mapping into the machine.
+
+   The file starts with the magic "C8PK", a 32-bit version and a 32-bit
+   number of ROMs, followed by the index and then the ROM data. Each index
+   entry is the hash of a ROM (64 bits), the offset of its data from the
+   start of the file and its length (32 bits each). Entries are sorted by
+   hash and ROMs are stored once, however many times they were packed. All
+   numbers are little endian. */
+typedef struct chip8_pack chip8_pack;
+
+struct chip8_pack_entry {
+  uint64_t hash;
+  uint32_t offset;
+  uint32_t length;
+};
+
+/* Returned by chip8_pack_find for a hash not in the pack. */
+#define CHIP8_PACK_NONE SIZE_MAX
+
+/* The hash identifying a ROM in packs: 64-bit FNV-1a of its bytes. */
+uint64_t chip8_rom_hash(const uint8_t *, size_t);
+
+/* A ROM to be packed. */
+struct chip8_pack_rom {
+  const uint8_t *data;
+  size_t size;
+};
+
+/* Writes a pack holding the given ROMs, storing identical ones once.
+   Returns false if a ROM is too big for XO-CHIP memory or the file could
+   not be written. */
+bool chip8_pack_write(const char *path, const struct chip8_pack_rom *,
+                      size_t n);
+
+/* Maps a pack read-only. Returns NULL if it could not be mapped or is not a
+   valid pack. */
+chip8_pack *chip8_pack_open(const char *path);
+void chip8_pack_close(chip8_pack *);
+/* Number of distinct ROMs in the pack. */
+size_t chip8_pack_count(const chip8_pack *);
+/* Reads entry i of the index, i being less than chip8_pack_count. */
+void chip8_pack_entry(const chip8_pack *, size_t i,
+                      struct chip8_pack_entry *);
+/* Returns the index of the ROM with the given hash, or CHIP8_PACK_NONE. */
+size_t chip8_pack_find(const chip8_pack *, uint64_t hash);
+
+/* Loads ROM i of the pack, copying it from the mapping into the memory of
+   the machine. Returns false if it is too big for the mode of the machine. */
+bool chip8_load_rom_from_pack(chip8 *, const chip8_pack *, size_t i);
+
+#endif
@@ -0,0 +1,127 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pack.h"
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s -o pack <CHIP-8 ROM>...\n"
+    "       %s -l pack\n"
+    "  -o pack  Write the ROMs to a pack, storing identical ones once, and\n"
+    "           print the hash of each\n"
+    "  -l pack  List the hash, offset and length of each ROM in a pack\n",
+    prog, prog);
+  exit(EXIT_FAILURE);
+}
+
+/* Reads a whole ROM into memory, or returns NULL. */
+static uint8_t *read_rom(const char *path, size_t *size)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+  size_t capacity = 0x1000;
+  uint8_t *data = malloc(capacity);
+  *size = 0;
+  while (data) {
+    *size += fread(data + *size, 1, capacity - *size, f);
+    if (*size < capacity) {
+      break;
+    }
+    uint8_t *bigger = realloc(data, 2 * capacity);
+    if (!bigger) {
+      free(data);
+    }
+    data = bigger;
+    capacity *= 2;
+  }
+  if (data && ferror(f)) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  return data;
+}
+
+static int create(const char *path, char **roms, size_t n)
+{
+  struct chip8_pack_rom *packed = calloc(n ? n : 1, sizeof(*packed));
+  int status = EXIT_FAILURE;
+  if (!packed) {
+    fprintf(stderr, "out of memory\n");
+    return status;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    uint8_t *data = read_rom(roms[i], &packed[i].size);
+    if (!data) {
+      fprintf(stderr, "%s: could not read ROM\n", roms[i]);
+      goto done;
+    }
+    packed[i].data = data;
+    printf("%016" PRIx64 " %s\n",
+           chip8_rom_hash(packed[i].data, packed[i].size), roms[i]);
+  }
+  if (!chip8_pack_write(path, packed, n)) {
+    fprintf(stderr, "%s: could not write pack\n", path);
+    goto done;
+  }
+  status = EXIT_SUCCESS;
+
+done:
+  for (size_t i = 0; i < n; ++i) {
+    free((void *) packed[i].data);
+  }
+  free(packed);
+  return status;
+}
+
+static int list(const char *path)
+{
+  chip8_pack *pack = chip8_pack_open(path);
+  if (!pack) {
+    fprintf(stderr, "%s: could not open pack\n", path);
+    return EXIT_FAILURE;
+  }
+  for (size_t i = 0; i < chip8_pack_count(pack); ++i) {
+    struct chip8_pack_entry e;
+    chip8_pack_entry(pack, i, &e);
+    printf("%016" PRIx64 " %" PRIu32 " %" PRIu32 "\n",
+           e.hash, e.offset, e.length);
+  }
+  chip8_pack_close(pack);
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+  const char *output = NULL;
+  const char *input = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "o:l:")) != -1) {
+    switch (opt) {
+    case 'o':
+      output = optarg;
+      break;
+    case 'l':
+      input = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (output && !input) {
+    return create(output, &argv[optind], argc - optind);
+  }
+  if (input && !output && optind == argc) {
+    return list(input);
+  }
+  usage(argv[0]);
+}
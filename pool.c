@@ -0,0 +1,66 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "chip8.h"
+#include "chip8_internal.h"
+
+struct chip8_pool {
+  size_t n;
+  chip8 *machines;
+};
+
+/* The registers of each machine start a cache line, the rest follow in the
+   lines after, up to the next machine. */
+typedef char chip8_hot_line_fits[
+  offsetof(chip8, skip_idle) < CHIP8_CACHE_LINE ? 1 : -1];
+typedef char chip8_lines_whole[sizeof(chip8) % CHIP8_CACHE_LINE ? -1 : 1];
+
+struct chip8_pool *chip8_pool_new(size_t n)
+{
+  struct chip8_pool *pool = malloc(sizeof(*pool));
+  void *machines = NULL;
+  if (!pool || n > SIZE_MAX / sizeof(chip8)
+      || posix_memalign(&machines, CHIP8_CACHE_LINE,
+                        (n ? n : 1) * sizeof(chip8)) != 0) {
+    free(pool);
+    return NULL;
+  }
+  pool->n = 0;
+  pool->machines = machines;
+  for (; pool->n < n; ++pool->n) {
+    if (!chip8_init_at(&pool->machines[pool->n])) {
+      chip8_pool_free(pool);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+void chip8_pool_free(struct chip8_pool *pool)
+{
+  for (size_t i = 0; i < pool->n; ++i) {
+    chip8_release(&pool->machines[i]);
+  }
+  free(pool->machines);
+  free(pool);
+}
+
+size_t chip8_pool_size(const struct chip8_pool *pool)
+{
+  return pool->n;
+}
+
+chip8 *chip8_pool_get(struct chip8_pool *pool, size_t i)
+{
+  return &pool->machines[i];
+}
+
+void chip8_pool_reset(struct chip8_pool *pool)
+{
+  for (size_t i = 0; i < pool->n; ++i) {
+    chip8_reset(&pool->machines[i]);
+  }
+}
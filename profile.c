@@ -0,0 +1,221 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "chip8_internal.h"
+#include "profile.h"
+
+#define NS_PER_SEC 1000000000L
+
+static const char *const op_names[OP_COUNT] = {
+#define OPCODE_NAME(name) #name,
+  CHIP8_OPCODES(OPCODE_NAME)
+#undef OPCODE_NAME
+};
+
+bool chip8_profile_available(void)
+{
+#ifdef CHIP8_PROFILE
+  return true;
+#else
+  return false;
+#endif
+}
+
+struct chip8_profile *chip8_profile_new(void)
+{
+  return calloc(1, sizeof(struct chip8_profile));
+}
+
+void chip8_profile_free(struct chip8_profile *p)
+{
+  free(p);
+}
+
+void chip8_profile_attach(chip8 *c8, struct chip8_profile *p)
+{
+  c8->profile = p;
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* Adds the time since the last update to the current frame. */
+static void profile_update(struct chip8_profile *p)
+{
+  uint64_t now = now_ns();
+  p->run_ns += now - p->stamp;
+  p->frame_ns += now - p->stamp;
+  p->stamp = now;
+}
+
+void chip8_profile_enter(struct chip8_profile *p)
+{
+  p->stamp = now_ns();
+}
+
+void chip8_profile_leave(struct chip8_profile *p)
+{
+  profile_update(p);
+}
+
+void chip8_profile_tick(struct chip8_profile *p)
+{
+  profile_update(p);
+  unsigned bucket = 0;
+  for (uint64_t ns = p->frame_ns; ns > 1; ns >>= 1) {
+    ++bucket;
+  }
+  ++p->frame_hist[bucket];
+  ++p->frames;
+  if (p->frame_ns > p->max_frame_ns) {
+    p->max_frame_ns = p->frame_ns;
+  }
+  p->frame_ns = 0;
+}
+
+int chip8_disassemble(opcode op, char *out, size_t size)
+{
+  struct chip8_uop u;
+  chip8_decode_op(op, &u);
+  switch (u.op) {
+  case OP_00E0: return snprintf(out, size, "CLS");
+  case OP_00EE: return snprintf(out, size, "RET");
+  case OP_1NNN: return snprintf(out, size, "JP %03X", u.NNN);
+  case OP_2NNN: return snprintf(out, size, "CALL %03X", u.NNN);
+  case OP_3XNN: return snprintf(out, size, "SE V%X, %02X", u.X, u.NN);
+  case OP_4XNN: return snprintf(out, size, "SNE V%X, %02X", u.X, u.NN);
+  case OP_5XY0: return snprintf(out, size, "SE V%X, V%X", u.X, u.Y);
+  case OP_6XNN: return snprintf(out, size, "LD V%X, %02X", u.X, u.NN);
+  case OP_7XNN: return snprintf(out, size, "ADD V%X, %02X", u.X, u.NN);
+  case OP_8XY0: return snprintf(out, size, "LD V%X, V%X", u.X, u.Y);
+  case OP_8XY1: return snprintf(out, size, "OR V%X, V%X", u.X, u.Y);
+  case OP_8XY2: return snprintf(out, size, "AND V%X, V%X", u.X, u.Y);
+  case OP_8XY3: return snprintf(out, size, "XOR V%X, V%X", u.X, u.Y);
+  case OP_8XY4: return snprintf(out, size, "ADD V%X, V%X", u.X, u.Y);
+  case OP_8XY5: return snprintf(out, size, "SUB V%X, V%X", u.X, u.Y);
+  case OP_8XY6: return snprintf(out, size, "SHR V%X", u.X);
+  case OP_8XY7: return snprintf(out, size, "SUBN V%X, V%X", u.X, u.Y);
+  case OP_8XYE: return snprintf(out, size, "SHL V%X", u.X);
+  case OP_9XY0: return snprintf(out, size, "SNE V%X, V%X", u.X, u.Y);
+  case OP_ANNN: return snprintf(out, size, "LD I, %03X", u.NNN);
+  case OP_BNNN: return snprintf(out, size, "JP V0, %03X", u.NNN);
+  case OP_CXNN: return snprintf(out, size, "RND V%X, %02X", u.X, u.NN);
+  case OP_DXYN:
+    return snprintf(out, size, "DRW V%X, V%X, %X", u.X, u.Y, u.N);
+  case OP_EX9E: return snprintf(out, size, "SKP V%X", u.X);
+  case OP_EXA1: return snprintf(out, size, "SKNP V%X", u.X);
+  case OP_FX07: return snprintf(out, size, "LD V%X, DT", u.X);
+  case OP_FX0A: return snprintf(out, size, "LD V%X, K", u.X);
+  case OP_FX15: return snprintf(out, size, "LD DT, V%X", u.X);
+  case OP_FX18: return snprintf(out, size, "LD ST, V%X", u.X);
+  case OP_FX1E: return snprintf(out, size, "ADD I, V%X", u.X);
+  case OP_FX29: return snprintf(out, size, "LD F, V%X", u.X);
+  case OP_FX33: return snprintf(out, size, "LD B, V%X", u.X);
+  case OP_FX55: return snprintf(out, size, "LD [I], V%X", u.X);
+  case OP_FX65: return snprintf(out, size, "LD V%X, [I]", u.X);
+  case OP_00CN: return snprintf(out, size, "SCD %X", u.N);
+  case OP_00FB: return snprintf(out, size, "SCR");
+  case OP_00FC: return snprintf(out, size, "SCL");
+  case OP_00FD: return snprintf(out, size, "EXIT");
+  case OP_00FE: return snprintf(out, size, "LOW");
+  case OP_00FF: return snprintf(out, size, "HIGH");
+  case OP_FX30: return snprintf(out, size, "LD HF, V%X", u.X);
+  case OP_FX75: return snprintf(out, size, "LD R, V%X", u.X);
+  case OP_FX85: return snprintf(out, size, "LD V%X, R", u.X);
+  case OP_00DN: return snprintf(out, size, "SCU %X", u.N);
+  case OP_5XY2: return snprintf(out, size, "LD [I], V%X-V%X", u.X, u.Y);
+  case OP_5XY3: return snprintf(out, size, "LD V%X-V%X, [I]", u.X, u.Y);
+  case OP_F000: return snprintf(out, size, "LD I, LONG");
+  case OP_FN01: return snprintf(out, size, "PLANE %X", u.X);
+  case OP_F002: return snprintf(out, size, "AUDIO");
+  case OP_FX3A: return snprintf(out, size, "PITCH V%X", u.X);
+  default:      return snprintf(out, size, "DW %04X", op);
+  }
+}
+
+/* The counts being sorted by sort_indices. */
+static const uint64_t *sort_counts;
+
+static int by_count(const void *a, const void *b)
+{
+  uint64_t ca = sort_counts[*(const uint16_t *) a];
+  uint64_t cb = sort_counts[*(const uint16_t *) b];
+  return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/* Fills indices with 0..n-1 sorted by decreasing count. */
+static void sort_indices(const uint64_t *counts, uint16_t *indices, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    indices[i] = i;
+  }
+  sort_counts = counts;
+  qsort(indices, n, sizeof(*indices), by_count);
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+  return total ? 100.0 * part / total : 0.0;
+}
+
+void chip8_profile_report(const struct chip8_profile *p, const chip8 *c8,
+                          FILE *f, size_t top)
+{
+  uint64_t total = 0;
+  for (size_t i = 0; i < OP_COUNT; ++i) {
+    total += p->ops[i];
+  }
+  fprintf(f, "profile: %" PRIu64 " instructions, %" PRIu64 " frames,"
+          " %.4f s in the engines\n", total, p->frames,
+          (double) p->run_ns / NS_PER_SEC);
+  if (!chip8_profile_available()) {
+    fprintf(f, "  (built without -DCHIP8_PROFILE, nothing was counted)\n");
+    return;
+  }
+
+  if (p->frames > 0) {
+    fprintf(f, "host time per frame: mean %.2f us, max %.2f us\n",
+            (double) (p->run_ns - p->frame_ns) / p->frames / 1000,
+            (double) p->max_frame_ns / 1000);
+    for (size_t b = 0; b < PROFILE_BUCKETS; ++b) {
+      if (p->frame_hist[b]) {
+        fprintf(f, "  %10.2f us and up %12" PRIu64 " %6.2f%%\n",
+                (double) (UINT64_C(1) << b) / 1000, p->frame_hist[b],
+                percent(p->frame_hist[b], p->frames));
+      }
+    }
+  }
+
+  uint16_t ops[OP_COUNT];
+  sort_indices(p->ops, ops, OP_COUNT);
+  fprintf(f, "instructions by kind:\n");
+  for (size_t i = 0; i < OP_COUNT && p->ops[ops[i]]; ++i) {
+    fprintf(f, "  %-7s %14" PRIu64 " %6.2f%%\n", op_names[ops[i]],
+            p->ops[ops[i]], percent(p->ops[ops[i]], total));
+  }
+
+  size_t npcs = sizeof(p->pcs) / sizeof(*p->pcs);
+  uint16_t *pcs = malloc(npcs * sizeof(*pcs));
+  if (!pcs) {
+    return;
+  }
+  sort_indices(p->pcs, pcs, npcs);
+  fprintf(f, "hottest addresses:\n");
+  for (size_t i = 0; i < top && i < npcs && p->pcs[pcs[i]]; ++i) {
+    uint16_t pc = pcs[i];
+    opcode op = (chip8_peek(c8, pc) << 8) | chip8_peek(c8, pc + 1);
+    char text[32];
+    chip8_disassemble(op, text, sizeof(text));
+    fprintf(f,
+            "  0x%04" PRIX16 " %14" PRIu64 " %6.2f%%  %04" PRIX16 "  %s\n",
+            pc, p->pcs[pc], percent(p->pcs[pc], total), op, text);
+  }
+  free(pcs);
+}
@@ -0,0 +1,39 @@
+#ifndef CHIP8_PROFILE_H
+#define CHIP8_PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "chip8.h"
+
+/* Counts the instructions a machine executes by kind and by address, and
+   the host time the engines spend on each 60 Hz frame of guest time, to
+   tell what a ROM spends its time on.
+
+   The counting is only compiled in when the core is built with
+   -DCHIP8_PROFILE (make profile). Otherwise the engines have no profiling
+   code at all, and a profile stays empty. While a profile is attached,
+   chip8_run_jit runs chip8_run_blocks instead, as translated code is not
+   instrumented. */
+
+/* Returns whether the core was built with -DCHIP8_PROFILE. */
+bool chip8_profile_available(void);
+
+/* Returns an empty profile, or NULL if out of memory. */
+struct chip8_profile *chip8_profile_new(void);
+void chip8_profile_free(struct chip8_profile *);
+/* Starts counting what a machine executes into the profile, or stops if it
+   is NULL. The profile is not owned by the machine. */
+void chip8_profile_attach(chip8 *, struct chip8_profile *);
+/* Writes the instruction kinds sorted by count, the frame times and the
+   given number of hottest addresses with their instructions, disassembled
+   from the current memory of the machine. */
+void chip8_profile_report(const struct chip8_profile *, const chip8 *,
+                          FILE *, size_t top);
+
+/* Writes the assembly of an instruction, in the syntax of Cowgod's
+   reference, and returns its length like snprintf. */
+int chip8_disassemble(opcode, char *, size_t);
+
+#endif
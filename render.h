@@ -0,0 +1,66 @@
+#ifndef CHIP8_RENDER_H
+#define CHIP8_RENDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/* The CPU side of drawing a frame, shared by the GLFW frontend and
+   chip8-bench: the dirty rows of each plane of the framebuffer are packed
+   into 32-bit words, the leftmost pixel in the MSB, for upload as a texture
+   holding the rows of the first plane and then those of the second. */
+
+/* Texture words per row, enough for high resolution */
+#define RENDER_WORDS (DISPLAY_HIRES_WIDTH / 32)
+
+/* The colors of pixels by the planes they are lit in, as RGB, those of the
+   fragment shader of the GLFW frontend. */
+static const uint8_t render_palette[4][3] = {
+  { 26, 26, 26 },
+  { 217, 217, 217 },
+  { 230, 140, 26 },
+  { 102, 102, 102 },
+};
+
+/* Rows start to start+count-1 are to be uploaded, in every plane. */
+struct render_run {
+  uint8_t start;
+  uint8_t count;
+};
+
+typedef uint32_t render_words[DISPLAY_PLANES][DISPLAY_HIRES_HEIGHT]
+                             [RENDER_WORDS];
+
+/* Packs the given dirty rows of the planes of a framebuffer of the given
+   height, laid out as chip8.gfx. Returns the number of runs of consecutive
+   dirty rows. */
+static inline size_t
+render_pack_rows(const uint64_t gfx[DISPLAY_PLANES][DISPLAY_HIRES_HEIGHT]
+                                   [DISPLAY_ROW_WORDS],
+                 size_t height, uint64_t dirty, render_words words,
+                 struct render_run runs[DISPLAY_HIRES_HEIGHT])
+{
+  size_t nruns = 0;
+  size_t y = 0;
+  while (y < height) {
+    if (!(dirty >> y & 1)) {
+      ++y;
+      continue;
+    }
+    size_t start = y;
+    for (; y < height && dirty >> y & 1; ++y) {
+      for (size_t p = 0; p < DISPLAY_PLANES; ++p) {
+        for (size_t i = 0; i < RENDER_WORDS; ++i) {
+          words[p][y][i] = gfx[p][y][i / 2] >> (i % 2 ? 0 : 32);
+        }
+      }
+    }
+    runs[nruns].start = start;
+    runs[nruns].count = y - start;
+    ++nruns;
+  }
+  return nruns;
+}
+
+#endif
@@ -0,0 +1,259 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rewind.h"
+#include "chip8_internal.h"
+
+/* The recorded part of the machine state, laid out without padding so that
+   it can be handled as an array of words. Memory comes last, so that only
+   the words up to the end of the memory of the mode are recorded. */
+struct state {
+  uint64_t cycles;
+  uint32_t cycles_per_tick;
+  uint32_t tick_cycles;
+  uint64_t rng;
+  uint64_t gfx[DISPLAY_PLANES][DISPLAY_HIRES_HEIGHT][DISPLAY_ROW_WORDS];
+  uint16_t stack[0x10];
+  uint16_t I;
+  uint16_t pc;
+  uint16_t sp;
+  uint8_t V[0x10];
+  uint8_t delay_timer;
+  uint8_t sound_timer;
+  uint8_t mode;
+  uint8_t hires;
+  uint8_t planes;
+  uint8_t pitch;
+  uint8_t flags[0x10];
+  uint8_t pattern[16];
+  uint8_t unused[4];
+  uint8_t memory[XOCHIP_MEMORY_SIZE];
+};
+
+#define STATE_WORDS (sizeof(struct state) / sizeof(uint64_t))
+
+typedef char state_memory_aligned[
+  offsetof(struct state, memory) % sizeof(uint64_t) == 0 ? 1 : -1];
+
+union state_words {
+  struct state s;
+  uint64_t words[STATE_WORDS];
+};
+
+/* The delta between a frame and the one before it. */
+struct entry {
+  size_t offset;
+  size_t len;
+};
+
+/* Frames first to last are recorded, and state holds frame pos. The delta
+   of frame f, f > first, is entries[f % max_frames]. Deltas are stored in
+   data in the order recorded, wrapping around to its start when they don't
+   fit at the end, so the oldest one follows the newest. */
+struct chip8_rewind {
+  uint8_t *data;
+  size_t max_bytes;
+  size_t bytes;
+  size_t head;  /* End of the newest delta in data */
+  struct entry *entries;
+  size_t max_frames;
+  size_t nwords;  /* Words of the state recorded, set by the first frame */
+  uint64_t first, last, pos;
+  bool empty;
+  union state_words *state;  /* Frame pos */
+  union state_words *next;   /* Frame being recorded */
+  union state_words buffers[2];
+  uint8_t encoded[CHIP8_DELTA_BOUND(STATE_WORDS)];
+};
+
+chip8_rewind *chip8_rewind_init(size_t max_bytes, size_t max_frames)
+{
+  chip8_rewind *r = calloc(1, sizeof(*r));
+  if (!r) {
+    return NULL;
+  }
+  r->max_bytes = max_bytes;
+  r->max_frames = max_frames < 2 ? 2 : max_frames;
+  r->data = malloc(max_bytes);
+  r->entries = calloc(r->max_frames, sizeof(*r->entries));
+  if (!r->data || !r->entries) {
+    chip8_rewind_free(r);
+    return NULL;
+  }
+  r->state = &r->buffers[0];
+  r->next = &r->buffers[1];
+  r->empty = true;
+  return r;
+}
+
+void chip8_rewind_free(chip8_rewind *r)
+{
+  free(r->data);
+  free(r->entries);
+  free(r);
+}
+
+static struct entry *entry(chip8_rewind *r, uint64_t frame)
+{
+  return &r->entries[frame % r->max_frames];
+}
+
+static void save(struct state *s, const chip8 *c8)
+{
+  s->cycles = c8->cycles;
+  s->cycles_per_tick = c8->cycles_per_tick;
+  s->tick_cycles = c8->tick_cycles;
+  s->rng = c8->rng;
+  chip8_copy_from_gfx(c8, &s->gfx[0][0][0]);
+  memcpy(s->memory, c8->memory, chip8_memory_size(c8));
+  s->mode = c8->mode;
+  s->hires = c8->hires;
+  s->planes = c8->planes;
+  s->pitch = c8->pitch;
+  memcpy(s->flags, c8->flags, sizeof(s->flags));
+  memcpy(s->pattern, c8->pattern, sizeof(s->pattern));
+  memcpy(s->stack, c8->stack, sizeof(s->stack));
+  s->I = c8->I;
+  s->pc = c8->pc;
+  s->sp = c8->sp;
+  memcpy(s->V, c8->V, sizeof(s->V));
+  s->delay_timer = c8->delay_timer;
+  s->sound_timer = c8->sound_timer;
+}
+
+static void load(chip8 *c8, const struct state *s)
+{
+  c8->cycles = s->cycles;
+  c8->cycles_per_tick = s->cycles_per_tick;
+  c8->tick_cycles = s->tick_cycles;
+  c8->rng = s->rng;
+  c8->hires = s->hires;
+  c8->planes = s->planes;
+  c8->pitch = s->pitch;
+  memcpy(c8->flags, s->flags, sizeof(c8->flags));
+  memcpy(c8->pattern, s->pattern, sizeof(c8->pattern));
+  chip8_copy_to_gfx(c8, &s->gfx[0][0][0]);
+  /* Pages left as they are keep their decoded code. */
+  for (size_t addr = 0; addr < chip8_memory_size(c8); addr += PAGE_SIZE) {
+    if (memcmp(&c8->memory[addr], &s->memory[addr], PAGE_SIZE) != 0) {
+      chip8_copy_to_memory(c8, addr, &s->memory[addr], PAGE_SIZE);
+    }
+  }
+  memcpy(c8->stack, s->stack, sizeof(c8->stack));
+  c8->I = s->I;
+  c8->pc = s->pc;
+  c8->sp = s->sp;
+  memcpy(c8->V, s->V, sizeof(c8->V));
+  c8->delay_timer = s->delay_timer;
+  c8->sound_timer = s->sound_timer;
+  c8->draw_flag = true;
+}
+
+static void drop_oldest(chip8_rewind *r)
+{
+  r->bytes -= entry(r, r->first + 1)->len;
+  ++r->first;
+}
+
+/* Makes room for a delta of len bytes at head, dropping the oldest deltas
+   in the way. */
+static void make_room(chip8_rewind *r, size_t len)
+{
+  while (r->last - r->first + 1 >= r->max_frames) {
+    drop_oldest(r);
+  }
+  if (r->head + len > r->max_bytes) {
+    /* The deltas after head are the oldest ones. */
+    while (r->last > r->first && entry(r, r->first + 1)->offset >= r->head) {
+      drop_oldest(r);
+    }
+    r->head = 0;
+  }
+  while (r->last > r->first && entry(r, r->first + 1)->offset >= r->head
+         && entry(r, r->first + 1)->offset < r->head + len) {
+    drop_oldest(r);
+  }
+}
+
+bool chip8_rewind_record(chip8_rewind *r, const chip8 *c8)
+{
+  save(&r->next->s, c8);
+  if (r->empty) {
+    r->nwords = (offsetof(struct state, memory) + chip8_memory_size(c8))
+                / sizeof(uint64_t);
+    *r->state = *r->next;
+    r->first = r->last = r->pos = 0;
+    r->empty = false;
+    return true;
+  }
+
+  /* Recording after seeking back drops the frames that were ahead. */
+  while (r->last > r->pos) {
+    r->bytes -= entry(r, r->last)->len;
+    --r->last;
+  }
+  if (r->last > r->first) {
+    r->head = entry(r, r->last)->offset + entry(r, r->last)->len;
+  } else {
+    r->head = 0;
+  }
+
+  size_t len = chip8_delta_encode(r->state->words, r->next->words,
+                                  r->nwords, r->encoded);
+  if (len > r->max_bytes) {
+    return false;
+  }
+  make_room(r, len);
+  struct entry *e = entry(r, r->last + 1);
+  e->offset = r->head;
+  e->len = len;
+  memcpy(&r->data[e->offset], r->encoded, len);
+  r->head += len;
+  r->bytes += len;
+  union state_words *recorded = r->next;
+  r->next = r->state;
+  r->state = recorded;
+  r->pos = ++r->last;
+  return true;
+}
+
+size_t chip8_rewind_behind(const chip8_rewind *r)
+{
+  return r->pos - r->first;
+}
+
+size_t chip8_rewind_ahead(const chip8_rewind *r)
+{
+  return r->last - r->pos;
+}
+
+size_t chip8_rewind_bytes(const chip8_rewind *r)
+{
+  return r->bytes;
+}
+
+bool chip8_rewind_seek(chip8_rewind *r, chip8 *c8, long frames)
+{
+  if (r->empty || (frames < 0 && (size_t) -frames > chip8_rewind_behind(r))
+      || (frames > 0 && (size_t) frames > chip8_rewind_ahead(r))) {
+    return false;
+  }
+  /* Every frame is in the mode of the first. */
+  if (!chip8_switch_mode(c8, r->state->s.mode)) {
+    return false;
+  }
+  uint64_t target = r->pos + frames;
+  for (; r->pos > target; --r->pos) {
+    struct entry *e = entry(r, r->pos);
+    chip8_delta_apply(r->state->words, r->nwords, &r->data[e->offset],
+                      e->len);
+  }
+  for (; r->pos < target; ++r->pos) {
+    struct entry *e = entry(r, r->pos + 1);
+    chip8_delta_apply(r->state->words, r->nwords, &r->data[e->offset],
+                      e->len);
+  }
+  load(c8, &r->state->s);
+  return true;
+}
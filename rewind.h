@@ -0,0 +1,39 @@
+#ifndef CHIP8_REWIND_H
+#define CHIP8_REWIND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "chip8.h"
+
+/* History of recent frames for rewinding. The frontends record the state
+   after every frame, each frame being stored as the XOR of its state with
+   that of the frame before, run-length encoded. The oldest frames are
+   dropped to stay within the given number of bytes and frames.
+
+   Key state is input and not part of the history. */
+typedef struct chip8_rewind chip8_rewind;
+
+/* History size used by the frontends: ten minutes at 60 Hz, which typically
+   takes 1-3 MB. */
+#define REWIND_BYTES (4 << 20)
+#define REWIND_FRAMES (60 * 60 * 10)
+
+chip8_rewind *chip8_rewind_init(size_t max_bytes, size_t max_frames);
+void chip8_rewind_free(chip8_rewind *);
+/* Records the state of the machine as the frame after the current one,
+   dropping any frames after the current one left by seeking back. Returns
+   false if the frame is too large for the history. */
+bool chip8_rewind_record(chip8_rewind *, const chip8 *);
+/* Number of frames recorded before and after the current one. */
+size_t chip8_rewind_behind(const chip8_rewind *);
+size_t chip8_rewind_ahead(const chip8_rewind *);
+/* Moves the given number of frames back (negative) or forward (positive),
+   and sets the machine to that frame. Returns false, without changing
+   anything, if there are not that many frames recorded or if out of
+   memory. */
+bool chip8_rewind_seek(chip8_rewind *, chip8 *, long frames);
+/* Bytes used by the recorded frames. */
+size_t chip8_rewind_bytes(const chip8_rewind *);
+
+#endif
@@ -0,0 +1,65 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <time.h>
+
+#include "sched.h"
+
+#define NS_PER_SEC 1000000000L
+
+/* Falling further behind than this, for example while waiting for a key
+   press, restarts the pacing from now instead of running to catch up. */
+#define MAX_LAG_NS (NS_PER_SEC / 10)
+
+void chip8_sched_init(struct chip8_sched *s, enum chip8_pace pace,
+                      unsigned factor)
+{
+  s->pace = pace;
+  s->factor = factor ? factor : 1;
+  s->started = false;
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* Sleeps until the end of the frame that just ended. */
+static void wait_for_frame(struct chip8_sched *s)
+{
+  uint64_t now = now_ns();
+  unsigned factor = s->pace == CHIP8_PACE_FAST_FORWARD ? s->factor : 1;
+  if (!s->started || now > s->deadline + MAX_LAG_NS) {
+    s->deadline = now;
+    s->started = true;
+  }
+  s->deadline += NS_PER_SEC / CHIP8_TIMER_HZ / factor;
+  struct timespec ts = {
+    .tv_sec = s->deadline / NS_PER_SEC,
+    .tv_nsec = s->deadline % NS_PER_SEC
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+         == EINTR) {
+  }
+}
+
+uint64_t chip8_sched_run(struct chip8_sched *s, chip8 *c8, chip8_run_fun run,
+                         uint64_t ncycles)
+{
+  uint64_t to_tick = c8->cycles_per_tick - c8->tick_cycles;
+  if (ncycles > to_tick) {
+    ncycles = to_tick;
+  }
+  uint64_t n = run(c8, ncycles);
+  if (c8->halted && n < ncycles) {
+    /* Nothing to do until a key is pressed: skip to the end of the frame. */
+    chip8_idle(c8, ncycles - n);
+    n = ncycles;
+  }
+  if (n > 0 && c8->tick_cycles == 0 && s->pace != CHIP8_PACE_TURBO) {
+    wait_for_frame(s);
+  }
+  return n;
+}
@@ -0,0 +1,33 @@
+#ifndef CHIP8_SCHED_H
+#define CHIP8_SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/* How guest time maps to wall-clock time. Guest time itself is counted in
+   instructions, so the timers and thus the game behave the same in every
+   mode. */
+enum chip8_pace {
+  CHIP8_PACE_FIXED,         /* The CPU rate of the machine, in real time */
+  CHIP8_PACE_TURBO,         /* As fast as the host can */
+  CHIP8_PACE_FAST_FORWARD,  /* A multiple of the CPU rate */
+};
+
+struct chip8_sched {
+  enum chip8_pace pace;
+  unsigned factor;           /* For CHIP8_PACE_FAST_FORWARD */
+  uint64_t deadline;  /* When the current frame is due, in ns */
+  bool started;
+};
+
+void chip8_sched_init(struct chip8_sched *, enum chip8_pace, unsigned factor);
+/* Runs up to the given number of instructions, stopping at the next 60 Hz
+   timer tick. A machine halted waiting for a key idles until then. Once a
+   tick is reached, waits until it is due in wall-clock time. Returns the
+   number of instructions executed or idled. */
+uint64_t chip8_sched_run(struct chip8_sched *, chip8 *, chip8_run_fun,
+                         uint64_t);
+
+#endif
@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "chip8_internal.h"
+
+/* Snapshots are sized by the mode of the machine: a CHIP-8 one keeps 16
+   pages and the first word of 32 rows, in a few hundred bytes. */
+struct chip8_snapshot {
+  size_t npages;  /* Pages of memory in the mode of the machine */
+  uint64_t *gfx;  /* The words of the rows of the mode, after pages */
+  uint8_t mode;
+  bool hires;
+  uint8_t planes;
+  uint8_t flags[0x10];
+  uint8_t pitch;
+  uint8_t pattern[16];
+  uint64_t cycles;
+  uint32_t cycles_per_tick;
+  uint32_t tick_cycles;
+  uint64_t rng;
+  uint16_t I;
+  uint16_t pc;
+  uint16_t stack[0x10];
+  uint16_t sp;
+  uint8_t V[0x10];
+  uint8_t delay_timer;
+  uint8_t sound_timer;
+  bool draw_flag;
+  bool halted;
+  bool key[0x10];
+  struct chip8_page *pages[];
+};
+
+/* Words kept of each row of the framebuffer: CHIP-8 mode only has the low
+   resolution, which draws to the first word. */
+static size_t row_words(uint8_t mode)
+{
+  return mode == CHIP8_MODE_CHIP8 ? 1 : DISPLAY_ROW_WORDS;
+}
+
+/* Pages may be shared by snapshots used from different threads. */
+static struct chip8_page *page_ref(struct chip8_page *p)
+{
+  __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+  return p;
+}
+
+static void page_unref(struct chip8_page *p)
+{
+  if (p && __atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(p);
+  }
+}
+
+void chip8_pages_free(struct chip8_pages *pages)
+{
+  for (size_t p = 0; p < NPAGES; ++p) {
+    page_unref(pages->pages[p]);
+  }
+  free(pages);
+}
+
+static struct chip8_pages *pages_of(chip8 *c8)
+{
+  if (!c8->pages) {
+    c8->pages = calloc(1, sizeof(*c8->pages));
+  }
+  return c8->pages;
+}
+
+struct chip8_snapshot *chip8_snapshot(chip8 *c8)
+{
+  struct chip8_pages *pages = pages_of(c8);
+  size_t npages = chip8_memory_size(c8) >> PAGE_SHIFT;
+  size_t nwords = chip8_gfx_rows(c8) * row_words(c8->mode);
+  struct chip8_snapshot *s = malloc(sizeof(*s) + npages * sizeof(*s->pages)
+                                    + nwords * sizeof(*s->gfx));
+  if (!pages || !s) {
+    free(s);
+    return NULL;
+  }
+
+  /* Pages written since the last snapshot or restore are copied, the others
+     are shared with it. */
+  s->npages = npages;
+  s->gfx = (uint64_t *) &s->pages[npages];
+  for (size_t p = 0; p < s->npages; ++p) {
+    if (chip8_page_dirty(c8, p) || !pages->pages[p]) {
+      struct chip8_page *page = malloc(sizeof(*page));
+      if (!page) {
+        while (p-- > 0) {
+          page_unref(s->pages[p]);
+        }
+        free(s);
+        return NULL;
+      }
+      page->refs = 1;
+      memcpy(page->data, &c8->memory[p << PAGE_SHIFT], PAGE_SIZE);
+      page_unref(pages->pages[p]);
+      pages->pages[p] = page;
+      c8->dirty_pages[p / 64] &= ~(UINT64_C(1) << (p % 64));
+    }
+    s->pages[p] = page_ref(pages->pages[p]);
+  }
+
+  size_t w = row_words(c8->mode);
+  for (size_t r = 0; r < chip8_gfx_rows(c8); ++r) {
+    memcpy(&s->gfx[r * w], c8->gfx[r / DISPLAY_HIRES_HEIGHT]
+                                  [r % DISPLAY_HIRES_HEIGHT],
+           w * sizeof(*s->gfx));
+  }
+  s->mode = c8->mode;
+  s->hires = c8->hires;
+  s->planes = c8->planes;
+  memcpy(s->flags, c8->flags, sizeof(s->flags));
+  s->pitch = c8->pitch;
+  memcpy(s->pattern, c8->pattern, sizeof(s->pattern));
+  s->cycles = c8->cycles;
+  s->cycles_per_tick = c8->cycles_per_tick;
+  s->tick_cycles = c8->tick_cycles;
+  s->rng = c8->rng;
+  s->I = c8->I;
+  s->pc = c8->pc;
+  memcpy(s->stack, c8->stack, sizeof(s->stack));
+  s->sp = c8->sp;
+  memcpy(s->V, c8->V, sizeof(s->V));
+  s->delay_timer = c8->delay_timer;
+  s->sound_timer = c8->sound_timer;
+  s->draw_flag = c8->draw_flag;
+  s->halted = c8->halted;
+  memcpy(s->key, c8->key, sizeof(s->key));
+  return s;
+}
+
+bool chip8_restore(chip8 *c8, const struct chip8_snapshot *s)
+{
+  struct chip8_pages *pages = pages_of(c8);
+  /* Set first, so that the pages wrap at the memory of the mode of the
+     snapshot. */
+  if (!pages || !chip8_switch_mode(c8, s->mode)) {
+    return false;
+  }
+
+  /* Only pages that differ from the snapshot are copied. */
+  for (size_t p = 0; p < s->npages; ++p) {
+    if (chip8_page_dirty(c8, p) || pages->pages[p] != s->pages[p]) {
+      chip8_copy_to_memory(c8, p << PAGE_SHIFT, s->pages[p]->data,
+                           PAGE_SIZE);
+      page_unref(pages->pages[p]);
+      pages->pages[p] = page_ref(s->pages[p]);
+    }
+    c8->dirty_pages[p / 64] &= ~(UINT64_C(1) << (p % 64));
+  }
+
+  uint64_t gfx[DISPLAY_PLANES][DISPLAY_HIRES_HEIGHT][DISPLAY_ROW_WORDS] = {0};
+  size_t w = row_words(s->mode);
+  for (size_t r = 0; r < chip8_gfx_rows(c8); ++r) {
+    memcpy(gfx[r / DISPLAY_HIRES_HEIGHT][r % DISPLAY_HIRES_HEIGHT],
+           &s->gfx[r * w], w * sizeof(*s->gfx));
+  }
+  chip8_copy_to_gfx(c8, &gfx[0][0][0]);
+  c8->hires = s->hires;
+  c8->planes = s->planes;
+  memcpy(c8->flags, s->flags, sizeof(c8->flags));
+  c8->pitch = s->pitch;
+  memcpy(c8->pattern, s->pattern, sizeof(c8->pattern));
+  c8->cycles = s->cycles;
+  c8->cycles_per_tick = s->cycles_per_tick;
+  c8->tick_cycles = s->tick_cycles;
+  c8->rng = s->rng;
+  c8->I = s->I;
+  c8->pc = s->pc;
+  memcpy(c8->stack, s->stack, sizeof(c8->stack));
+  c8->sp = s->sp;
+  memcpy(c8->V, s->V, sizeof(c8->V));
+  c8->delay_timer = s->delay_timer;
+  c8->sound_timer = s->sound_timer;
+  c8->draw_flag = s->draw_flag;
+  c8->halted = s->halted;
+  memcpy(c8->key, s->key, sizeof(c8->key));
+  return true;
+}
+
+void chip8_snapshot_free(struct chip8_snapshot *s)
+{
+  for (size_t p = 0; p < s->npages; ++p) {
+    page_unref(s->pages[p]);
+  }
+  free(s);
+}
+
+chip8 *chip8_fork(chip8 *c8)
+{
+  struct chip8_snapshot *s = chip8_snapshot(c8);
+  chip8 *fork = chip8_init();
+  if (!s || !fork || !chip8_restore(fork, s)) {
+    if (s) {
+      chip8_snapshot_free(s);
+    }
+    if (fork) {
+      chip8_destroy(fork);
+    }
+    return NULL;
+  }
+  chip8_snapshot_free(s);
+  return fork;
+}
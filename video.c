@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8_internal.h"
+#include "video.h"
+
+#define VIDEO_MAGIC "C8VD"
+#define VIDEO_VERSION 1
+#define NWORDS (DISPLAY_PLANES * DISPLAY_HIRES_HEIGHT * DISPLAY_ROW_WORDS)
+
+enum record {
+  RECORD_SAME,
+  RECORD_LORES,
+  RECORD_HIRES,
+};
+
+struct chip8_video {
+  FILE *f;
+  bool writing;
+  uint8_t mode;
+  struct chip8_frame frame;  /* The last frame written or read */
+  uint64_t frames;           /* Frames written or read */
+  uint64_t same;  /* Frames equal to the last one left to write or read */
+  bool complete;
+  uint8_t delta[CHIP8_DELTA_BOUND(NWORDS)];
+};
+
+static void put_varint(FILE *f, uint64_t v)
+{
+  while (v >= 0x80) {
+    fputc((v & 0x7F) | 0x80, f);
+    v >>= 7;
+  }
+  fputc(v, f);
+}
+
+static bool get_varint(FILE *f, uint64_t *v)
+{
+  *v = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    int c = fgetc(f);
+    if (c == EOF) {
+      return false;
+    }
+    *v |= (uint64_t) (c & 0x7F) << shift;
+    if (!(c & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+chip8_video *chip8_video_create(const char *path, enum chip8_mode mode)
+{
+  chip8_video *v = calloc(1, sizeof(*v));
+  if (!v) {
+    return NULL;
+  }
+  if (!(v->f = fopen(path, "wb"))) {
+    free(v);
+    return NULL;
+  }
+  v->writing = true;
+  v->mode = mode;
+  fputs(VIDEO_MAGIC, v->f);
+  fputc(VIDEO_VERSION, v->f);
+  fputc(mode, v->f);
+  return v;
+}
+
+static void write_same(chip8_video *v)
+{
+  if (v->same > 0) {
+    fputc(RECORD_SAME, v->f);
+    put_varint(v->f, v->same);
+    v->same = 0;
+  }
+}
+
+bool chip8_video_frame(chip8_video *v, chip8 *c8)
+{
+  /* Only rows marked dirty can differ from the frame before. */
+  bool first = v->frames++ == 0;
+  uint64_t gfx[DISPLAY_PLANES][DISPLAY_HIRES_HEIGHT][DISPLAY_ROW_WORDS];
+  size_t n = 0;
+  if (first || c8->dirty_rows) {
+    chip8_copy_from_gfx(c8, gfx[0][0]);
+    n = chip8_delta_encode(v->frame.gfx[0][0], gfx[0][0], NWORDS, v->delta);
+  }
+  c8->dirty_rows = 0;
+  if (!first && n == 0 && c8->hires == v->frame.hires) {
+    ++v->same;
+    return true;
+  }
+  write_same(v);
+  fputc(c8->hires ? RECORD_HIRES : RECORD_LORES, v->f);
+  put_varint(v->f, n);
+  fwrite(v->delta, 1, n, v->f);
+  if (n > 0) {
+    memcpy(v->frame.gfx, gfx, sizeof(v->frame.gfx));
+  }
+  v->frame.hires = c8->hires;
+  return !ferror(v->f);
+}
+
+bool chip8_video_close(chip8_video *v)
+{
+  bool ok = true;
+  if (v->writing) {
+    write_same(v);
+    ok = !ferror(v->f);
+  }
+  ok &= fclose(v->f) == 0;
+  free(v);
+  return ok;
+}
+
+chip8_video *chip8_video_open(const char *path)
+{
+  chip8_video *v = calloc(1, sizeof(*v));
+  if (!v) {
+    return NULL;
+  }
+  if (!(v->f = fopen(path, "rb"))) {
+    free(v);
+    return NULL;
+  }
+  char magic[sizeof(VIDEO_MAGIC) - 1];
+  int mode;
+  if (fread(magic, sizeof(magic), 1, v->f) != 1
+      || memcmp(magic, VIDEO_MAGIC, sizeof(magic)) != 0
+      || fgetc(v->f) != VIDEO_VERSION
+      || (mode = fgetc(v->f)) < 0 || mode > CHIP8_MODE_XOCHIP) {
+    chip8_video_close(v);
+    return NULL;
+  }
+  v->mode = mode;
+  return v;
+}
+
+enum chip8_mode chip8_video_mode(const chip8_video *v)
+{
+  return v->mode;
+}
+
+/* Returns the rows that differ between two framebuffers. */
+static uint64_t changed_rows(const struct chip8_frame *a,
+                             uint64_t gfx[DISPLAY_PLANES]
+                                         [DISPLAY_HIRES_HEIGHT]
+                                         [DISPLAY_ROW_WORDS])
+{
+  uint64_t rows = 0;
+  for (size_t p = 0; p < DISPLAY_PLANES; ++p) {
+    for (size_t y = 0; y < DISPLAY_HIRES_HEIGHT; ++y) {
+      if (memcmp(a->gfx[p][y], gfx[p][y], sizeof(a->gfx[p][y])) != 0) {
+        rows |= UINT64_C(1) << y;
+      }
+    }
+  }
+  return rows;
+}
+
+const struct chip8_frame *chip8_video_read(chip8_video *v)
+{
+  v->frame.dirty_rows = 0;
+  if (v->same == 0) {
+    int record = fgetc(v->f);
+    uint64_t n;
+    if (record == EOF) {
+      v->complete = !ferror(v->f);
+      return NULL;
+    }
+    if (record == RECORD_SAME) {
+      if (v->frames == 0 || !get_varint(v->f, &v->same) || v->same == 0) {
+        return NULL;
+      }
+    } else if (record == RECORD_LORES || record == RECORD_HIRES) {
+      uint64_t gfx[DISPLAY_PLANES][DISPLAY_HIRES_HEIGHT][DISPLAY_ROW_WORDS];
+      memcpy(gfx, v->frame.gfx, sizeof(gfx));
+      if (!get_varint(v->f, &n) || n > sizeof(v->delta)
+          || fread(v->delta, 1, n, v->f) != n
+          || !chip8_delta_apply(gfx[0][0], NWORDS, v->delta, n)) {
+        return NULL;
+      }
+      bool hires = record == RECORD_HIRES;
+      v->frame.dirty_rows = v->frames == 0 || hires != v->frame.hires
+                            ? CHIP8_ALL_ROWS : changed_rows(&v->frame, gfx);
+      memcpy(v->frame.gfx, gfx, sizeof(gfx));
+      v->frame.hires = hires;
+      ++v->same;
+    } else {
+      return NULL;
+    }
+  }
+  --v->same;
+  v->frame.seq = v->frames++;
+  return &v->frame;
+}
+
+bool chip8_video_complete(const chip8_video *v)
+{
+  return v->complete;
+}
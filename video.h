@@ -0,0 +1,46 @@
+#ifndef CHIP8_VIDEO_H
+#define CHIP8_VIDEO_H
+
+#include <stdbool.h>
+
+#include "chip8.h"
+#include "frames.h"
+
+/* A recording of the frames of a run, one per 60 Hz tick, written as it
+   goes at little cost per frame. Each frame is stored as the XOR of its
+   framebuffer with the frame before, with runs of unchanged words left out,
+   and runs of unchanged frames as a count, so that a minute of a game
+   typically takes a few KB. chip8-video converts videos to Y4M or PNG.
+
+   The file starts with the magic "C8VD", a version byte and a byte holding
+   the enum chip8_mode, followed by records. A record is a byte: 0 for a
+   varint count of frames equal to the frame before, or 1 or 2 for a frame in
+   low or high resolution, followed by the varint size and the bytes of its
+   delta from the frame before, as written by chip8_delta_encode over the
+   words of chip8.gfx in the byte order of the host. The first frame is a
+   delta from a blank framebuffer. */
+typedef struct chip8_video chip8_video;
+
+/* Creates a video of machines in the given mode. Returns NULL if the file
+   could not be created or out of memory. */
+chip8_video *chip8_video_create(const char *path, enum chip8_mode);
+/* Appends the framebuffer of the machine as the next frame, and clears
+   dirty_rows: the video takes the place of a frontend drawing the frames.
+   Returns false if it could not be written. */
+bool chip8_video_frame(chip8_video *, chip8 *);
+/* Closes a video, writing the frames left if it was created. Returns false
+   if it could not be written. */
+bool chip8_video_close(chip8_video *);
+
+/* Opens a video for reading, returning NULL if it could not be read. */
+chip8_video *chip8_video_open(const char *path);
+enum chip8_mode chip8_video_mode(const chip8_video *);
+/* Returns the next frame, valid until the next call, or NULL at the end of
+   the video or if it is malformed. dirty_rows has the rows that changed and
+   seq the number of the frame. */
+const struct chip8_frame *chip8_video_read(chip8_video *);
+/* Returns whether chip8_video_read stopped at the end of a whole video
+   rather than on malformed data. */
+bool chip8_video_complete(const chip8_video *);
+
+#endif
@@ -0,0 +1,286 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "render.h"
+#include "video.h"
+
+/* PNG frames are written as prefix000000.png, prefix000001.png, ... */
+#define PNG_NAME_MAX 4096
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s [-f format] [-s scale] video output\n"
+    "  -f format  y4m (default) to write all frames to one file, - for\n"
+    "             stdout, or png to write each to output000000.png, ...\n"
+    "  -s scale   Pixels of output per pixel of high resolution (default\n"
+    "             4), twice that in CHIP-8 mode and in low resolution\n",
+    prog);
+  exit(EXIT_FAILURE);
+}
+
+/* An image in the colors of render_palette, one byte per pixel. */
+struct image {
+  unsigned width, height;
+  uint8_t *pixels;
+};
+
+/* Draws a frame scaled to the image, which is the size of the largest
+   resolution of the mode. */
+static void paint(struct image *img, const struct chip8_frame *frame)
+{
+  unsigned width = frame->hires ? DISPLAY_HIRES_WIDTH : DISPLAY_WIDTH;
+  unsigned height = frame->hires ? DISPLAY_HIRES_HEIGHT : DISPLAY_HEIGHT;
+  unsigned scale = img->width / width;
+  for (unsigned y = 0; y < height; ++y) {
+    if (!(frame->dirty_rows >> y & 1)) {
+      continue;
+    }
+    uint8_t *row = &img->pixels[(size_t) y * scale * img->width];
+    for (unsigned x = 0; x < width; ++x) {
+      unsigned color = 0;
+      for (unsigned p = 0; p < DISPLAY_PLANES; ++p) {
+        color |= ((frame->gfx[p][y][x / 64] >> (63 - x % 64)) & 1) << p;
+      }
+      memset(&row[x * scale], color, scale);
+    }
+    for (unsigned i = 1; i < scale; ++i) {
+      memcpy(&row[(size_t) i * img->width], row, img->width);
+    }
+  }
+}
+
+/* Writes a frame of a YUV4MPEG2 stream with 4:4:4 sampling. */
+static bool write_y4m(FILE *f, const struct image *img)
+{
+  uint8_t yuv[4][3];
+  for (int c = 0; c < 4; ++c) {
+    double r = render_palette[c][0];
+    double g = render_palette[c][1];
+    double b = render_palette[c][2];
+    yuv[c][0] = 16 + (65.738 * r + 129.057 * g + 25.064 * b) / 256;
+    yuv[c][1] = 128 + (-37.945 * r - 74.494 * g + 112.439 * b) / 256;
+    yuv[c][2] = 128 + (112.439 * r - 94.154 * g - 18.285 * b) / 256;
+  }
+  size_t n = (size_t) img->width * img->height;
+  uint8_t *plane = malloc(n);
+  if (!plane) {
+    return false;
+  }
+  fputs("FRAME\n", f);
+  for (int c = 0; c < 3; ++c) {
+    for (size_t i = 0; i < n; ++i) {
+      plane[i] = yuv[img->pixels[i]][c];
+    }
+    fwrite(plane, 1, n, f);
+  }
+  free(plane);
+  return !ferror(f);
+}
+
+static uint32_t crc_table[256];
+
+static void build_crc_table(void)
+{
+  for (uint32_t n = 0; n < 256; ++n) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; ++k) {
+      c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    }
+    crc_table[n] = c;
+  }
+}
+
+static uint32_t crc(uint32_t c, const uint8_t *data, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    c = crc_table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+  }
+  return c;
+}
+
+static void put_be(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static void write_chunk(FILE *f, const char *type, const uint8_t *data,
+                        size_t n)
+{
+  uint8_t word[4];
+  put_be(word, n);
+  fwrite(word, 1, 4, f);
+  fwrite(type, 1, 4, f);
+  fwrite(data, 1, n, f);
+  uint32_t c = crc(0xFFFFFFFF, (const uint8_t *) type, 4);
+  put_be(word, crc(c, data, n) ^ 0xFFFFFFFF);
+  fwrite(word, 1, 4, f);
+}
+
+/* Writes an 8-bit palette PNG. Its image data is a zlib stream of stored
+   deflate blocks: the frames are left for PNG optimizers to compress. */
+static bool write_png(const char *path, const struct image *img)
+{
+  size_t stride = 1 + (size_t) img->width;
+  size_t raw = stride * img->height;
+  size_t blocks = (raw + 0xFFFE) / 0xFFFF;
+  size_t size = 2 + raw + 5 * (blocks ? blocks : 1) + 4;
+  uint8_t *z = malloc(size);
+  FILE *f = z ? fopen(path, "wb") : NULL;
+  if (!f) {
+    free(z);
+    return false;
+  }
+
+  /* Each row starts with filter type 0 (none). */
+  uint8_t *p = z;
+  *p++ = 0x78;
+  *p++ = 0x01;
+  uint32_t a = 1, b = 0;
+  size_t left = raw;
+  size_t y = 0, x = 0;
+  do {
+    size_t len = left < 0xFFFF ? left : 0xFFFF;
+    left -= len;
+    *p++ = left == 0;
+    *p++ = len & 0xFF;
+    *p++ = len >> 8;
+    *p++ = ~len & 0xFF;
+    *p++ = (~len >> 8) & 0xFF;
+    for (size_t i = 0; i < len; ++i) {
+      uint8_t byte = x == 0 ? 0 : img->pixels[y * img->width + x - 1];
+      if (++x == stride) {
+        x = 0;
+        ++y;
+      }
+      *p++ = byte;
+      a = (a + byte) % 65521;
+      b = (b + a) % 65521;
+    }
+  } while (left > 0);
+  put_be(p, b << 16 | a);
+  p += 4;
+
+  static const uint8_t signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+  fwrite(signature, 1, sizeof(signature), f);
+  uint8_t ihdr[13];
+  put_be(ihdr, img->width);
+  put_be(ihdr + 4, img->height);
+  ihdr[8] = 8;   /* Bits per pixel */
+  ihdr[9] = 3;   /* Palette */
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+  write_chunk(f, "IHDR", ihdr, sizeof(ihdr));
+  write_chunk(f, "PLTE", &render_palette[0][0], sizeof(render_palette));
+  write_chunk(f, "IDAT", z, p - z);
+  write_chunk(f, "IEND", NULL, 0);
+  free(z);
+  bool ok = !ferror(f);
+  return fclose(f) == 0 && ok;
+}
+
+int main(int argc, char **argv)
+{
+  bool png = false;
+  unsigned long scale = 4;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "f:s:")) != -1) {
+    switch (opt) {
+    case 'f':
+      if (strcmp(optarg, "y4m") == 0) {
+        png = false;
+      } else if (strcmp(optarg, "png") == 0) {
+        png = true;
+      } else {
+        usage(argv[0]);
+      }
+      break;
+    case 's':
+      scale = strtoul(optarg, NULL, 10);
+      if (scale == 0 || scale > 64) {
+        usage(argv[0]);
+      }
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv[0]);
+  }
+  const char *input = argv[optind];
+  const char *output = argv[optind + 1];
+
+  chip8_video *v = chip8_video_open(input);
+  if (!v) {
+    fprintf(stderr, "%s: could not read video\n", input);
+    return EXIT_FAILURE;
+  }
+  /* CHIP-8 mode only has the low resolution. */
+  if (chip8_video_mode(v) == CHIP8_MODE_CHIP8) {
+    scale *= 2;
+  }
+  struct image img = {
+    .width = DISPLAY_HIRES_WIDTH * scale,
+    .height = DISPLAY_HIRES_HEIGHT * scale,
+  };
+  if (chip8_video_mode(v) == CHIP8_MODE_CHIP8) {
+    img.width /= 2;
+    img.height /= 2;
+  }
+  img.pixels = calloc((size_t) img.width, img.height);
+  FILE *y4m = NULL;
+  if (!png) {
+    y4m = strcmp(output, "-") == 0 ? stdout : fopen(output, "wb");
+    if (y4m) {
+      fprintf(y4m, "YUV4MPEG2 W%u H%u F%d:1 Ip A1:1 C444\n",
+              img.width, img.height, CHIP8_TIMER_HZ);
+    }
+  }
+  build_crc_table();
+
+  int status = EXIT_FAILURE;
+  if (!img.pixels || (!png && !y4m)) {
+    fprintf(stderr, "%s: could not create output\n", output);
+    goto done;
+  }
+  const struct chip8_frame *frame;
+  while ((frame = chip8_video_read(v))) {
+    paint(&img, frame);
+    bool ok;
+    if (png) {
+      char path[PNG_NAME_MAX];
+      snprintf(path, sizeof(path), "%s%06" PRIu64 ".png", output,
+               frame->seq);
+      ok = write_png(path, &img);
+    } else {
+      ok = write_y4m(y4m, &img);
+    }
+    if (!ok) {
+      fprintf(stderr, "%s: could not write frame %" PRIu64 "\n", output,
+              frame->seq);
+      goto done;
+    }
+  }
+  if (!chip8_video_complete(v)) {
+    fprintf(stderr, "%s: malformed video\n", input);
+    goto done;
+  }
+  status = EXIT_SUCCESS;
+
+done:
+  if (y4m && y4m != stdout && fclose(y4m) != 0) {
+    status = EXIT_FAILURE;
+  }
+  free(img.pixels);
+  chip8_video_close(v);
+  return status;
+}